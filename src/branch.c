@@ -0,0 +1,329 @@
+/*
+*  C Implementation: branch
+*
+* Description: Branch backends
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+*
+* Details:
+*	All accesses to a branch go through its struct branch_ops, so a
+*	branch does not need to be a directory. Directories are served by
+*	dir_ops below, which simply do the system calls on the path within
+*	the branch. Image files (see image.c) are served from memory and are
+*	always read-only, memory branches (see memfs.c) keep a whole
+*	rw-branch within the daemon.
+*/
+
+#if defined __linux__
+	// For pread()/pwrite()/utimensat()
+	#define _XOPEN_SOURCE 700
+	#define _DEFAULT_SOURCE 1
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/time.h>
+
+#include "conf.h"
+#include "unionfs.h"
+#include "opts.h"
+#include "debug.h"
+#include "usyslog.h"
+#include "string.h"
+#include "image.h"
+#include "memfs.h"
+#include "index.h"
+#include "uioctl.h"
+#include "branch.h"
+
+#define DROP_BEHIND_START (4 << 20)	// sequential bytes before a read counts as stream
+#define DROP_BEHIND_CHUNK (1 << 20)	// the page cache is dropped in steps of this
+
+static uint64_t dropped_bytes;
+
+/**
+ * Build the path of path within branch into p
+ */
+static int dir_path(char *p, int branch, const char *path) {
+	if (BUILD_PATH(p, uopt.branches[branch].path, path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	return 0;
+}
+
+static int dir_lstat(int branch, const char *path, struct stat *stbuf) {
+	char p[PATHLEN_MAX];
+	if (dir_path(p, branch, path)) return -1;
+
+	return lstat(p, stbuf);
+}
+
+static int dir_open(int branch, const char *path, int flags, mode_t mode, branch_file_t *file) {
+	char p[PATHLEN_MAX];
+	if (dir_path(p, branch, path)) return -1;
+
+	int fd = open(p, flags, mode);
+	if (fd == -1) return -1;
+
+	file->branch = branch;
+	file->fd = fd;
+	file->data = NULL;
+	file->size = 0;
+	file->priv = NULL;
+	file->seq_start = 0;
+	file->seq_next = 0;
+	file->seq_dropped = 0;
+
+	return 0;
+}
+
+/**
+ * The kernel keeps what we read in the page cache of the union, so for
+ * large streams the page cache of the branch file is just a second copy.
+ * Once a read of len bytes at offset continues a stream, the page cache
+ * of the branch file behind it is dropped.
+ * Reads of a file might be done by several threads at once and arrive a
+ * bit out of order, so they continue a stream if they are close to where
+ * the last one ended. The fields are not locked, a lost update only
+ * delays the next drop.
+ */
+static void drop_behind(branch_file_t *file, off_t offset, ssize_t len) {
+#ifdef POSIX_FADV_DONTNEED
+	off_t distance = offset - file->seq_next;
+
+	if (distance < -DROP_BEHIND_CHUNK || distance > DROP_BEHIND_CHUNK) {
+		// a seek, start a new stream
+		file->seq_start = offset;
+		file->seq_dropped = offset & ~(off_t)(DROP_BEHIND_CHUNK - 1);
+	}
+	if (offset + len > file->seq_next) file->seq_next = offset + len;
+
+	if (file->seq_next - file->seq_start < DROP_BEHIND_START) return;
+
+	// whole chunks only, the one we are in is still being read
+	off_t end = offset & ~(off_t)(DROP_BEHIND_CHUNK - 1);
+	off_t start = file->seq_dropped;
+	if (end - start < DROP_BEHIND_CHUNK) return;
+
+	file->seq_dropped = end;
+	if (posix_fadvise(file->fd, start, end - start, POSIX_FADV_DONTNEED) == 0) {
+		__atomic_add_fetch(&dropped_bytes, end - start, __ATOMIC_RELAXED);
+	}
+#else
+	(void)file;
+	(void)offset;
+	(void)len;
+#endif
+}
+
+static ssize_t dir_read(branch_file_t *file, char *buf, size_t size, off_t offset) {
+	ssize_t res = pread(file->fd, buf, size, offset);
+
+	if (uopt.drop_behind && res > 0) drop_behind(file, offset, res);
+
+	return res;
+}
+
+static int dir_close(branch_file_t *file) {
+	return close(file->fd);
+}
+
+static int dir_readdir(int branch, const char *path, branch_filler_t filler, void *priv) {
+	char p[PATHLEN_MAX];
+	if (dir_path(p, branch, path)) return -1;
+
+	DIR *dp = opendir(p);
+	if (dp == NULL) return -1;
+
+	struct dirent *de;
+	while ((de = readdir(dp)) != NULL) {
+		if (filler(priv, de->d_name, de->d_ino, de->d_type)) break;
+	}
+
+	closedir(dp);
+	return 0;
+}
+
+static ssize_t dir_readlink(int branch, const char *path, char *buf, size_t size) {
+	char p[PATHLEN_MAX];
+	if (dir_path(p, branch, path)) return -1;
+
+	return readlink(p, buf, size);
+}
+
+static ssize_t dir_write(branch_file_t *file, const char *buf, size_t size, off_t offset) {
+	return pwrite(file->fd, buf, size, offset);
+}
+
+static int dir_mkdir(int branch, const char *path, mode_t mode) {
+	char p[PATHLEN_MAX];
+	if (dir_path(p, branch, path)) return -1;
+
+	return mkdir(p, mode);
+}
+
+static int dir_mknod(int branch, const char *path, mode_t mode, dev_t rdev) {
+	char p[PATHLEN_MAX];
+	if (dir_path(p, branch, path)) return -1;
+
+	return mknod(p, mode, rdev);
+}
+
+static int dir_symlink(int branch, const char *target, const char *path) {
+	char p[PATHLEN_MAX];
+	if (dir_path(p, branch, path)) return -1;
+
+	return symlink(target, p);
+}
+
+static int dir_link(int branch, const char *from, const char *to) {
+	char f[PATHLEN_MAX], t[PATHLEN_MAX];
+	if (dir_path(f, branch, from) || dir_path(t, branch, to)) return -1;
+
+	return link(f, t);
+}
+
+static int dir_unlink(int branch, const char *path) {
+	char p[PATHLEN_MAX];
+	if (dir_path(p, branch, path)) return -1;
+
+	return unlink(p);
+}
+
+static int dir_rmdir(int branch, const char *path) {
+	char p[PATHLEN_MAX];
+	if (dir_path(p, branch, path)) return -1;
+
+	return rmdir(p);
+}
+
+static int dir_rename(int branch, const char *from, const char *to) {
+	char f[PATHLEN_MAX], t[PATHLEN_MAX];
+	if (dir_path(f, branch, from) || dir_path(t, branch, to)) return -1;
+
+	return rename(f, t);
+}
+
+static int dir_chmod(int branch, const char *path, mode_t mode) {
+	char p[PATHLEN_MAX];
+	if (dir_path(p, branch, path)) return -1;
+
+	return chmod(p, mode);
+}
+
+static int dir_chown(int branch, const char *path, uid_t uid, gid_t gid) {
+	char p[PATHLEN_MAX];
+	if (dir_path(p, branch, path)) return -1;
+
+	return lchown(p, uid, gid);
+}
+
+static int dir_truncate(int branch, const char *path, off_t size) {
+	char p[PATHLEN_MAX];
+	if (dir_path(p, branch, path)) return -1;
+
+	return truncate(p, size);
+}
+
+static int dir_utimens(int branch, const char *path, const struct timespec ts[2]) {
+	char p[PATHLEN_MAX];
+	if (dir_path(p, branch, path)) return -1;
+
+#ifdef UNIONFS_HAVE_AT
+	return utimensat(AT_FDCWD, p, ts, AT_SYMLINK_NOFOLLOW);
+#else
+	struct timeval tv[2];
+	tv[0].tv_sec = ts[0].tv_sec;
+	tv[0].tv_usec = ts[0].tv_nsec / 1000;
+	tv[1].tv_sec = ts[1].tv_sec;
+	tv[1].tv_usec = ts[1].tv_nsec / 1000;
+	return utimes(p, tv);
+#endif
+}
+
+const struct branch_ops dir_ops = {
+	.lstat = dir_lstat,
+	.open = dir_open,
+	.read = dir_read,
+	.close = dir_close,
+	.readdir = dir_readdir,
+	.readlink = dir_readlink,
+	.xattrs = true,
+
+	.write = dir_write,
+	.mkdir = dir_mkdir,
+	.mknod = dir_mknod,
+	.symlink = dir_symlink,
+	.link = dir_link,
+	.unlink = dir_unlink,
+	.rmdir = dir_rmdir,
+	.rename = dir_rename,
+	.chmod = dir_chmod,
+	.chown = dir_chown,
+	.truncate = dir_truncate,
+	.utimens = dir_utimens,
+};
+
+/**
+ * rename() from on branch to to on to_branch. This only works if both are
+ * directories on the same filesystem, otherwise it fails with EXDEV.
+ */
+int branch_move(int branch, const char *from, int to_branch, const char *to) {
+	if (uopt.branches[branch].ops != &dir_ops || uopt.branches[to_branch].ops != &dir_ops) {
+		errno = EXDEV;
+		return -1;
+	}
+
+	char f[PATHLEN_MAX], t[PATHLEN_MAX];
+	if (dir_path(f, branch, from) || dir_path(t, to_branch, to)) return -1;
+
+	return rename(f, t);
+}
+
+void branch_stats(struct unionfs_stats *stats) {
+	stats->drop_behind_bytes = __atomic_load_n(&dropped_bytes, __ATOMIC_RELAXED);
+}
+
+/**
+ * Select the backend of branch, path is the (possibly chrooted) path
+ * branch->fd was opened from.
+ */
+int branch_init(branch_entry_t *branch, const char *path) {
+	if (branch->memory) {
+		branch->ops = &memfs_ops;
+		return memfs_open(branch, path);
+	}
+
+	struct stat st;
+	if (fstat(branch->fd, &st) == -1) return -1;
+
+	if (S_ISREG(st.st_mode)) {
+		if (branch->rw) {
+			fprintf(stderr, "%s is an image file, which can only be a RO branch\n", path);
+			errno = EROFS;
+			return -1;
+		}
+		// the mapping of an image must not change under us
+		branch->immutable = 1;
+		branch->ops = &image_ops;
+		return image_open(branch, path);
+	}
+
+	branch->ops = &dir_ops;
+
+	// without an index, the branch just stays a plain directory
+	if (uopt.index_dir && branch->immutable && !branch->rw && index_attach(branch, path)) {
+		USYSLOG(LOG_WARNING, "No index for %s: %s\n", path, strerror(errno));
+	}
+
+	return 0;
+}
@@ -0,0 +1,165 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#ifndef BRANCH_H
+#define BRANCH_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "unionfs.h"
+#include "opts.h"
+
+struct branch_ops;
+struct unionfs_stats;
+
+/**
+ * An open file of a branch, this is what fi->fh points to. Files are
+ * accessed through ops, so they stay usable if branches are added or
+ * removed while they are open, see reconf.c.
+ */
+typedef struct branch_file {
+	int branch;
+	const struct branch_ops *ops;	// set by branch_open()
+	int fd;			// -1 if not backed by a file descriptor
+	const char *data;	// contents of files served from memory, e.g. images
+	off_t size;		// size of data
+	void *priv;		// data of the backend
+
+	// lower files opened for writing are copied up on the first write only
+	int cow_flags;		// the flags of such an open, 0 for all other files
+	unsigned long cow_seen;	// copy_up_count() when we last checked for a copy
+	struct branch_file *up;	// the copy, once there is one
+
+	// sequential reads, see drop_behind() in branch.c
+	off_t seq_start;	// where the stream started
+	off_t seq_next;		// the offset we expect next
+	off_t seq_dropped;	// the page cache before this is dropped
+} branch_file_t;
+
+/**
+ * Called by readdir() for every entry, return non-zero to stop
+ */
+typedef int (*branch_filler_t)(void *priv, const char *name, ino_t ino, unsigned char type);
+
+/**
+ * The operations every branch backend implements. Paths are relative to the
+ * branch root. Just like the system calls, they return -1 and set errno on
+ * failure. Backends which can only serve ro-branches leave the operations
+ * modifying the branch NULL, these are only called on rw-branches.
+ */
+struct branch_ops {
+	int (*lstat)(int branch, const char *path, struct stat *stbuf);
+	int (*open)(int branch, const char *path, int flags, mode_t mode, branch_file_t *file);
+	ssize_t (*read)(branch_file_t *file, char *buf, size_t size, off_t offset);
+	int (*close)(branch_file_t *file);
+	int (*readdir)(int branch, const char *path, branch_filler_t filler, void *priv);
+	ssize_t (*readlink)(int branch, const char *path, char *buf, size_t size);
+	bool xattrs;		// extended attributes are available by path
+
+	// modifications, symlinks are never followed
+	ssize_t (*write)(branch_file_t *file, const char *buf, size_t size, off_t offset);
+	int (*mkdir)(int branch, const char *path, mode_t mode);
+	int (*mknod)(int branch, const char *path, mode_t mode, dev_t rdev);
+	int (*symlink)(int branch, const char *target, const char *path);
+	int (*link)(int branch, const char *from, const char *to);
+	int (*unlink)(int branch, const char *path);
+	int (*rmdir)(int branch, const char *path);
+	int (*rename)(int branch, const char *from, const char *to);
+	int (*chmod)(int branch, const char *path, mode_t mode);
+	int (*chown)(int branch, const char *path, uid_t uid, gid_t gid);
+	int (*truncate)(int branch, const char *path, off_t size);
+	int (*utimens)(int branch, const char *path, const struct timespec ts[2]);
+};
+
+extern const struct branch_ops dir_ops;
+
+int branch_init(branch_entry_t *branch, const char *path);
+int branch_move(int branch, const char *from, int to_branch, const char *to);
+void branch_stats(struct unionfs_stats *stats);
+
+static inline int branch_lstat(int branch, const char *path, struct stat *stbuf) {
+	return uopt.branches[branch].ops->lstat(branch, path, stbuf);
+}
+
+static inline int branch_open(int branch, const char *path, int flags, mode_t mode, branch_file_t *file) {
+	const struct branch_ops *ops = uopt.branches[branch].ops;
+
+	int res = ops->open(branch, path, flags, mode, file);
+	if (res == 0) {
+		file->ops = ops;
+		file->cow_flags = 0;
+		file->up = NULL;
+	}
+	return res;
+}
+
+static inline ssize_t branch_read(branch_file_t *file, char *buf, size_t size, off_t offset) {
+	return file->ops->read(file, buf, size, offset);
+}
+
+static inline int branch_close(branch_file_t *file) {
+	return file->ops->close(file);
+}
+
+static inline int branch_readdir(int branch, const char *path, branch_filler_t filler, void *priv) {
+	return uopt.branches[branch].ops->readdir(branch, path, filler, priv);
+}
+
+static inline ssize_t branch_readlink(int branch, const char *path, char *buf, size_t size) {
+	return uopt.branches[branch].ops->readlink(branch, path, buf, size);
+}
+
+static inline ssize_t branch_write(branch_file_t *file, const char *buf, size_t size, off_t offset) {
+	return file->ops->write(file, buf, size, offset);
+}
+
+static inline int branch_mkdir(int branch, const char *path, mode_t mode) {
+	return uopt.branches[branch].ops->mkdir(branch, path, mode);
+}
+
+static inline int branch_mknod(int branch, const char *path, mode_t mode, dev_t rdev) {
+	return uopt.branches[branch].ops->mknod(branch, path, mode, rdev);
+}
+
+static inline int branch_symlink(int branch, const char *target, const char *path) {
+	return uopt.branches[branch].ops->symlink(branch, target, path);
+}
+
+static inline int branch_link(int branch, const char *from, const char *to) {
+	return uopt.branches[branch].ops->link(branch, from, to);
+}
+
+static inline int branch_unlink(int branch, const char *path) {
+	return uopt.branches[branch].ops->unlink(branch, path);
+}
+
+static inline int branch_rmdir(int branch, const char *path) {
+	return uopt.branches[branch].ops->rmdir(branch, path);
+}
+
+static inline int branch_rename(int branch, const char *from, const char *to) {
+	return uopt.branches[branch].ops->rename(branch, from, to);
+}
+
+static inline int branch_chmod(int branch, const char *path, mode_t mode) {
+	return uopt.branches[branch].ops->chmod(branch, path, mode);
+}
+
+static inline int branch_chown(int branch, const char *path, uid_t uid, gid_t gid) {
+	return uopt.branches[branch].ops->chown(branch, path, uid, gid);
+}
+
+static inline int branch_truncate(int branch, const char *path, off_t size) {
+	return uopt.branches[branch].ops->truncate(branch, path, size);
+}
+
+static inline int branch_utimens(int branch, const char *path, const struct timespec ts[2]) {
+	return uopt.branches[branch].ops->utimens(branch, path, ts);
+}
+
+#endif
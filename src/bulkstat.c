@@ -0,0 +1,329 @@
+/*
+*  C Implementation: bulkstat
+*
+* Description: Attributes of many files with a single ioctl
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+*
+* Details:
+*	Tools like indexers stat every single file of the union, which costs
+*	a round trip through the kernel and a branch lookup each. With
+*	UNIONFS_BULK_STAT they get the attributes of a whole batch of names,
+*	or of all entries of a directory, as packed records of one ioctl.
+*	The lookups are the very same as for getattr(), so the results follow
+*	the order of the branches, whiteouts and hidden files, and they use
+*	and fill the same caches.
+*	If the records do not fit into the buffer of the ioctl, fewer are
+*	returned and the caller asks again for the remaining names, or for a
+*	directory starting at the returned offset. The names of a directory
+*	are read once, at offset 0, and kept as a cursor until the caller got
+*	all of them, so each further call only costs its own batch. Like the
+*	position of an open directory, a cursor does not see names created
+*	after the listing was read. Up to BULK_CURSORS directories are listed
+*	at the same time; a caller whose cursor was dropped meanwhile gets
+*	the directory read again and skipped up to its offset.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "unionfs.h"
+#include "opts.h"
+#include "debug.h"
+#include "string.h"
+#include "general.h"
+#include "readdir.h"
+#include "reconf.h"
+#include "uioctl.h"
+#include "bulkstat.h"
+
+#define BULK_CURSORS 16 // directories listed at the same time
+
+typedef struct {
+	const char *dir;	// path of the ioctl, "" for the root
+	char *out;		// where the next record goes
+	char *end;
+	uint32_t count;		// records written
+} bulk_t;
+
+// the names of a directory, while a caller works through them
+typedef struct {
+	char *path;
+	uint64_t offset;	// of the next name to return
+	char **names;
+	uint64_t count, max;
+	unsigned int used;	// when it was last used, to drop the oldest
+	bool incomplete;	// out of memory while reading the names
+} cursor_t;
+
+static cursor_t *cursors[BULK_CURSORS];
+static unsigned int cursors_used;
+static pthread_mutex_t cursors_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Names must not leave the directory, i.e. be absolute or contain ".."
+ */
+static bool name_valid(const char *name) {
+	if (name[0] == '/') return false;
+
+	while (*name) {
+		size_t len = strcspn(name, "/");
+		if (len == 2 && name[0] == '.' && name[1] == '.') return false;
+
+		name += len;
+		if (*name) name++;
+	}
+
+	return true;
+}
+
+/**
+ * Append the record of name, returns -1 if it does not fit anymore
+ */
+static int add_record(bulk_t *b, const char *name) {
+	size_t namelen = strlen(name);
+	size_t reclen = (sizeof(struct unionfs_stat_record) + namelen + 1 + 7) & ~(size_t)7;
+	if (reclen > (size_t)(b->end - b->out)) return -1;
+
+	struct unionfs_stat_record *rec = (struct unionfs_stat_record *)b->out;
+	memset(rec, 0, sizeof(*rec));
+	rec->reclen = reclen;
+	rec->namelen = namelen;
+	memcpy(rec->name, name, namelen + 1);
+
+	char path[PATHLEN_MAX];
+	struct stat st;
+	int res;
+
+	if (!name_valid(name)) {
+		res = -EINVAL;
+	} else if (name[0] == '\0') {
+		res = union_lstat(b->dir[0] ? b->dir : "/", &st);
+	} else if (BUILD_PATH(path, b->dir, "/", name)) {
+		res = -ENAMETOOLONG;
+	} else {
+		res = union_lstat(path, &st);
+	}
+
+	if (res < 0) {
+		rec->error = -res;
+	} else {
+		rec->branch = res;
+		rec->mode = st.st_mode;
+		rec->nlink = st.st_nlink;
+		rec->uid = st.st_uid;
+		rec->gid = st.st_gid;
+		rec->ino = st.st_ino;
+		rec->size = st.st_size;
+		rec->blocks = st.st_blocks;
+		rec->rdev = st.st_rdev;
+		rec->atime = st.st_atim.tv_sec;
+		rec->atime_nsec = st.st_atim.tv_nsec;
+		rec->mtime = st.st_mtim.tv_sec;
+		rec->mtime_nsec = st.st_mtim.tv_nsec;
+		rec->ctime = st.st_ctim.tv_sec;
+		rec->ctime_nsec = st.st_ctim.tv_nsec;
+	}
+
+	b->out += reclen;
+	b->count++;
+	return 0;
+}
+
+static void free_cursor(cursor_t *c) {
+	if (!c) return;
+
+	uint64_t i;
+	for (i = 0; i < c->count; i++) free(c->names[i]);
+	free(c->names);
+	free(c->path);
+	free(c);
+}
+
+/**
+ * Take the cursor of path at offset out of the table, NULL if there is none
+ */
+static cursor_t *take_cursor(const char *path, uint64_t offset) {
+	cursor_t *c = NULL;
+
+	pthread_mutex_lock(&cursors_lock);
+
+	int i;
+	for (i = 0; i < BULK_CURSORS; i++) {
+		if (cursors[i] && cursors[i]->offset == offset && strcmp(cursors[i]->path, path) == 0) {
+			c = cursors[i];
+			cursors[i] = NULL;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&cursors_lock);
+	return c;
+}
+
+/**
+ * Keep c for the next call, in place of the cursor used longest ago
+ */
+static void put_cursor(cursor_t *c) {
+	pthread_mutex_lock(&cursors_lock);
+
+	c->used = ++cursors_used;
+
+	int i, oldest = 0;
+	for (i = 0; i < BULK_CURSORS; i++) {
+		if (!cursors[i]) {
+			oldest = i;
+			break;
+		}
+		if (cursors[i]->used - cursors[oldest]->used > UINT_MAX / 2) oldest = i;
+	}
+
+	cursor_t *old = cursors[oldest];
+	cursors[oldest] = c;
+
+	pthread_mutex_unlock(&cursors_lock);
+
+	free_cursor(old);
+}
+
+/**
+ * fuse_fill_dir_t for unionfs_readdir(), collect the names
+ */
+static int fill_cursor(void *buf, const char *name, const struct stat *st, off_t off) {
+	(void)st;
+	(void)off;
+
+	cursor_t *c = buf;
+
+	if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) return 0;
+
+	if (c->count == c->max) {
+		uint64_t max = c->max ? c->max * 2 : 256;
+		char **names = realloc(c->names, max * sizeof(char *));
+		if (!names) goto err;
+		c->names = names;
+		c->max = max;
+	}
+
+	c->names[c->count] = strdup(name);
+	if (!c->names[c->count]) goto err;
+	c->count++;
+
+	return 0;
+
+err:
+	c->incomplete = true;
+	return 1;
+}
+
+/**
+ * Read the names of the directory path
+ */
+static cursor_t *new_cursor(const char *path) {
+	cursor_t *c = calloc(1, sizeof(cursor_t));
+	if (!c) return NULL;
+
+	c->path = strdup(path);
+	if (!c->path) {
+		free_cursor(c);
+		return NULL;
+	}
+
+	int res = unionfs_readdir(path, c, fill_cursor, 0, NULL);
+	if (res || c->incomplete) {
+		free_cursor(c);
+		errno = res ? -res : ENOMEM;
+		return NULL;
+	}
+
+	return c;
+}
+
+static int bulk_dir(bulk_t *b, const char *path, struct unionfs_bulk_stat *req) {
+	struct stat st;
+	int res = union_lstat(path, &st);
+	if (res < 0) return res;
+	if (!S_ISDIR(st.st_mode)) return -ENOTDIR;
+
+	cursor_t *c = req->offset ? take_cursor(path, req->offset) : NULL;
+	if (!c) {
+		c = new_cursor(path);
+		if (!c) return -errno;
+	}
+
+	uint64_t i;
+	for (i = req->offset; i < c->count; i++) {
+		if (add_record(b, c->names[i])) break;
+	}
+
+	if (i < c->count) {
+		req->offset = c->offset = i;
+		put_cursor(c);
+	} else {
+		req->offset = 0;
+		free_cursor(c);
+	}
+
+	return 0;
+}
+
+static int bulk_names(bulk_t *b, struct unionfs_bulk_stat *req) {
+	// the records overwrite the names
+	char *names = malloc(sizeof(req->buf));
+	if (!names) return -ENOMEM;
+
+	memcpy(names, req->buf, sizeof(req->buf));
+	names[sizeof(req->buf) - 1] = '\0';
+
+	const char *name = names;
+	const char *end = names + sizeof(req->buf);
+	uint32_t i;
+
+	int res = 0;
+	for (i = 0; i < req->count && name < end; i++) {
+		if (add_record(b, name)) {
+			// the caller would ask for it again and again
+			if (b->count == 0) res = -ENAMETOOLONG;
+			break;
+		}
+		name += strlen(name) + 1;
+	}
+
+	free(names);
+	return res;
+}
+
+/**
+ * UNIONFS_BULK_STAT on path
+ */
+int bulk_stat(const char *path, struct unionfs_bulk_stat *req) {
+	DBG("%s\n", path);
+
+	bulk_t b;
+	memset(&b, 0, sizeof(b));
+	b.dir = strcmp(path, "/") == 0 ? "" : path;
+	b.out = req->buf;
+	b.end = req->buf + sizeof(req->buf);
+
+	reconf_enter();
+
+	int res;
+	if (req->flags & UNIONFS_BULK_DIR) {
+		res = bulk_dir(&b, path, req);
+	} else {
+		res = bulk_names(&b, req);
+	}
+
+	reconf_leave();
+
+	req->count = b.count;
+	RETURN(res);
+}
@@ -0,0 +1,14 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#ifndef BULKSTAT_H
+#define BULKSTAT_H
+
+#include "uioctl.h"
+
+int bulk_stat(const char *path, struct unionfs_bulk_stat *req);
+
+#endif
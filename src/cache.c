@@ -0,0 +1,218 @@
+/*
+*  C Implementation: cache
+*
+* Description: Helpers shared by our path based caches
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+*
+* Details:
+*	All caches are hash tables with the union path as key, interned by
+*	intern.c, so the path strings are shared by all caches. Operations
+*	modifying a path only need to call cache_invalidate() or, if a whole
+*	directory tree is affected (e.g. rename of a directory),
+*	cache_invalidate_tree() and all caches will forget about it, also
+*	those of other mounts with -o peers, see peers.c.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "unionfs.h"
+#include "cache.h"
+#include "general.h"
+#include "branch.h"
+#include "hashtable_itr.h"
+#include "intern.h"
+#include "xattr_cache.h"
+#include "symlink_cache.h"
+#include "dircache.h"
+#include "peers.h"
+
+/**
+ * Create a cache, a hashtable with interned paths as keys
+ */
+struct hashtable *cache_create(unsigned int size) {
+	struct hashtable *h = create_hashtable(size, intern_hash, intern_equal);
+	if (h) hashtable_set_free_key(h, intern_free_key);
+	return h;
+}
+
+/**
+ * Find the entry of path in h
+ */
+void *cache_search(struct hashtable *h, const char *path) {
+	// if path is not interned, no cache can have it
+	const path_id_t *id = intern_find(path);
+	if (!id) return NULL;
+
+	// the key of the entry holds its own reference
+	void *value = hashtable_search(h, (void *)id);
+	intern_put(id);
+
+	return value;
+}
+
+/**
+ * Add value as the entry of path to h, returns false if we run out of memory
+ */
+bool cache_insert(struct hashtable *h, const char *path, void *value) {
+	const path_id_t *id = intern_get(path);
+	if (!id) return false;
+
+	// the reference is passed on to the key
+	if (!hashtable_insert(h, (void *)id, value)) {
+		intern_put(id);
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Remove the entry of path from h and return it
+ */
+void *cache_remove(struct hashtable *h, const char *path) {
+	const path_id_t *id = intern_find(path);
+	if (!id) return NULL;
+
+	void *value = hashtable_remove(h, (void *)id);
+	intern_put(id);
+
+	return value;
+}
+
+/**
+ * Remove all entries of h for which match() returns true
+ */
+static void remove_if(struct hashtable *h, bool (*match)(const path_id_t *key, const void *arg),
+                      const void *arg, void (*free_value)(void *)) {
+	if (hashtable_count(h) == 0) return;
+
+	struct hashtable_itr *itr = hashtable_iterator(h);
+	if (!itr) return;
+
+	bool more = true;
+	while (more) {
+		const path_id_t *key = hashtable_iterator_key(itr);
+		if (match(key, arg)) {
+			free_value(hashtable_iterator_value(itr));
+			more = hashtable_iterator_remove(itr);
+		} else {
+			more = hashtable_iterator_advance(itr);
+		}
+	}
+
+	free(itr);
+}
+
+static bool always(const path_id_t *key, const void *arg) {
+	(void)key;
+	(void)arg;
+	return true;
+}
+
+/**
+ * Remove all entries of h, the caller has to hold the write lock of h
+ */
+void cache_flush(struct hashtable *h, void (*free_value)(void *)) {
+	remove_if(h, always, NULL, free_value);
+}
+
+static bool in_tree(const path_id_t *key, const void *arg) {
+	return intern_below(key, arg);
+}
+
+/**
+ * Remove path and all entries below path from h, the caller has to hold
+ * the write lock of h
+ */
+void cache_remove_tree(struct hashtable *h, const char *path, void (*free_value)(void *)) {
+	// anything below path would keep path interned
+	const path_id_t *dir = intern_find(path);
+	if (!dir) return;
+
+	remove_if(h, in_tree, dir, free_value);
+	intern_put(dir);
+}
+
+/**
+ * Might branch serve path or hide it from lower branches? A file where a
+ * directory of path should be counts as well.
+ */
+static bool on_branch(const path_id_t *key, const void *arg) {
+	int branch = *(const int *)arg;
+
+	char path[PATHLEN_MAX];
+	if (intern_path(key, path, sizeof(path))) return true;
+
+	struct stat st;
+	if (branch_lstat(branch, path, &st) == 0 || errno == ENOTDIR) return true;
+
+	return path_hidden(path, branch) != 0;
+}
+
+/**
+ * Remove all entries of h branch might serve, the caller has to hold the
+ * write lock of h
+ */
+void cache_remove_branch(struct hashtable *h, int branch, void (*free_value)(void *)) {
+	remove_if(h, on_branch, &branch, free_value);
+}
+
+/**
+ * Drop the entries of path from our own caches only, e.g. when a peer
+ * changed it
+ */
+void cache_drop(const char *path) {
+	xattr_cache_invalidate(path);
+	symlink_cache_invalidate(path);
+	dircache_invalidate(path);
+}
+
+void cache_drop_tree(const char *path) {
+	xattr_cache_invalidate_tree(path);
+	symlink_cache_invalidate_tree(path);
+	dircache_invalidate_tree(path);
+}
+
+/**
+ * path was created, removed, copied up or modified otherwise
+ */
+void cache_invalidate(const char *path) {
+	cache_drop(path);
+	peers_publish(path, false);
+}
+
+/**
+ * path and everything below it changed, e.g. by a rename
+ */
+void cache_invalidate_tree(const char *path) {
+	cache_drop_tree(path);
+	peers_publish(path, true);
+}
+
+/**
+ * branch got added or is about to be removed, forget whatever it might
+ * serve now or did serve before. Everything else stays valid.
+ */
+void cache_forget_branch(int branch) {
+	xattr_cache_forget_branch(branch);
+	symlink_cache_forget_branch(branch);
+	dircache_flush();
+}
+
+/**
+ * The branches got new indices, map[old index] is the new one or -1 for a
+ * removed branch, n the number of branches before the change
+ */
+void cache_renumber(const int *map, int n) {
+	symlink_cache_renumber(map, n);
+	dircache_flush();
+}
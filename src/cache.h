@@ -0,0 +1,29 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdbool.h>
+
+#include "hashtable.h"
+
+struct hashtable *cache_create(unsigned int size);
+void *cache_search(struct hashtable *h, const char *path);
+bool cache_insert(struct hashtable *h, const char *path, void *value);
+void *cache_remove(struct hashtable *h, const char *path);
+void cache_flush(struct hashtable *h, void (*free_value)(void *));
+void cache_remove_tree(struct hashtable *h, const char *path, void (*free_value)(void *));
+void cache_remove_branch(struct hashtable *h, int branch, void (*free_value)(void *));
+
+void cache_drop(const char *path);
+void cache_drop_tree(const char *path);
+void cache_invalidate(const char *path);
+void cache_invalidate_tree(const char *path);
+void cache_forget_branch(int branch);
+void cache_renumber(const int *map, int n);
+
+#endif
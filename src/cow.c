@@ -16,6 +16,7 @@
 #include <errno.h>
 #include <stdio.h>
 #include <dirent.h>
+#include <pthread.h>
 
 #include "opts.h"
 #include "findbranch.h"
@@ -25,19 +26,31 @@
 #include "string.h"
 #include "debug.h"
 #include "usyslog.h"
+#include "cache.h"
+#include "branch.h"
+#include "hashtable.h"
+#include "pathlock.h"
 
 
+#define COPIES_MAX 65536 // forget all copies if there are more
+
+typedef struct {
+	dev_t dev;		// of the copy, to notice it was replaced
+	ino_t ino;
+	char path[];		// of the copy within its branch
+} copy_entry_t;
+
+static struct hashtable *copies;	// "dev:ino" of lower files with several links -> copy_entry_t
+static pthread_mutex_t copies_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /**
  * Actually create the directory here.
  */
 static int do_create(const char *path, int nbranch_ro, int nbranch_rw) {
 	DBG("%s\n", path);
 
-	char dirp[PATHLEN_MAX]; // dir path to create
-	sprintf(dirp, "%s%s", uopt.branches[nbranch_rw].path, path);
-
 	struct stat buf;
-	int res = stat(dirp, &buf);
+	int res = branch_lstat(nbranch_rw, path, &buf);
 	if (res != -1) RETURN(0); // already exists
 
 	if (nbranch_ro == nbranch_rw) {
@@ -46,21 +59,22 @@ static int do_create(const char *path, int nbranch_ro, int nbranch_rw) {
 		buf.st_mode = S_IRWXU | S_IRWXG;
 	} else {
 		// data from the ro-branch
-		char o_dirp[PATHLEN_MAX]; // the pathname we want to copy
-		sprintf(o_dirp, "%s%s", uopt.branches[nbranch_ro].path, path);
-		res = stat(o_dirp, &buf);
+		res = branch_lstat(nbranch_ro, path, &buf);
 		if (res == -1) RETURN(1); // lower level branch removed in the mean time?
 	}
 
-	res = mkdir(dirp, buf.st_mode);
+	res = branch_mkdir(nbranch_rw, path, buf.st_mode);
 	if (res == -1) {
-		USYSLOG(LOG_DAEMON, "Creating %s failed: \n", dirp);
+		USYSLOG(LOG_DAEMON, "Creating %s%s failed: \n", uopt.branches[nbranch_rw].path, path);
 		RETURN(1);
 	}
 
+	// path is now served by the new directory
+	cache_invalidate(path);
+
 	if (nbranch_ro == nbranch_rw) RETURN(0); // the special case again
 
-	if (setfile(dirp, &buf))  RETURN(1); // directory already removed by another process?
+	if (setfile(nbranch_rw, path, &buf))  RETURN(1); // directory already removed by another process?
 
 	// TODO: time, but its values are modified by the next dir/file creation steps?
 
@@ -76,31 +90,33 @@ int path_create(const char *path, int nbranch_ro, int nbranch_rw) {
 
 	if (!uopt.cow_enabled) RETURN(0);
 	
-	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[nbranch_rw].path, path)) RETURN(-ENAMETOOLONG);
-
 	struct stat st;
-	if (!stat(p, &st)) {
+	if (!branch_lstat(nbranch_rw, path, &st)) {
 		// path does already exists, no need to create it
 		RETURN(0);
 	}
 
-	char *walk = (char *)path;
+	char p[PATHLEN_MAX];
+	if (BUILD_PATH(p, path)) RETURN(1);
+
+	char *walk = p;
 
 	// first slashes, e.g. we have path = /dir1/dir2/, will set walk = dir1/dir2/
-	while (*walk != '\0' && *walk == '/') walk++;
+	walk += strspn(walk, "/");
 
 	do {
 		// walk over the directory name, walk will now be /dir2
-		while (*walk != '\0' && *walk != '/') walk++;
+		walk += strcspn(walk, "/");
 
-		// +1 due to \0, which gets added automatically
-		snprintf(p, (walk - path) + 1, "%s", path); // walk - path = strlen(/dir1)
+		// cut p at walk for a moment, p = /dir1
+		char c = *walk;
+		*walk = '\0';
 		int res = do_create(p, nbranch_ro, nbranch_rw);
+		*walk = c;
 		if (res) RETURN(res); // creating the directory failed
 
 		// as above the do loop, walk over the next slashes, walk = dir2/
-		while (*walk != '\0' && *walk == '/') walk++;
+		walk += strspn(walk, "/");
 	} while (*walk != '\0');
 
 	RETURN(0);
@@ -122,6 +138,41 @@ int path_create_cutlast(const char *path, int nbranch_ro, int nbranch_rw) {
 	RETURN(ret);
 }
 
+static void cow_init(struct cow *cow, int branch, const char *path, int to_branch, const char *to_path) {
+	setlocale(LC_ALL, "");
+
+	cow->uid = getuid();
+
+	// Copy the umask for explicit mode setting.
+	cow->umask = umask(0);
+	umask(cow->umask);
+
+	cow->branch = branch;
+	cow->path = path;
+	cow->to_branch = to_branch;
+	cow->to_path = to_path;
+}
+
+/**
+ * Copy anything but a directory
+ */
+static int copy_nondir(struct cow *cow) {
+	switch (cow->stat->st_mode & S_IFMT) {
+		case S_IFLNK:
+			return copy_link(cow);
+		case S_IFBLK:
+		case S_IFCHR:
+			return copy_special(cow);
+		case S_IFIFO:
+			return copy_fifo(cow);
+		case S_IFSOCK:
+			USYSLOG(LOG_WARNING, "COW of sockets not supported: %s\n", cow->path);
+			return 1;
+		default:
+			return copy_file(cow);
+	}
+}
+
 /**
  * initiate the cow-copy action
  */
@@ -131,56 +182,242 @@ int cow_cp(const char *path, int branch_ro, int branch_rw, bool copy_dir) {
 	// create the path to the file
 	path_create_cutlast(path, branch_ro, branch_rw);
 
-	char from[PATHLEN_MAX], to[PATHLEN_MAX];
-	if (BUILD_PATH(from, uopt.branches[branch_ro].path, path))
-		RETURN(-ENAMETOOLONG);
-	if (BUILD_PATH(to, uopt.branches[branch_rw].path, path))
-		RETURN(-ENAMETOOLONG);
+	struct cow cow;
+	cow_init(&cow, branch_ro, path, branch_rw, path);
 
-	setlocale(LC_ALL, "");
+	// path is going to be served by the copy, which e.g. has no xattrs
+	cache_invalidate(path);
 
-	struct cow cow;
+	struct stat buf;
+	if (branch_lstat(branch_ro, path, &buf) == -1) RETURN(1);
+	cow.stat = &buf;
+
+	int res;
+	if (S_ISDIR(buf.st_mode)) {
+		if (copy_dir) {
+			res = copy_directory(path, branch_ro, branch_rw);
+		} else {
+			res = path_create(path, branch_ro, branch_rw);
+		}
+	} else {
+		res = copy_nondir(&cow);
+	}
 
-	cow.uid = getuid();
+	// lookups during the copy might have cached the original again
+	cache_invalidate(path);
 
-	// Copy the umask for explicit mode setting.
-	cow.umask = umask(0);
-	umask(cow.umask);
+	RETURN(res);
+}
+
+static void copy_key(char *key, size_t size, int branch_rw, const struct stat *st) {
+	snprintf(key, size, "%d:%llu:%llu", branch_rw,
+		(unsigned long long)st->st_dev, (unsigned long long)st->st_ino);
+}
+
+/**
+ * Check if copy, described by entry, still has the data of the lower file
+ * st. Writes, truncate() and chmod() of the copy through the union change
+ * its size, mtime or mode. Its ownership and the setuid bits are not
+ * compared, copy-up might not have been able to preserve them.
+ */
+static bool same_copy(const copy_entry_t *entry, const struct stat *copy, const struct stat *st) {
+	mode_t mask = S_IFMT | S_IRWXU | S_IRWXG | S_IRWXO;
+
+	return entry->dev == copy->st_dev && entry->ino == copy->st_ino &&
+	       copy->st_size == st->st_size &&
+	       copy->st_mtim.tv_sec == st->st_mtim.tv_sec && copy->st_mtim.tv_nsec == st->st_mtim.tv_nsec &&
+	       (copy->st_mode & mask) == (st->st_mode & mask);
+}
+
+/**
+ * If another name of the lower file was already copied to branch_rw, and
+ * that copy was not modified since, link path to it. Return 0 if this
+ * worked.
+ */
+static int link_to_copy(const char *path, int branch_rw, const struct stat *st) {
+	char key[80];
+	copy_key(key, sizeof(key), branch_rw, st);
+
+	char copy[PATHLEN_MAX];
+	copy_entry_t copy_st;
+
+	pthread_mutex_lock(&copies_lock);
+	copy_entry_t *entry = copies ? hashtable_search(copies, key) : NULL;
+	if (entry) {
+		strcpy(copy, entry->path);
+		copy_st = *entry;
+	}
+	pthread_mutex_unlock(&copies_lock);
+
+	if (!entry) return -1;
+
+	// we already hold the lock of path, so we must not wait for another
+	// one; if the copy is busy, path just gets a copy of its own
+	if (path_trylock(copy)) return -1;
+
+	// the copy might have been removed, replaced or modified, or the
+	// branches changed
+	struct stat now;
+	int res = -1;
+	if (branch_lstat(branch_rw, copy, &now) == 0 && same_copy(&copy_st, &now, st)) {
+		res = branch_link(branch_rw, copy, path);
+	}
+
+	path_unlock(copy, NULL);
+	return res;
+}
+
+/**
+ * Remember path on branch_rw as the copy of the lower file st
+ */
+static void remember_copy(const char *path, int branch_rw, const struct stat *st) {
+	struct stat copy_st;
+	if (branch_lstat(branch_rw, path, &copy_st) == -1) return;
+
+	char key[80];
+	copy_key(key, sizeof(key), branch_rw, st);
 
-	cow.from_path = from;
-	cow.to_path = to;
+	copy_entry_t *entry = malloc(sizeof(copy_entry_t) + strlen(path) + 1);
+	char *k = strdup(key);
+	if (!entry || !k) goto err;
+
+	entry->dev = copy_st.st_dev;
+	entry->ino = copy_st.st_ino;
+	strcpy(entry->path, path);
+
+	pthread_mutex_lock(&copies_lock);
+
+	if (copies && hashtable_count(copies) >= COPIES_MAX) {
+		hashtable_destroy(copies, 1);
+		copies = NULL;
+	}
+	if (!copies) copies = create_hashtable(256, string_hash, string_equal);
+
+	free(hashtable_remove(copies, k));
+	bool inserted = copies && hashtable_insert(copies, k, entry);
+
+	pthread_mutex_unlock(&copies_lock);
+
+	if (inserted) return;
+
+err:
+	free(entry);
+	free(k);
+}
+
+/**
+ * cow_cp() for link(). Lower files with several links (e.g. from a package
+ * manager deduplicating files) are only copied once per rw-branch, further
+ * names of them are linked to that first copy. Otherwise every link() to
+ * another name would copy the data again, and the links would not share
+ * their data as they did on the lower branch.
+ */
+int cow_cp_link(const char *path, int branch_ro, int branch_rw) {
+	DBG("%s\n", path);
+
+	struct stat st;
+	if (branch_lstat(branch_ro, path, &st) == -1) RETURN(1);
+
+	if (S_ISDIR(st.st_mode) || st.st_nlink < 2) RETURN(cow_cp(path, branch_ro, branch_rw, false));
+
+	path_create_cutlast(path, branch_ro, branch_rw);
+
+	if (link_to_copy(path, branch_rw, &st) == 0) {
+		DBG("%s: linked to an earlier copy\n", path);
+		cache_invalidate(path);
+		RETURN(0);
+	}
+
+	int res = cow_cp(path, branch_ro, branch_rw, false);
+	if (res == 0) remember_copy(path, branch_rw, &st);
+
+	RETURN(res);
+}
+
+struct copy_to_state {
+	const char *path;
+	int branch;
+	const char *to_path;
+	int to_branch;
+	int res;
+};
+
+static int copy_to_entry(void *priv, const char *name, ino_t ino, unsigned char type) {
+	(void)ino;
+	(void)type;
+
+	struct copy_to_state *state = priv;
+
+	if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) return 0;
+
+	char member[PATHLEN_MAX], to_member[PATHLEN_MAX];
+	if (BUILD_PATH(member, state->path, "/", name)
+	||  BUILD_PATH(to_member, state->to_path, "/", name)) {
+		state->res = 1;
+		return 1;
+	}
+	state->res = cow_cp_to(member, state->branch, to_member, state->to_branch);
+
+	return state->res;
+}
+
+/**
+ * Copy path of branch to to_path on to_branch, directories with all of their
+ * contents. Unlike cow_cp() the name may change, so the parent directory of
+ * to_path has to exist already. Used by rename() across branches.
+ */
+int cow_cp_to(const char *path, int branch, const char *to_path, int to_branch) {
+	DBG("%s to %s\n", path, to_path);
+
+	struct cow cow;
+	cow_init(&cow, branch, path, to_branch, to_path);
 
 	struct stat buf;
-	lstat(cow.from_path, &buf);
+	if (branch_lstat(branch, path, &buf) == -1) RETURN(1);
 	cow.stat = &buf;
 
+	if (!S_ISDIR(buf.st_mode)) RETURN(copy_nondir(&cow));
+
+	// writable for us until all contents are there
+	if (branch_mkdir(to_branch, to_path, S_IRWXU) == -1) RETURN(1);
+
+	struct copy_to_state state = {
+		.path = path,
+		.branch = branch,
+		.to_path = to_path,
+		.to_branch = to_branch,
+		.res = 0,
+	};
+
+	if (branch_readdir(branch, path, copy_to_entry, &state) == -1) RETURN(1);
+	if (state.res) RETURN(state.res);
+
+	RETURN(setfile(to_branch, to_path, &buf));
+}
+
+struct copy_dir_state {
+	const char *path;
+	int branch_ro;
+	int branch_rw;
 	int res;
-	switch (buf.st_mode & S_IFMT) {
-		case S_IFLNK:
-			res = copy_link(&cow);
-			break;
-		case S_IFDIR:
-			if (copy_dir) {
-				res = copy_directory(path, branch_ro, branch_rw);
-			} else {
-				res = path_create(path, branch_ro, branch_rw);
-			}
-			break;
-		case S_IFBLK:
-		case S_IFCHR:
-			res = copy_special(&cow);
-			break;
-		case S_IFIFO:
-			res = copy_fifo(&cow);
-			break;
-		case S_IFSOCK:
-			USYSLOG(LOG_WARNING, "COW of sockets not supported: %s\n", cow.from_path);
-			RETURN(1);
-		default:
-			res = copy_file(&cow);
+};
+
+static int copy_entry(void *priv, const char *name, ino_t ino, unsigned char type) {
+	(void)ino;
+	(void)type;
+
+	struct copy_dir_state *state = priv;
+
+	if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) return 0;
+
+	char member[PATHLEN_MAX];
+	if (BUILD_PATH(member, state->path, "/", name)) {
+		state->res = 1;
+		return 1;
 	}
+	state->res = cow_cp(member, state->branch_ro, state->branch_rw, true);
 
-	RETURN(res);
+	return state->res;
 }
 
 /**
@@ -195,27 +432,15 @@ int copy_directory(const char *path, int branch_ro, int branch_rw) {
 		RETURN(res);
 	}
 
-	/* determine path to source directory on read-only branch */
-	char from[PATHLEN_MAX];
-	if (BUILD_PATH(from, uopt.branches[branch_ro].path, path)) RETURN(1);
+	struct copy_dir_state state = {
+		.path = path,
+		.branch_ro = branch_ro,
+		.branch_rw = branch_rw,
+		.res = 0,
+	};
 
-	DIR *dp = opendir(from);
-	if (dp == NULL) RETURN(1);
+	if (branch_readdir(branch_ro, path, copy_entry, &state) == -1) RETURN(1);
 
-	struct dirent *de;
-	while ((de = readdir(dp)) != NULL) {
-		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
-
-		char member[PATHLEN_MAX];
-		if (BUILD_PATH(member, path, "/", de->d_name)) {
-			res = 1;
-			break;
-		}
-		res = cow_cp(member, branch_ro, branch_rw, true);
-		if (res != 0) break;
-	}
-
-	closedir(dp);
-	RETURN(res);
+	RETURN(state.res);
 }
 
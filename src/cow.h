@@ -13,5 +13,7 @@ int cow_cp(const char *path, int branch_ro, int branch_rw, bool copy_dir);
 int path_create(const char *path, int nbranch_ro, int nbranch_rw);
 int path_create_cutlast(const char *path, int nbranch_ro, int nbranch_rw);
 int copy_directory(const char *path, int branch_ro, int branch_rw);
+int cow_cp_link(const char *path, int branch_ro, int branch_rw);
+int cow_cp_to(const char *path, int branch, const char *to_path, int to_branch);
 
 #endif
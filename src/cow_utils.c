@@ -38,15 +38,21 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <utime.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+
+#ifdef __linux__
+#include <linux/fs.h> // FICLONE
+#endif
 
 #include "unionfs.h"
 #include "cow_utils.h"
 #include "debug.h"
 #include "general.h"
 #include "usyslog.h"
+#include "branch.h"
 
 // BSD seems to know S_ISTXT itself
 #ifndef S_ISTXT
@@ -56,18 +62,18 @@
 /**
  * set the stat() data of a file
  **/
-int setfile(const char *path, struct stat *fs)
+int setfile(int branch, const char *path, struct stat *fs)
 {
 	DBG("%s\n", path);
 
-	struct utimbuf ut;
+	struct timespec ts[2];
 	int rval = 0;
 
 	fs->st_mode &= S_ISUID | S_ISGID | S_ISTXT | S_IRWXU | S_IRWXG | S_IRWXO;
 
-	ut.actime  = fs->st_atime;
-	ut.modtime = fs->st_mtime;
-	if (utime(path, &ut)) {
+	ts[0] = fs->st_atim;
+	ts[1] = fs->st_mtim;
+	if (branch_utimens(branch, path, ts)) {
 		USYSLOG(LOG_WARNING,   "utimes: %s", path);
 		rval = 1;
 	}
@@ -77,7 +83,7 @@ int setfile(const char *path, struct stat *fs)
 	* the mode; current BSD behavior is to remove all setuid bits on
 	* chown.  If chown fails, lose setuid/setgid bits.
 	*/
-	if (chown(path, fs->st_uid, fs->st_gid)) {
+	if (branch_chown(branch, path, fs->st_uid, fs->st_gid)) {
 		if (errno != EPERM) {
 			USYSLOG(LOG_WARNING,   "chown: %s", path);
 			rval = 1;
@@ -85,7 +91,7 @@ int setfile(const char *path, struct stat *fs)
 		fs->st_mode &= ~(S_ISTXT | S_ISUID | S_ISGID);
 	}
 	
-	if (chmod(path, fs->st_mode)) {
+	if (branch_chmod(branch, path, fs->st_mode)) {
 		USYSLOG(LOG_WARNING,   "chown: %s", path);
 		rval = 1;
 	}
@@ -98,8 +104,11 @@ int setfile(const char *path, struct stat *fs)
 		 * if the server supports flags and we were trying to *remove* flags
 		 * on a file that we copied, i.e., that we didn't create.)
 		 */
+		char p[PATHLEN_MAX];
 		errno = 0;
-		if (chflags(path, fs->st_flags)) {
+		if (uopt.branches[branch].ops == &dir_ops
+		&&  !BUILD_PATH(p, uopt.branches[branch].path, path)
+		&&  chflags(p, fs->st_flags)) {
 			if (errno != EOPNOTSUPP || fs->st_flags != 0) {
 				USYSLOG(LOG_WARNING,   "chflags: %s", path);
 				rval = 1;
@@ -113,11 +122,11 @@ int setfile(const char *path, struct stat *fs)
 /**
  * set the stat() data of a link
  **/
-static int setlink(const char *path, struct stat *fs)
+static int setlink(int branch, const char *path, struct stat *fs)
 {
 	DBG("%s\n", path);
 
-	if (lchown(path, fs->st_uid, fs->st_gid)) {
+	if (branch_chown(branch, path, fs->st_uid, fs->st_gid)) {
 		if (errno != EPERM) {
 			USYSLOG(LOG_WARNING,   "lchown: %s", path);
 			RETURN(1);
@@ -127,84 +136,154 @@ static int setlink(const char *path, struct stat *fs)
 }
 
 
+/**
+ * Let the filesystem share the data blocks of from_fd with to_fd (reflink),
+ * which makes the copy O(1) in time and space on btrfs, xfs and alike.
+ * Fails with EOPNOTSUPP/EXDEV/EINVAL if this is not possible.
+ **/
+static int clone_file(int from_fd, int to_fd)
+{
+#ifdef FICLONE
+	return ioctl(to_fd, FICLONE, from_fd);
+#else
+	(void)from_fd;
+	(void)to_fd;
+	errno = EOPNOTSUPP;
+	return -1;
+#endif
+}
+
+/**
+ * Copy size bytes with copy_file_range(), which keeps the data within the
+ * kernel and lets e.g. NFS copy on the server. Fails if the kernel or the
+ * filesystems do not support it, the caller then copies on its own.
+ **/
+static int copy_range(int from_fd, int to_fd, off_t size)
+{
+#ifdef SYS_copy_file_range
+	while (size > 0) {
+		ssize_t res = syscall(SYS_copy_file_range, from_fd, NULL, to_fd, NULL, (size_t)size, 0);
+		if (res == -1 && errno == EINTR) continue;
+		if (res <= 0) return -1;
+		size -= res;
+	}
+	return 0;
+#else
+	(void)from_fd;
+	(void)to_fd;
+	(void)size;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/**
+ * write all of buf at offset, even if the branch takes it in pieces
+ **/
+static int write_all(branch_file_t *file, const char *buf, size_t size, off_t offset)
+{
+	while (size > 0) {
+		ssize_t res = branch_write(file, buf, size, offset);
+		if (res == -1) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		buf += res;
+		size -= res;
+		offset += res;
+	}
+	return 0;
+}
+
 /**
  * copy an ordinary file with all of its stat() data
  **/
 int copy_file(struct cow *cow)
 {
-	DBG("from %s to %s\n", cow->from_path, cow->to_path);
+	DBG("%s from branch %d to %d\n", cow->path, cow->branch, cow->to_branch);
 
-	static char buf[MAXBSIZE];
+	char buf[MAXBSIZE]; // not static, we might be called from several threads
 	struct stat to_stat, *fs;
-	int from_fd, rcount, to_fd, wcount;
+	branch_file_t from, to;
+	ssize_t rcount;
+	off_t offset = 0;
 	int rval = 0;
 #ifdef VM_AND_BUFFER_CACHE_SYNCHRONIZED
 	char *p;
 #endif
 
-	if ((from_fd = open(cow->from_path, O_RDONLY, 0)) == -1) {
-		USYSLOG(LOG_WARNING, "%s", cow->from_path);
+	if (branch_open(cow->branch, cow->path, O_RDONLY, 0, &from) == -1) {
+		USYSLOG(LOG_WARNING, "%s", cow->path);
 		RETURN(1);
 	}
 
 	fs = cow->stat;
 
-	to_fd = open(cow->to_path, O_WRONLY | O_TRUNC | O_CREAT,
-	             fs->st_mode & ~(S_ISTXT | S_ISUID | S_ISGID));
-
-	if (to_fd == -1) {
+	if (branch_open(cow->to_branch, cow->to_path, O_WRONLY | O_TRUNC | O_CREAT,
+	                fs->st_mode & ~(S_ISTXT | S_ISUID | S_ISGID), &to) == -1) {
 		USYSLOG(LOG_WARNING, "%s", cow->to_path);
-		(void)close(from_fd);
+		(void)branch_close(&from);
 		RETURN(1);
 	}
 
+	if (from.data) {
+		// the branch serves the file from memory, e.g. an image
+		if (write_all(&to, from.data, from.size, 0)) {
+			USYSLOG(LOG_WARNING,   "%s", cow->to_path);
+			rval = 1;
+		}
+	} else if (from.fd != -1 && to.fd != -1 && clone_file(from.fd, to.fd) == 0) {
+		DBG("%s: data blocks shared\n", cow->to_path);
+	} else if (from.fd != -1 && to.fd != -1 && copy_range(from.fd, to.fd, fs->st_size) == 0) {
+		DBG("%s: copied within the kernel\n", cow->to_path);
+	} else
 	/*
 	 * Mmap and write if less than 8M (the limit is so we don't totally
 	 * trash memory on big files.  This is really a minor hack, but it
 	 * wins some CPU back.
 	 */
 #ifdef VM_AND_BUFFER_CACHE_SYNCHRONIZED
-	if (fs->st_size > 0 && fs->st_size <= 8 * 1048576) {
+	if (from.fd != -1 && fs->st_size > 0 && fs->st_size <= 8 * 1048576) {
 		if ((p = mmap(NULL, (size_t)fs->st_size, PROT_READ,
-		    MAP_FILE|MAP_SHARED, from_fd, (off_t)0)) == MAP_FAILED) {
-			USYSLOG(LOG_WARNING,   "mmap: %s", cow->from_path);
+		    MAP_FILE|MAP_SHARED, from.fd, (off_t)0)) == MAP_FAILED) {
+			USYSLOG(LOG_WARNING,   "mmap: %s", cow->path);
 			rval = 1;
 		} else {
 			madvise(p, fs->st_size, MADV_SEQUENTIAL);
-			if (write(to_fd, p, fs->st_size) != fs->st_size) {
+			if (write_all(&to, p, fs->st_size, 0)) {
 				USYSLOG(LOG_WARNING,   "%s", cow->to_path);
 				rval = 1;
 			}
 			/* Some systems don't unmap on close(2). */
 			if (munmap(p, fs->st_size) < 0) {
-				USYSLOG(LOG_WARNING,   "%s", cow->from_path);
+				USYSLOG(LOG_WARNING,   "%s", cow->path);
 				rval = 1;
 			}
 		}
 	} else
 #endif
 	{
-		while ((rcount = read(from_fd, buf, MAXBSIZE)) > 0) {
-			wcount = write(to_fd, buf, rcount);
-			if (rcount != wcount || wcount == -1) {
+		while ((rcount = branch_read(&from, buf, MAXBSIZE, offset)) > 0) {
+			if (write_all(&to, buf, rcount, offset)) {
 				USYSLOG(LOG_WARNING,   "%s", cow->to_path);
 				rval = 1;
 				break;
 			}
+			offset += rcount;
 		}
 		if (rcount < 0) {
-			USYSLOG(LOG_WARNING,   "copy failed: %s", cow->from_path);
+			USYSLOG(LOG_WARNING,   "copy failed: %s", cow->path);
 			rval = 1;
 		}
 	}
 
 	if (rval == 1) {
-		(void)close(from_fd);
-		(void)close(to_fd);
+		(void)branch_close(&from);
+		(void)branch_close(&to);
 		RETURN(1);
 	}
 
-	if (setfile(cow->to_path, cow->stat))
+	if (setfile(cow->to_branch, cow->to_path, cow->stat))
 		rval = 1;
 	/*
 	 * If the source was setuid or setgid, lose the bits unless the
@@ -213,17 +292,17 @@ int copy_file(struct cow *cow)
 #define	RETAINBITS \
 	(S_ISUID | S_ISGID | S_ISVTX | S_IRWXU | S_IRWXG | S_IRWXO)
 	else if (fs->st_mode & (S_ISUID | S_ISGID) && fs->st_uid == cow->uid) {
-		if (fstat(to_fd, &to_stat)) {
+		if (branch_lstat(cow->to_branch, cow->to_path, &to_stat)) {
 			USYSLOG(LOG_WARNING,   "%s", cow->to_path);
 			rval = 1;
 		} else if (fs->st_gid == to_stat.st_gid &&
-		    fchmod(to_fd, fs->st_mode & RETAINBITS & ~cow->umask)) {
+		    branch_chmod(cow->to_branch, cow->to_path, fs->st_mode & RETAINBITS & ~cow->umask)) {
 			USYSLOG(LOG_WARNING,   "%s", cow->to_path);
 			rval = 1;
 		}
 	}
-	(void)close(from_fd);
-	if (close(to_fd)) {
+	(void)branch_close(&from);
+	if (branch_close(&to)) {
 		USYSLOG(LOG_WARNING,   "%s", cow->to_path);
 		rval = 1;
 	}
@@ -236,24 +315,24 @@ int copy_file(struct cow *cow)
  */
 int copy_link(struct cow *cow)
 {
-	DBG("from %s to %s\n", cow->from_path, cow->to_path);
+	DBG("%s from branch %d to %d\n", cow->path, cow->branch, cow->to_branch);
 
 	int len;
 	char link[PATHLEN_MAX];
 
-	if ((len = readlink(cow->from_path, link, sizeof(link)-1)) == -1) {
-		USYSLOG(LOG_WARNING,   "readlink: %s", cow->from_path);
+	if ((len = branch_readlink(cow->branch, cow->path, link, sizeof(link)-1)) == -1) {
+		USYSLOG(LOG_WARNING,   "readlink: %s", cow->path);
 		RETURN(1);
 	}
 
 	link[len] = '\0';
 	
-	if (symlink(link, cow->to_path)) {
+	if (branch_symlink(cow->to_branch, link, cow->to_path)) {
 		USYSLOG(LOG_WARNING,   "symlink: %s", link);
 		RETURN(1);
 	}
 	
-	RETURN(setlink(cow->to_path, cow->stat));
+	RETURN(setlink(cow->to_branch, cow->to_path, cow->stat));
 }
 
 /**
@@ -262,13 +341,13 @@ int copy_link(struct cow *cow)
  **/
 int copy_fifo(struct cow *cow)
 {
-	DBG("from %s to %s\n", cow->from_path, cow->to_path);
+	DBG("%s from branch %d to %d\n", cow->path, cow->branch, cow->to_branch);
 
-	if (mkfifo(cow->to_path, cow->stat->st_mode)) {
+	if (branch_mknod(cow->to_branch, cow->to_path, S_IFIFO | (cow->stat->st_mode & S_PROT_MASK), 0)) {
 		USYSLOG(LOG_WARNING,   "mkfifo: %s", cow->to_path);
 		RETURN(1);
 	}
-	RETURN(setfile(cow->to_path, cow->stat));
+	RETURN(setfile(cow->to_branch, cow->to_path, cow->stat));
 }
 
 /**
@@ -277,11 +356,11 @@ int copy_fifo(struct cow *cow)
  */
 int copy_special(struct cow *cow)
 {
-	DBG("from %s to %s\n", cow->from_path, cow->to_path);
+	DBG("%s from branch %d to %d\n", cow->path, cow->branch, cow->to_branch);
 
-	if (mknod(cow->to_path, cow->stat->st_mode, cow->stat->st_rdev)) {
+	if (branch_mknod(cow->to_branch, cow->to_path, cow->stat->st_mode, cow->stat->st_rdev)) {
 		USYSLOG(LOG_WARNING,   "mknod: %s", cow->to_path);
 		RETURN(1);
 	}
-	RETURN(setfile(cow->to_path, cow->stat));
+	RETURN(setfile(cow->to_branch, cow->to_path, cow->stat));
 }
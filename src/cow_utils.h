@@ -15,14 +15,16 @@ struct cow {
 	uid_t uid;
 
 	// source file
-	char  *from_path;
 	struct stat *stat;
+	int branch;		// branch of the source file
+	const char *path;	// path of the source file within branch
 
 	// destination file
-	char *to_path;
+	int to_branch;
+	const char *to_path;	// path within to_branch
 };
 
-int setfile(const char *path, struct stat *fs);
+int setfile(int branch, const char *path, struct stat *fs);
 int copy_special(struct cow *cow);
 int copy_fifo(struct cow *cow);
 int copy_link(struct cow *cow);
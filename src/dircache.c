@@ -0,0 +1,289 @@
+/*
+*  C Implementation: dircache
+*
+* Description: Complete listings of directories, to answer lookups
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+*
+* Details:
+*	After unionfs_readdir() merged a directory, we know every name within
+*	it and the branch serving it. configure scripts and interpreters
+*	searching their module paths then look up lots of names which do not
+*	exist, each costing an lstat() per branch. So readdir() hands its
+*	table of names over to us and find_rorw_branch() answers lookups
+*	within the directory from it, present names as well as missing ones.
+*	Reading the directory again, e.g. the next "ls", is served from it as
+*	well. The kernel could cache listings itself, but libfuse 2 has no
+*	way to ask for it (FOPEN_CACHE_DIR), so we at least save the scan of
+*	all branches and whiteouts.
+*	Entries are dropped by cache_invalidate() of any path within the
+*	directory or of the directory itself. Operations invalidate after
+*	they modified a branch, so a listing racing with them is either
+*	dropped or, as with the symlink cache, not added at all because the
+*	generation changed since readdir() started.
+*	Listings of our meta data directory are never kept, whiteouts are
+*	created there without invalidating anything.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "unionfs.h"
+#include "opts.h"
+#include "debug.h"
+#include "hashtable.h"
+#include "hashtable_itr.h"
+#include "string.h"
+#include "cache.h"
+#include "uioctl.h"
+#include "policy.h"
+#include "dircache.h"
+
+#define DIR_CACHE_MAX (1024 * 1024) // flush the cache if it holds more names
+
+/**
+ * The names of a directory. They never change, so a listing can be read
+ * without the lock while it is referenced.
+ */
+typedef struct {
+	unsigned int refs;	// one of dirs, one of each reader
+	struct hashtable *names;	// see dircache_set()
+} listing_t;
+
+static struct hashtable *dirs;		// path -> listing_t
+static pthread_rwlock_t dirs_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static unsigned int generation;		// increased on every invalidation
+static unsigned int names;		// names of all directories
+
+static uint64_t hits;
+static uint64_t misses;
+
+void dircache_init(void) {
+	dirs = cache_create(256);
+}
+
+static void put_listing(listing_t *listing) {
+	if (__sync_sub_and_fetch(&listing->refs, 1) > 0) return;
+
+	hashtable_destroy(listing->names, 1);
+	free(listing);
+}
+
+/**
+ * Free function for the entries of dirs
+ */
+static void free_listing(void *data) {
+	listing_t *listing = data;
+
+	names -= hashtable_count(listing->names);
+	put_listing(listing);
+}
+
+/**
+ * Check if path is our meta data directory or within it
+ */
+static bool is_meta(const char *path) {
+	size_t len = strlen("/" METANAME);
+	return strncmp(path, "/" METANAME, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+/**
+ * Split path into its directory, written to dir, and its name
+ */
+static const char *split(const char *path, char *dir) {
+	const char *name = strrchr(path, '/');
+	if (!name || name[1] == '\0') return NULL;
+
+	size_t len = name - path;
+	if (len == 0) len = 1; // the root directory keeps its slash
+	if (len >= PATHLEN_MAX) return NULL;
+
+	memcpy(dir, path, len);
+	dir[len] = '\0';
+
+	return name + 1;
+}
+
+/**
+ * Look path up in the listing of its directory. Returns true if there is
+ * one, *branch is then the branch serving path or -1 if it does not exist.
+ */
+bool dircache_get(const char *path, int *branch) {
+	if (!uopt.dir_cache) return false;
+
+	char dir[PATHLEN_MAX];
+	const char *name = split(path, dir);
+	if (!name) return false;
+
+	pthread_rwlock_rdlock(&dirs_lock);
+
+	listing_t *listing = cache_search(dirs, dir);
+	if (listing) {
+		dircache_entry_t *entry = hashtable_search(listing->names, (void *)name);
+		*branch = entry ? entry->branch : -1;
+	}
+
+	pthread_rwlock_unlock(&dirs_lock);
+
+	if (listing) {
+		__sync_fetch_and_add(&hits, 1);
+		DBG("%s: cached %d\n", path, *branch);
+		return true;
+	}
+
+	__sync_fetch_and_add(&misses, 1);
+	return false;
+}
+
+/**
+ * Get the generation to be given to dircache_set() later on, this has to
+ * be called before reading the directory.
+ */
+unsigned int dircache_generation(void) {
+	return __sync_fetch_and_add(&generation, 0);
+}
+
+/**
+ * Remember the complete listing of path. list is a table of string_hash()
+ * with every name of the directory as key and a dircache_entry_t as value.
+ * We take it over, it is freed if it is not needed.
+ */
+void dircache_set(const char *path, struct hashtable *list, unsigned int gen) {
+	if (!uopt.dir_cache || is_meta(path) || (policy_of(path) & POLICY_NOCACHE)) {
+		hashtable_destroy(list, 1);
+		return;
+	}
+
+	listing_t *listing = malloc(sizeof(listing_t));
+	if (!listing) {
+		hashtable_destroy(list, 1);
+		return;
+	}
+	listing->refs = 1;
+	listing->names = list;
+
+	pthread_rwlock_wrlock(&dirs_lock);
+
+	// an invalidation in the mean time, the listing might be outdated
+	if (gen != generation || cache_search(dirs, path)) {
+		put_listing(listing);
+		goto out;
+	}
+
+	unsigned int count = hashtable_count(list);
+	if (names + count > DIR_CACHE_MAX) {
+		DBG("dir cache full, flushing it\n");
+		cache_flush(dirs, free_listing);
+	}
+
+	if (!cache_insert(dirs, path, listing)) {
+		put_listing(listing);
+		goto out;
+	}
+	names += count;
+
+out:
+	pthread_rwlock_unlock(&dirs_lock);
+}
+
+/**
+ * Call filler for every name of the listing of path, returns false if there
+ * is none. Stops as soon as filler returns non-zero.
+ */
+bool dircache_list(const char *path, dircache_filler_t filler, void *priv) {
+	if (!uopt.dir_cache) return false;
+
+	pthread_rwlock_rdlock(&dirs_lock);
+
+	listing_t *listing = cache_search(dirs, path);
+	if (listing) __sync_fetch_and_add(&listing->refs, 1);
+
+	pthread_rwlock_unlock(&dirs_lock);
+
+	if (!listing) {
+		__sync_fetch_and_add(&misses, 1);
+		return false;
+	}
+
+	// the filler might look up names itself, so the lock is not held
+	struct hashtable_itr *itr = hashtable_count(listing->names) ? hashtable_iterator(listing->names) : NULL;
+	bool more = itr != NULL;
+	while (more) {
+		if (filler(priv, hashtable_iterator_key(itr), hashtable_iterator_value(itr))) break;
+		more = hashtable_iterator_advance(itr);
+	}
+	free(itr);
+
+	put_listing(listing);
+
+	__sync_fetch_and_add(&hits, 1);
+	DBG("%s: cached listing\n", path);
+	return true;
+}
+
+static void remove_dir(const char *path) {
+	listing_t *listing = cache_remove(dirs, path);
+	if (listing) free_listing(listing);
+}
+
+/**
+ * path was created, removed or changed its branch: its directory has to be
+ * read again, and so has path itself if it is a directory
+ */
+void dircache_invalidate(const char *path) {
+	if (!uopt.dir_cache) return;
+
+	char dir[PATHLEN_MAX];
+	const char *name = split(path, dir);
+
+	pthread_rwlock_wrlock(&dirs_lock);
+
+	generation++;
+	if (name) remove_dir(dir);
+	remove_dir(path);
+
+	pthread_rwlock_unlock(&dirs_lock);
+}
+
+void dircache_invalidate_tree(const char *path) {
+	if (!uopt.dir_cache) return;
+
+	char dir[PATHLEN_MAX];
+	const char *name = split(path, dir);
+
+	pthread_rwlock_wrlock(&dirs_lock);
+
+	generation++;
+	if (name) remove_dir(dir);
+	cache_remove_tree(dirs, path, free_listing);
+
+	pthread_rwlock_unlock(&dirs_lock);
+}
+
+/**
+ * The branches changed, see cache_forget_branch(). Every listing holds
+ * names of all branches, so none of them is valid anymore.
+ */
+void dircache_flush(void) {
+	if (!uopt.dir_cache) return;
+
+	pthread_rwlock_wrlock(&dirs_lock);
+
+	generation++;
+	cache_flush(dirs, free_listing);
+
+	pthread_rwlock_unlock(&dirs_lock);
+}
+
+void dircache_stats(struct unionfs_stats *stats) {
+	stats->dir_cache_hits = hits;
+	stats->dir_cache_misses = misses;
+}
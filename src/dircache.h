@@ -0,0 +1,38 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#ifndef DIRCACHE_H
+#define DIRCACHE_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "hashtable.h"
+
+struct unionfs_stats;
+
+/**
+ * A name of a listing, see dircache_set()
+ */
+typedef struct {
+	int branch;		// serving the name
+	unsigned char type;	// d_type
+	ino_t ino;		// d_ino
+} dircache_entry_t;
+
+typedef int (*dircache_filler_t)(void *priv, const char *name, const dircache_entry_t *entry);
+
+void dircache_init(void);
+bool dircache_get(const char *path, int *branch);
+unsigned int dircache_generation(void);
+void dircache_set(const char *path, struct hashtable *list, unsigned int generation);
+bool dircache_list(const char *path, dircache_filler_t filler, void *priv);
+void dircache_invalidate(const char *path);
+void dircache_invalidate_tree(const char *path);
+void dircache_flush(void);
+void dircache_stats(struct unionfs_stats *stats);
+
+#endif
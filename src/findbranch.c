@@ -50,6 +50,8 @@
 #include "string.h"
 #include "debug.h"
 #include "usyslog.h"
+#include "branch.h"
+#include "dircache.h"
 
 /**
  *  Find a branch that has "path". Return the branch number.
@@ -59,13 +61,10 @@ static int find_branch(const char *path, searchflag_t flag) {
 
 	int i = 0;
 	for (i = 0; i < uopt.nbranches; i++) {
-		char p[PATHLEN_MAX];
-		if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
-
 		struct stat stbuf;
-		int res = lstat(p, &stbuf);
+		int res = branch_lstat(i, path, &stbuf);
 
-		DBG("%s: res = %d\n", p, res);
+		DBG("%s%s: res = %d\n", uopt.branches[i].path, path, res);
 
 		if (res == 0) { // path was found
 			switch (flag) {
@@ -102,6 +101,13 @@ static int find_branch(const char *path, searchflag_t flag) {
  */
 int find_rorw_branch(const char *path) {
 	DBG("%s\n", path);
+
+	int branch;
+	if (dircache_get(path, &branch)) {
+		if (branch == -1) errno = ENOENT;
+		RETURN(branch);
+	}
+
 	int res = find_branch(path, RWRO);
 	RETURN(res);
 }
@@ -179,8 +185,14 @@ int find_rw_branch_cutlast(const char *path) {
 	RETURN(res);
 }
 
-int find_rw_branch_cow(const char *path) {
-	return find_rw_branch_cow_common(path, false);
+static unsigned long copy_ups;	// files copied up so far
+
+/**
+ * Number of files copied up so far, e.g. to check if an open file of a
+ * lower branch might have got a copy in the meantime
+ */
+unsigned long copy_up_count(void) {
+	return __atomic_load_n(&copy_ups, __ATOMIC_ACQUIRE);
 }
 
 /**
@@ -191,7 +203,7 @@ int find_rw_branch_cow(const char *path) {
  *       It will definitely fail, when a ro-branch is on top of a rw-branch
  *       and a directory is to be copied from ro- to rw-branch.
  */
-int find_rw_branch_cow_common(const char *path, bool copy_dir) {
+static int cow_branch(const char *path, bool copy_dir, bool link) {
 	DBG("%s\n", path);
 
 	int branch_rorw = find_rorw_branch(path);
@@ -215,14 +227,36 @@ int find_rw_branch_cow_common(const char *path, bool copy_dir) {
 		RETURN(-1);
 	}
 
-	if (cow_cp(path, branch_rorw, branch_rw, copy_dir)) RETURN(-1);
+	int res;
+	if (link)
+		res = cow_cp_link(path, branch_rorw, branch_rw);
+	else
+		res = cow_cp(path, branch_rorw, branch_rw, copy_dir);
+	if (res) RETURN(-1);
 
 	// remove a file that might hide the copied file
 	remove_hidden(path, branch_rw);
 
+	__atomic_add_fetch(&copy_ups, 1, __ATOMIC_RELEASE);
+
 	RETURN(branch_rw);
 }
 
+int find_rw_branch_cow(const char *path) {
+	return cow_branch(path, false, false);
+}
+
+int find_rw_branch_cow_common(const char *path, bool copy_dir) {
+	return cow_branch(path, copy_dir, false);
+}
+
+/**
+ * find_rw_branch_cow() for link(), see cow_cp_link()
+ */
+int find_rw_branch_cow_link(const char *path) {
+	return cow_branch(path, false, true);
+}
+
 /**
  * Find lowest possible writable branch but only lower than branch_ro.
  */
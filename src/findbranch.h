@@ -17,6 +17,8 @@ int find_lowest_rw_branch(int branch_ro);
 int find_rw_branch_cutlast(const char *path);
 int __find_rw_branch_cutlast(const char *path, int rw_hint);
 int find_rw_branch_cow(const char *path);
+int find_rw_branch_cow_link(const char *path);
 int find_rw_branch_cow_common(const char *path, bool copy_dir);
+unsigned long copy_up_count(void);
 
 #endif
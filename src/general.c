@@ -31,21 +31,18 @@
 #include "general.h"
 #include "debug.h"
 #include "usyslog.h"
+#include "branch.h"
+#include "hide.h"
+#include "cache.h"
 
 /**
- * Check if a file or directory with the hidden flag exists.
+ * Check if the whiteout of a file or directory exists on branch.
  */
-static int filedir_hidden(const char *path) {
-	// cow mode disabled, no need for hidden files
-	if (!uopt.cow_enabled) RETURN(false);
-	
-	char p[PATHLEN_MAX];
-	if (strlen(path) + strlen(HIDETAG) > PATHLEN_MAX) RETURN(-ENAMETOOLONG);
-	snprintf(p, PATHLEN_MAX, "%s%s", path, HIDETAG); 
-	DBG("%s\n", p);
+static int filedir_hidden(const char *whiteout, int branch) {
+	DBG("%s\n", whiteout);
 
 	struct stat stbuf;
-	int res = lstat(p, &stbuf);
+	int res = branch_lstat(branch, whiteout, &stbuf);
 	if (res == 0) RETURN(1);
 
 	RETURN(0);
@@ -59,28 +56,31 @@ int path_hidden(const char *path, int branch) {
 
 	if (!uopt.cow_enabled) RETURN(false);
 
-	char whiteoutpath[PATHLEN_MAX];
-	if (BUILD_PATH(whiteoutpath, uopt.branches[branch].path, METADIR, path)) RETURN(false);
+	// relative to the branch root, with room for the tag after any element
+	char whiteoutpath[PATHLEN_MAX + sizeof(HIDETAG)];
+	if (BUILD_PATH(whiteoutpath, METADIR, path)) RETURN(false);
 
 	// -1 as we MUST not end on the next path element 
-	char *walk = whiteoutpath + uopt.branches[branch].path_len + strlen(METADIR) - 1;
+	char *walk = whiteoutpath + strlen(METADIR) - 1;
 
 	// first slashes, e.g. we have path = /dir1/dir2/, will set walk = dir1/dir2/
-	while (*walk != '\0' && *walk == '/') walk++;
+	walk += strspn(walk, "/");
 
 	do {
 		// walk over the directory name, walk will now be /dir2
-		while (*walk != '\0' && *walk != '/') walk++;
-	
-		// +1 due to \0, which gets added automatically
-		char p[PATHLEN_MAX];
-		// walk - path = strlen(/dir1)
-		snprintf(p, (walk - whiteoutpath) + 1, "%s", whiteoutpath);
-		int res = filedir_hidden(p);
+		walk += strcspn(walk, "/");
+
+		// temporarily put the tag right behind the element, which
+		// saves a copy of the path for every element
+		char saved[sizeof(HIDETAG)];
+		memcpy(saved, walk, sizeof(HIDETAG));
+		memcpy(walk, HIDETAG, sizeof(HIDETAG));
+		int res = filedir_hidden(whiteoutpath, branch);
+		memcpy(walk, saved, sizeof(HIDETAG));
 		if (res) RETURN(res); // path is hidden or error
 
 		// as above the do loop, walk over the next slashes, walk = dir2/
-		while (*walk != '\0' && *walk == '/') walk++;
+		walk += strspn(walk, "/");
 	} while (*walk != '\0');
 
 	RETURN(0);
@@ -95,36 +95,88 @@ int remove_hidden(const char *path, int maxbranch) {
 
 	if (!uopt.cow_enabled) RETURN(0);
 
-	if (maxbranch == -1) maxbranch = uopt.nbranches;
+	if (maxbranch == -1) maxbranch = uopt.nbranches - 1;
 
 	int i;
+	bool removed = false;
 	for (i = 0; i <= maxbranch; i++) {
+		// whiteouts are only created on rw-branches and ro-branches stay untouched
+		if (!uopt.branches[i].rw) continue;
+
 		char p[PATHLEN_MAX];
-		if (BUILD_PATH(p, uopt.branches[i].path, METADIR, path)) RETURN(-ENAMETOOLONG);
+		if (BUILD_PATH(p, METADIR, path)) RETURN(-ENAMETOOLONG);
 		if (strlen(p) + strlen(HIDETAG) > PATHLEN_MAX) RETURN(-ENAMETOOLONG);
 		strcat(p, HIDETAG); // TODO check length
 
-		switch (path_is_dir(p)) {
-			case IS_FILE: unlink(p); break;
-			case IS_DIR: rmdir(p); break;
+		switch (path_is_dir(i, p)) {
+			case IS_FILE: branch_unlink(i, p); break;
+			case IS_DIR: branch_rmdir(i, p); break;
 			case NOT_EXISTING: continue;
 		}
+		removed = true;
 	}
 
+	// lower branches might serve path now
+	if (removed) cache_invalidate(path);
+
 	RETURN(0);
 }
 
+struct remove_tree_state {
+	const char *path;
+	int branch;
+	int res;
+};
+
+static int remove_entry(void *priv, const char *name, ino_t ino, unsigned char type) {
+	(void)ino;
+	(void)type;
+
+	struct remove_tree_state *state = priv;
+
+	if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) return 0;
+
+	char member[PATHLEN_MAX];
+	if (BUILD_PATH(member, state->path, "/", name) || remove_tree(state->branch, member)) {
+		state->res = -1;
+	}
+
+	return 0;
+}
+
 /**
- * check if path is a directory
+ * Remove path from branch, directories with all of their contents
+ */
+int remove_tree(int branch, const char *path) {
+	DBG("%s\n", path);
+
+	struct stat st;
+	if (branch_lstat(branch, path, &st) == -1) RETURN(-1);
+
+	if (!S_ISDIR(st.st_mode)) RETURN(branch_unlink(branch, path));
+
+	struct remove_tree_state state = {
+		.path = path,
+		.branch = branch,
+		.res = 0,
+	};
+
+	if (branch_readdir(branch, path, remove_entry, &state) == -1) RETURN(-1);
+
+	RETURN(branch_rmdir(branch, path));
+}
+
+/**
+ * check if path is a directory on branch
  *
  * return proper types given by filetype_t
  */
-filetype_t path_is_dir(const char *path) {
+filetype_t path_is_dir(int branch, const char *path) {
 	DBG("%s\n", path);
 
 	struct stat buf;
 	
-	if (lstat(path, &buf) == -1) RETURN(NOT_EXISTING);
+	if (branch_lstat(branch, path, &buf) == -1) RETURN(NOT_EXISTING);
 	
 	if (S_ISDIR(buf.st_mode)) RETURN(IS_DIR);
 	
@@ -146,20 +198,24 @@ static int do_create_whiteout(const char *path, int branch_rw, enum whiteout mod
 	path_create_cutlast(metapath, branch_rw, branch_rw);
 
 	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[branch_rw].path, metapath)) RETURN(-1);
+	if (BUILD_PATH(p, metapath)) RETURN(-1);
 	strcat(p, HIDETAG); // TODO check length
 
 	int res;
 	if (mode == WHITEOUT_FILE) {
-		res = open(p, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
+		branch_file_t file;
+		res = branch_open(branch_rw, p, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR, &file);
 		if (res == -1) RETURN(-1);
-		res = close(res);
+		res = branch_close(&file);
 	} else {
-		res = mkdir(p, S_IRWXU);
+		res = branch_mkdir(branch_rw, p, S_IRWXU);
 		if (res)
-			USYSLOG(LOG_ERR, "Creating %s failed: %s\n", p, strerror(errno));
+			USYSLOG(LOG_ERR, "Creating %s%s failed: %s\n",
+				uopt.branches[branch_rw].path, p, strerror(errno));
 	}
 
+	if (res == 0) cache_invalidate(path);
+
 	RETURN(res);
 }
 
@@ -197,13 +253,37 @@ int maybe_whiteout(const char *path, int branch_rw, enum whiteout mode) {
 	RETURN(0);
 }
 
+/**
+ * lstat() path as seen through the union, i.e. on the top branch having it.
+ * Returns the index of that branch or -errno.
+ */
+int union_lstat(const char *path, struct stat *stbuf) {
+	if (hide_path(path)) return -ENOENT;
+
+	int i = find_rorw_branch(path);
+	if (i == -1) return -errno;
+
+	if (branch_lstat(i, path, stbuf) == -1) return -errno;
+
+	/* This is a workaround for broken gnu find implementations. Actually,
+	 * n_links is not defined at all for directories by posix. However, it
+	 * seems to be common for filesystems to set it to one if the actual value
+	 * is unknown. Since nlink_t is unsigned and since these broken implementations
+	 * always substract 2 (for . and ..) this will cause an underflow, setting
+	 * it to max(nlink_t).
+	 */
+	if (S_ISDIR(stbuf->st_mode)) stbuf->st_nlink = 1;
+
+	return i;
+}
+
 /**
  * Set file owner of after an operation, which created a file.
  */
-int set_owner(const char *path) {
+int set_owner(int branch, const char *path) {
 	struct fuse_context *ctx = fuse_get_context();
 	if (ctx->uid != 0 && ctx->gid != 0) {
-		int res = lchown(path, ctx->uid, ctx->gid);
+		int res = branch_chown(branch, path, ctx->uid, ctx->gid);
 		if (res) {
 			USYSLOG(LOG_WARNING,
 			       ":%s: Setting the correct file owner failed: %s !\n", 
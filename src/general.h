@@ -8,6 +8,7 @@
 #define GENERAL_H
 
 #include <stdbool.h>
+#include <sys/stat.h>
 
 enum  whiteout {
 	WHITEOUT_FILE,
@@ -22,11 +23,13 @@ typedef enum filetype {
 
 int path_hidden(const char *path, int branch);
 int remove_hidden(const char *path, int maxbranch);
+int remove_tree(int branch, const char *path);
 int hide_file(const char *path, int branch_rw);
 int hide_dir(const char *path, int branch_rw);
-filetype_t path_is_dir (const char *path);
+filetype_t path_is_dir(int branch, const char *path);
 int maybe_whiteout(const char *path, int branch_rw, enum whiteout mode);
-int set_owner(const char *path);
+int set_owner(int branch, const char *path);
+int union_lstat(const char *path, struct stat *stbuf);
 
 
 #endif
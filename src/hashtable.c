@@ -66,6 +66,7 @@ create_hashtable(unsigned int minsize,
     h->entrycount   = 0;
     h->hashfn       = hashf;
     h->eqfn         = eqf;
+    h->freekeyfn    = free;
     h->loadlimit    = my_ceil(size * max_load_factor);
     return h;
 }
@@ -218,7 +219,7 @@ hashtable_remove(struct hashtable *h, void *k)
             *pE = e->next;
             h->entrycount--;
             v = e->v;
-            freekey(e->k);
+            freekey(h,e->k);
             free(e);
             return v;
         }
@@ -228,6 +229,13 @@ hashtable_remove(struct hashtable *h, void *k)
     return NULL;
 }
 
+/*****************************************************************************/
+void
+hashtable_set_free_key(struct hashtable *h, void (*freekeyf) (void*))
+{
+    h->freekeyfn = freekeyf;
+}
+
 /*****************************************************************************/
 /* destroy */
 void
@@ -242,7 +250,7 @@ hashtable_destroy(struct hashtable *h, int free_values)
         {
             e = table[i];
             while (NULL != e)
-            { f = e; e = e->next; freekey(f->k); free(f->v); free(f); }
+            { f = e; e = e->next; freekey(h,f->k); free(f->v); free(f); }
         }
     }
     else
@@ -251,7 +259,7 @@ hashtable_destroy(struct hashtable *h, int free_values)
         {
             e = table[i];
             while (NULL != e)
-            { f = e; e = e->next; freekey(f->k); free(f); }
+            { f = e; e = e->next; freekey(h,f->k); free(f); }
         }
     }
     free(h->table);
@@ -152,6 +152,17 @@ unsigned int
 hashtable_count(struct hashtable *h);
 
 
+/*****************************************************************************
+ * hashtable_set_free_key
+   
+ * @name        hashtable_set_free_key
+ * @param   h   the hashtable
+ * @param       freekeyfunction function releasing keys, 'free' by default
+ */
+void
+hashtable_set_free_key(struct hashtable *h, void (*freekeyfunction) (void*));
+
+
 /*****************************************************************************
  * hashtable_destroy
    
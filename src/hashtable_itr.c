@@ -101,7 +101,7 @@ hashtable_iterator_remove(struct hashtable_itr *itr)
     /* itr->e is now outside the hashtable */
     remember_e = itr->e;
     itr->h->entrycount--;
-    freekey(remember_e->k);
+    freekey(itr->h,remember_e->k);
 
     /* Advance the iterator, correcting the parent */
     remember_parent = itr->parent;
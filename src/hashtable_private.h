@@ -21,6 +21,7 @@ struct hashtable {
     unsigned int primeindex;
     unsigned int (*hashfn) (void *k);
     int (*eqfn) (void *k1, void *k2);
+    void (*freekeyfn) (void *k);
 };
 
 /*****************************************************************************/
@@ -43,8 +44,7 @@ indexFor(unsigned int tablelength, unsigned int hashvalue)
 */
 
 /*****************************************************************************/
-#define freekey(X) free(X)
-/*define freekey(X) ; */
+#define freekey(h,X) ((h)->freekeyfn(X))
 
 
 /*****************************************************************************/
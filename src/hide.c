@@ -0,0 +1,174 @@
+/*
+*  C Implementation: hide
+*
+* Description: Hide meta files, such as our .unionfs directory
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+*
+* Details:
+*	Names to hide are given as a list of glob patterns. Patterns
+*	containing a '/' match the whole path within the union, all others
+*	only the name, in any directory.
+*	readdir() has to check every single entry, so the patterns are
+*	compiled once on mount: most of them are a plain name or a name
+*	followed by a single '*', which only need a memcmp(), and they are
+*	sorted by their first character, so for most entries there is
+*	nothing to compare at all. Only patterns starting with a wildcard
+*	are checked for every entry.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fnmatch.h>
+
+#include "unionfs.h"
+#include "opts.h"
+#include "debug.h"
+#include "string.h"
+#include "hide.h"
+
+#define DEFAULT_PATTERNS "/" METANAME ":" FUSE_META_FILE "*"
+
+typedef enum {
+	MATCH_EXACT,	// no wildcards at all
+	MATCH_PREFIX,	// no wildcards but a trailing '*'
+	MATCH_GLOB	// anything else, fnmatch()
+} match_t;
+
+typedef struct pattern {
+	match_t type;
+	size_t len;		// of the literal part for MATCH_EXACT and MATCH_PREFIX
+	struct pattern *next;
+	char glob[];
+} pattern_t;
+
+typedef struct {
+	pattern_t *by_char[256];	// patterns starting with this character
+	pattern_t *wild;		// patterns starting with a wildcard
+} matcher_t;
+
+static matcher_t names;		// matched against the name
+static matcher_t paths;		// matched against the whole path
+static bool enabled;
+static bool have_paths;		// there is any pattern in paths
+
+static bool is_wildcard(char c) {
+	return c == '*' || c == '?' || c == '[' || c == '\\';
+}
+
+static void add_pattern(const char *glob, size_t len) {
+	pattern_t *p = malloc(sizeof(pattern_t) + len + 1);
+	if (!p) {
+		fprintf(stderr, "%s: malloc failed\n", __func__);
+		exit(1); // still early phase, we can abort
+	}
+	memcpy(p->glob, glob, len);
+	p->glob[len] = '\0';
+
+	size_t literal = strcspn(p->glob, "*?[\\");
+	if (literal == len) {
+		p->type = MATCH_EXACT;
+	} else if (literal == len - 1 && p->glob[literal] == '*') {
+		p->type = MATCH_PREFIX;
+	} else {
+		p->type = MATCH_GLOB;
+	}
+	p->len = literal;
+
+	matcher_t *m = &names;
+	if (memchr(p->glob, '/', len)) {
+		m = &paths;
+		have_paths = true;
+	}
+	pattern_t **list = is_wildcard(p->glob[0]) ? &m->wild : &m->by_char[(unsigned char)p->glob[0]];
+
+	p->next = *list;
+	*list = p;
+}
+
+/**
+ * Compile the ':' separated list of patterns, the defaults if it is NULL
+ */
+void hide_init(const char *patterns) {
+	if (!uopt.hide_meta_files) return;
+
+	if (!patterns) patterns = DEFAULT_PATTERNS;
+
+	while (*patterns) {
+		size_t len = strcspn(patterns, ROOT_SEP);
+		if (len) add_pattern(patterns, len);
+
+		patterns += len;
+		if (*patterns) patterns++;
+	}
+
+	enabled = true;
+}
+
+static bool match(const matcher_t *m, const char *s, int flags) {
+	const pattern_t *p = m->by_char[(unsigned char)s[0]];
+
+	for (; p; p = p->next) {
+		switch (p->type) {
+			case MATCH_EXACT:
+				if (strcmp(s, p->glob) == 0) return true;
+				break;
+			case MATCH_PREFIX:
+				if (strncmp(s, p->glob, p->len) == 0) return true;
+				break;
+			case MATCH_GLOB:
+				if (fnmatch(p->glob, s, flags) == 0) return true;
+				break;
+		}
+	}
+
+	for (p = m->wild; p; p = p->next) {
+		if (fnmatch(p->glob, s, flags) == 0) return true;
+	}
+
+	return false;
+}
+
+/**
+ * Check if name within the directory path has to be hidden
+ */
+bool hide_name(const char *path, const char *name) {
+	if (!enabled) return false;
+
+	if (match(&names, name, 0)) return true;
+
+	if (!have_paths) return false;
+
+	char p[PATHLEN_MAX];
+	if (BUILD_PATH(p, path, "/", name)) return false;
+
+	// path might be "/", which would give us two slashes
+	const char *walk = p;
+	if (walk[0] == '/' && walk[1] == '/') walk++;
+
+	return match(&paths, walk, FNM_PATHNAME);
+}
+
+/**
+ * Check if the lookup of path has to fail. Files of libfuse itself are
+ * never hidden here, as libfuse relies on finding them: it picks the name
+ * of a new .fuse_hidden file by probing names with getattr().
+ */
+bool hide_path(const char *path) {
+	if (!enabled) return false;
+
+	const char *name = strrchr(path, '/');
+	if (!name || name[1] == '\0') return false;
+	name++;
+
+	if (strncmp(name, FUSE_META_FILE, FUSE_META_LENGTH) == 0) return false;
+
+	if (match(&names, name, 0)) return true;
+
+	return match(&paths, path, FNM_PATHNAME);
+}
@@ -0,0 +1,16 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#ifndef HIDE_H
+#define HIDE_H
+
+#include <stdbool.h>
+
+void hide_init(const char *patterns);
+bool hide_name(const char *path, const char *name);
+bool hide_path(const char *path);
+
+#endif
@@ -0,0 +1,446 @@
+/*
+*  C Implementation: image
+*
+* Description: Read-only branch backend serving an image file
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+*
+* Details:
+*	A read-only layer with millions of files costs millions of inodes on
+*	the host and a path walk through the host filesystem for every lookup.
+*	An image (see image.h for the format, unionfssquash -i creates them)
+*	holds a whole layer in a single file, which we simply mmap(). All
+*	metadata are in contiguous tables and the entries of every directory
+*	are sorted, so a lookup is a binary search per path element. File
+*	data are read right out of the mapping.
+*	The image is validated once when it is opened, so later on we do not
+*	need to check any offsets. It must not be modified while it is used,
+*	so image branches are always immutable.
+*	An index (see index.c) uses the same format for the metadata of an
+*	immutable directory branch, without the file data, which are still
+*	read from the directory.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "unionfs.h"
+#include "opts.h"
+#include "debug.h"
+#include "branch.h"
+#include "image.h"
+
+typedef struct {
+	const char *base;	// the mapping
+	size_t size;
+	dev_t dev;		// device of the image file, reported as st_dev
+	bool index;		// an index, see index.c
+	const struct image_header *hdr;
+	const struct image_inode *inodes;
+	const struct image_dirent *dirents;
+	const char *names;
+} image_t;
+
+#define IMAGE(branch) ((const image_t *)uopt.branches[branch].priv)
+
+/**
+ * Check if count elements of size bytes at offset are within the image
+ */
+static bool in_image(const image_t *img, uint64_t offset, uint64_t count, uint64_t size) {
+	if (offset > img->size) return false;
+	if (size && count > (img->size - offset) / size) return false;
+	return true;
+}
+
+static bool image_valid(const image_t *img) {
+	const struct image_header *hdr = img->hdr;
+
+	if (img->size < sizeof(*hdr)) return false;
+	if (img->index && img->size < sizeof(*hdr) + sizeof(struct index_header)) return false;
+	if (memcmp(hdr->magic, img->index ? INDEX_MAGIC : IMAGE_MAGIC, sizeof(hdr->magic)) != 0) return false;
+	if (hdr->version != (img->index ? INDEX_VERSION : IMAGE_VERSION)) return false;
+
+	if (hdr->ninodes < 1 || hdr->ninodes > INT_MAX) return false;
+	if (hdr->inodes % IMAGE_ALIGN || hdr->dirents % IMAGE_ALIGN) return false;
+	if (!in_image(img, hdr->inodes, hdr->ninodes, sizeof(struct image_inode))) return false;
+	if (!in_image(img, hdr->dirents, hdr->ndirents, sizeof(struct image_dirent))) return false;
+	if (!in_image(img, hdr->names, hdr->names_size, 1)) return false;
+	if (hdr->names_size && img->base[hdr->names + hdr->names_size - 1] != '\0') return false;
+
+	const struct image_inode *inodes = (const void *)(img->base + hdr->inodes);
+	const struct image_dirent *dirents = (const void *)(img->base + hdr->dirents);
+
+	if (!S_ISDIR(inodes[0].mode)) return false;
+
+	uint32_t i;
+	for (i = 0; i < hdr->ninodes; i++) {
+		if (S_ISDIR(inodes[i].mode)) {
+			if (inodes[i].data > hdr->ndirents) return false;
+			if (inodes[i].size > hdr->ndirents - inodes[i].data) return false;
+		} else if (S_ISLNK(inodes[i].mode) || (S_ISREG(inodes[i].mode) && !img->index)) {
+			if (!in_image(img, inodes[i].data, inodes[i].size, 1)) return false;
+		}
+	}
+
+	uint64_t j;
+	for (j = 0; j < hdr->ndirents; j++) {
+		if (dirents[j].ino >= hdr->ninodes) return false;
+		if (dirents[j].name >= hdr->names_size) return false;
+	}
+
+	return true;
+}
+
+/**
+ * Map and validate the image or index fd, path is for error messages
+ */
+static image_t *image_map(int fd, const char *path, bool index) {
+	struct stat st;
+	if (fstat(fd, &st) == -1) return NULL;
+
+	image_t *img = calloc(1, sizeof(image_t));
+	if (!img) return NULL;
+
+	img->size = st.st_size;
+	img->dev = st.st_dev;
+	img->index = index;
+
+	if (img->size < sizeof(struct image_header)) {
+		// index_attach() just builds a broken index again
+		if (!index) fprintf(stderr, "%s: not a unionfs image\n", path);
+		free(img);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	void *base = mmap(NULL, img->size, PROT_READ, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		free(img);
+		return NULL;
+	}
+
+	img->base = base;
+	img->hdr = base;
+	if (!image_valid(img)) {
+		// index_attach() just builds a broken index again
+		if (!index) fprintf(stderr, "%s: not a unionfs image or corrupted\n", path);
+		munmap(base, img->size);
+		free(img);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	img->inodes = (const void *)(img->base + img->hdr->inodes);
+	img->dirents = (const void *)(img->base + img->hdr->dirents);
+	img->names = img->base + img->hdr->names;
+
+	return img;
+}
+
+/**
+ * Map the image of branch, which is already opened as branch->fd
+ */
+int image_open(branch_entry_t *branch, const char *path) {
+	image_t *img = image_map(branch->fd, path, false);
+	if (!img) return -1;
+
+	branch->priv = img;
+
+	return 0;
+}
+
+/**
+ * Map the index fd of the directory branch, whose files are on device dev.
+ * The mapping stays valid after fd is closed.
+ */
+int image_open_index(branch_entry_t *branch, int fd, const char *path, dev_t dev) {
+	image_t *img = image_map(fd, path, true);
+	if (!img) return -1;
+
+	img->dev = dev;
+	branch->priv = img;
+
+	return 0;
+}
+
+/**
+ * Forget the index of branch again, e.g. because it is stale
+ */
+void image_close_index(branch_entry_t *branch) {
+	image_t *img = branch->priv;
+
+	munmap((void *)img->base, img->size);
+	free(img);
+	branch->priv = NULL;
+}
+
+/**
+ * Raise max to the ctime of the directories below the directory inode dir,
+ * opened as fd. -1 if one of them is gone.
+ */
+static int dirs_ctime(const image_t *img, int fd, uint32_t dir, struct timespec *max) {
+	const struct image_inode *inode = &img->inodes[dir];
+
+	uint64_t i;
+	for (i = inode->data; i < inode->data + inode->size; i++) {
+		const struct image_dirent *de = &img->dirents[i];
+		if (!S_ISDIR(img->inodes[de->ino].mode)) continue;
+
+		int sub = openat(fd, img->names + de->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+		if (sub == -1) return -1;
+
+		struct stat st;
+		int res = fstat(sub, &st);
+		if (!res) {
+			if (st.st_ctim.tv_sec > max->tv_sec ||
+			    (st.st_ctim.tv_sec == max->tv_sec && st.st_ctim.tv_nsec > max->tv_nsec)) {
+				*max = st.st_ctim;
+			}
+			res = dirs_ctime(img, sub, de->ino, max);
+		}
+		close(sub);
+		if (res) return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Check if the index of branch still matches its directory. Creating,
+ * removing or renaming a file changes the ctime of its directory, so the
+ * largest ctime of the directories has to be the one recorded when the
+ * index was built. Files modified in place are not noticed.
+ */
+bool image_index_current(const branch_entry_t *branch) {
+	const image_t *img = branch->priv;
+	const struct index_header *idx = (const void *)(img->hdr + 1);
+
+	struct stat st;
+	if (fstat(branch->fd, &st) == -1) return false;
+
+	struct timespec max = st.st_ctim;
+	if (dirs_ctime(img, branch->fd, 0, &max)) return false;
+
+	return max.tv_sec == idx->generation && (uint32_t)max.tv_nsec == idx->generation_nsec;
+}
+
+/**
+ * Find the inode of path, -1 if it does not exist
+ */
+static int lookup(const image_t *img, const char *path) {
+	uint32_t ino = 0;
+	const char *walk = path;
+
+	while (1) {
+		while (*walk == '/') walk++;
+		if (*walk == '\0') return ino;
+
+		const char *end = walk;
+		while (*end != '\0' && *end != '/') end++;
+		size_t len = end - walk;
+
+		const struct image_inode *dir = &img->inodes[ino];
+		if (!S_ISDIR(dir->mode)) {
+			errno = ENOTDIR;
+			return -1;
+		}
+
+		uint64_t lo = dir->data;
+		uint64_t hi = dir->data + dir->size;
+		bool found = false;
+		while (lo < hi) {
+			uint64_t mid = lo + (hi - lo) / 2;
+			const char *name = img->names + img->dirents[mid].name;
+
+			int cmp = strncmp(name, walk, len);
+			if (cmp == 0 && name[len] != '\0') cmp = 1; // walk is a prefix of name
+
+			if (cmp == 0) {
+				ino = img->dirents[mid].ino;
+				found = true;
+				break;
+			}
+
+			if (cmp < 0) lo = mid + 1;
+			else hi = mid;
+		}
+
+		if (!found) {
+			errno = ENOENT;
+			return -1;
+		}
+
+		walk = end;
+	}
+}
+
+static int image_lstat(int branch, const char *path, struct stat *stbuf) {
+	const image_t *img = IMAGE(branch);
+
+	int ino = lookup(img, path);
+	if (ino == -1) return -1;
+
+	const struct image_inode *inode = &img->inodes[ino];
+
+	memset(stbuf, 0, sizeof(*stbuf));
+	stbuf->st_dev = img->dev;
+	stbuf->st_ino = ino + 1;
+	if (img->index && !S_ISDIR(inode->mode) && !S_ISLNK(inode->mode)) {
+		stbuf->st_ino = inode->data; // that of the file, e.g. for hard links
+	}
+	stbuf->st_mode = inode->mode;
+	stbuf->st_nlink = inode->nlink;
+	stbuf->st_uid = inode->uid;
+	stbuf->st_gid = inode->gid;
+	stbuf->st_rdev = inode->rdev;
+	stbuf->st_size = S_ISDIR(inode->mode) ? 4096 : inode->size;
+	stbuf->st_blksize = 4096;
+	stbuf->st_blocks = (stbuf->st_size + 511) / 512;
+	stbuf->st_atim.tv_sec = inode->atime;
+	stbuf->st_atim.tv_nsec = inode->atime_nsec;
+	stbuf->st_mtim.tv_sec = inode->mtime;
+	stbuf->st_mtim.tv_nsec = inode->mtime_nsec;
+	stbuf->st_ctim.tv_sec = inode->ctime;
+	stbuf->st_ctim.tv_nsec = inode->ctime_nsec;
+
+	return 0;
+}
+
+static int image_open_file(int branch, const char *path, int flags, mode_t mode, branch_file_t *file) {
+	(void)mode;
+
+	const image_t *img = IMAGE(branch);
+
+	if ((flags & O_ACCMODE) != O_RDONLY || (flags & O_CREAT)) {
+		errno = EROFS;
+		return -1;
+	}
+
+	int ino = lookup(img, path);
+	if (ino == -1) return -1;
+
+	const struct image_inode *inode = &img->inodes[ino];
+	if (S_ISDIR(inode->mode)) {
+		errno = EISDIR;
+		return -1;
+	}
+
+	file->branch = branch;
+	file->fd = -1;
+	file->data = NULL;
+	file->size = 0;
+	file->priv = NULL;
+
+	if (S_ISREG(inode->mode)) {
+		file->data = img->base + inode->data;
+		file->size = inode->size;
+	}
+
+	return 0;
+}
+
+static ssize_t image_read(branch_file_t *file, char *buf, size_t size, off_t offset) {
+	if (offset >= file->size) return 0;
+
+	if (size > (size_t)(file->size - offset)) size = file->size - offset;
+	memcpy(buf, file->data + offset, size);
+
+	return size;
+}
+
+static int image_close(branch_file_t *file) {
+	(void)file;
+	return 0;
+}
+
+static int image_readdir(int branch, const char *path, branch_filler_t filler, void *priv) {
+	const image_t *img = IMAGE(branch);
+
+	int ino = lookup(img, path);
+	if (ino == -1) return -1;
+
+	const struct image_inode *dir = &img->inodes[ino];
+	if (!S_ISDIR(dir->mode)) {
+		errno = ENOTDIR;
+		return -1;
+	}
+
+	if (filler(priv, ".", ino + 1, DT_DIR)) return 0;
+	if (filler(priv, "..", 0, DT_DIR)) return 0;
+
+	uint64_t i;
+	for (i = dir->data; i < dir->data + dir->size; i++) {
+		const struct image_dirent *de = &img->dirents[i];
+		unsigned char type = IFTODT(img->inodes[de->ino].mode);
+
+		if (filler(priv, img->names + de->name, de->ino + 1, type)) break;
+	}
+
+	return 0;
+}
+
+static ssize_t image_readlink(int branch, const char *path, char *buf, size_t size) {
+	const image_t *img = IMAGE(branch);
+
+	int ino = lookup(img, path);
+	if (ino == -1) return -1;
+
+	const struct image_inode *inode = &img->inodes[ino];
+	if (!S_ISLNK(inode->mode)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	// readlink() silently truncates, so do we
+	if (size > inode->size) size = inode->size;
+	memcpy(buf, img->base + inode->data, size);
+
+	return size;
+}
+
+static int index_open_file(int branch, const char *path, int flags, mode_t mode, branch_file_t *file) {
+	return dir_ops.open(branch, path, flags, mode, file);
+}
+
+static ssize_t index_read(branch_file_t *file, char *buf, size_t size, off_t offset) {
+	return dir_ops.read(file, buf, size, offset);
+}
+
+static int index_close(branch_file_t *file) {
+	return dir_ops.close(file);
+}
+
+const struct branch_ops image_ops = {
+	.lstat = image_lstat,
+	.open = image_open_file,
+	.read = image_read,
+	.close = image_close,
+	.readdir = image_readdir,
+	.readlink = image_readlink,
+	.xattrs = false,
+};
+
+/**
+ * Immutable directory branches with an index: the metadata come from the
+ * index, the data of files from the directory
+ */
+const struct branch_ops index_ops = {
+	.lstat = image_lstat,
+	.open = index_open_file,
+	.read = index_read,
+	.close = index_close,
+	.readdir = image_readdir,
+	.readlink = image_readlink,
+	.xattrs = true,
+};
@@ -0,0 +1,82 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "unionfs.h"
+
+#define IMAGE_MAGIC "UNIONIMG"
+#define INDEX_MAGIC "UNIONIDX"	// an index, see index.c
+#define IMAGE_VERSION 1
+#define INDEX_VERSION 2	// version 1 had no struct index_header
+#define IMAGE_ALIGN 8 // tables start at multiples of this
+
+/*
+ * Layout of an image file, all numbers in host byte order:
+ *	struct image_header
+ *	file data and symlink targets
+ *	struct image_inode[ninodes], inode 0 is the root directory
+ *	struct image_dirent[ndirents], the entries of a directory are
+ *	                               contiguous and sorted by strcmp()
+ *	names, '\0' terminated
+ * An index has no file data, but a struct index_header right after the
+ * image header. Data of its inodes other than directories and symlinks is
+ * the inode number of the file within the branch.
+ */
+struct image_header {
+	char magic[8];		// IMAGE_MAGIC, not '\0' terminated
+	uint32_t version;	// IMAGE_VERSION, INDEX_VERSION for an index
+	uint32_t ninodes;
+	uint64_t inodes;	// offset of the inode table
+	uint64_t ndirents;
+	uint64_t dirents;	// offset of the directory entries
+	uint64_t names;		// offset of the names
+	uint64_t names_size;
+};
+
+struct index_header {
+	int64_t generation;	// largest ctime of the directories of the branch
+	uint32_t generation_nsec;
+	uint32_t unused;
+};
+
+struct image_inode {
+	uint32_t mode;
+	uint32_t uid;
+	uint32_t gid;
+	uint32_t nlink;
+	uint64_t size;		// bytes of file data/link target, entries of directories
+	uint64_t data;		// offset of the data, first entry of directories
+	uint64_t rdev;
+	int64_t atime;
+	int64_t mtime;
+	int64_t ctime;
+	uint32_t atime_nsec;
+	uint32_t mtime_nsec;
+	uint32_t ctime_nsec;
+	uint32_t unused;
+};
+
+struct image_dirent {
+	uint32_t name;		// offset within the names
+	uint32_t ino;		// index in the inode table
+};
+
+struct branch_ops;
+
+extern const struct branch_ops image_ops;
+extern const struct branch_ops index_ops;
+
+int image_open(branch_entry_t *branch, const char *path);
+int image_open_index(branch_entry_t *branch, int fd, const char *path, dev_t dev);
+bool image_index_current(const branch_entry_t *branch);
+void image_close_index(branch_entry_t *branch);
+
+#endif
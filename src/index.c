@@ -0,0 +1,431 @@
+/*
+*  C Implementation: index
+*
+* Description: Metadata indexes of immutable directory branches, shared
+*              between mounts
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+*
+* Details:
+*	Many mounts often have the same read-only layers, e.g. the base
+*	system of many containers. With -o index_dir=dir, the first mount of
+*	an immutable directory branch walks it once and writes the metadata
+*	of everything in it into an index within dir. This is the image
+*	format of image.h, just without the file data. Every later mount of
+*	the same branch, by this or any other process, maps the index
+*	instead of looking up files within the directory. The mapping is
+*	shared and read-only, so there is only a single copy of the index in
+*	the page cache, no matter how many mounts use it.
+*	An index is named after the device, inode and ctime of the branch
+*	root. It is written to a temporary file which is renamed into place
+*	once it is complete, so no mount ever maps a partial index. Two
+*	mounts which build the same index at once just both write it.
+*	The index only serves lookups, readdir and readlink, files are still
+*	opened and read within the directory. It is not updated while it is
+*	used, as the branch is immutable. Its header records the largest ctime
+*	of the directories of the branch, which changes whenever a file is
+*	created, removed or renamed. Every mount compares that generation with
+*	the directories before it uses the index and builds it again if they
+*	do not match. This only takes a stat() of every directory, the files
+*	themselves are not looked at, so files modified in place still need
+*	the index to be removed.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "unionfs.h"
+#include "opts.h"
+#include "debug.h"
+#include "string.h"
+#include "usyslog.h"
+#include "branch.h"
+#include "image.h"
+#include "index.h"
+
+typedef struct {
+	struct image_inode *inodes;
+	uint64_t ninodes, max_inodes;
+	struct image_dirent *dirents;
+	uint64_t ndirents, max_dirents;
+	char *names;
+	uint64_t names_size, max_names;
+	char *data;		// symlink targets
+	uint64_t data_size, max_data;
+	char **dirs;		// directories still to walk, relative to the branch
+	uint32_t *dir_inodes;
+	uint64_t ndirs, max_dirs;
+	struct timespec generation;	// largest ctime of the directories
+} builder_t;
+
+static int index_fd = -1;
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Make room for count elements of size in array, which has max of them
+ */
+static int grow(void **array, uint64_t *max, uint64_t count, size_t size) {
+	if (count <= *max) return 0;
+
+	uint64_t n = *max ? *max * 2 : 64;
+	while (n < count) n *= 2;
+
+	void *p = realloc(*array, n * size);
+	if (!p) return -1;
+
+	*array = p;
+	*max = n;
+	return 0;
+}
+
+static int add_bytes(char **buf, uint64_t *size, uint64_t *max, const char *bytes, size_t len) {
+	if (*size + len > UINT32_MAX) {
+		errno = EFBIG;
+		return -1;
+	}
+	if (grow((void **)buf, max, *size + len, 1)) return -1;
+
+	memcpy(*buf + *size, bytes, len);
+	*size += len;
+	return 0;
+}
+
+static int add_inode(builder_t *b, const struct stat *st) {
+	if (b->ninodes >= UINT32_MAX) {
+		errno = EFBIG;
+		return -1;
+	}
+	if (grow((void **)&b->inodes, &b->max_inodes, b->ninodes + 1, sizeof(struct image_inode))) return -1;
+
+	struct image_inode *inode = &b->inodes[b->ninodes];
+	memset(inode, 0, sizeof(*inode));
+	inode->mode = st->st_mode;
+	inode->uid = st->st_uid;
+	inode->gid = st->st_gid;
+	inode->nlink = st->st_nlink;
+	inode->rdev = st->st_rdev;
+	inode->atime = st->st_atim.tv_sec;
+	inode->atime_nsec = st->st_atim.tv_nsec;
+	inode->mtime = st->st_mtim.tv_sec;
+	inode->mtime_nsec = st->st_mtim.tv_nsec;
+	inode->ctime = st->st_ctim.tv_sec;
+	inode->ctime_nsec = st->st_ctim.tv_nsec;
+
+	if (S_ISDIR(st->st_mode) && (st->st_ctim.tv_sec > b->generation.tv_sec ||
+	    (st->st_ctim.tv_sec == b->generation.tv_sec && st->st_ctim.tv_nsec > b->generation.tv_nsec))) {
+		b->generation = st->st_ctim;
+	}
+
+	// directories are filled in once they are walked
+	if (!S_ISDIR(st->st_mode)) {
+		inode->size = st->st_size;
+		inode->data = st->st_ino;
+	}
+
+	return b->ninodes++;
+}
+
+static int queue_dir(builder_t *b, const char *path, uint32_t ino) {
+	if (grow((void **)&b->dirs, &b->max_dirs, b->ndirs + 1, sizeof(char *))) return -1;
+	uint64_t max = b->max_dirs;
+	uint32_t *inodes = realloc(b->dir_inodes, max * sizeof(uint32_t));
+	if (!inodes) return -1;
+	b->dir_inodes = inodes;
+
+	b->dirs[b->ndirs] = strdup(path);
+	if (!b->dirs[b->ndirs]) return -1;
+	b->dir_inodes[b->ndirs] = ino;
+	b->ndirs++;
+
+	return 0;
+}
+
+static int compare_names(const void *a, const void *b) {
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static int add_link(builder_t *b, int dirfd, const char *name, uint32_t ino) {
+	char target[PATHLEN_MAX];
+	ssize_t len = readlinkat(dirfd, name, target, sizeof(target));
+	if (len == -1) return -1;
+	if (len == sizeof(target)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	b->inodes[ino].data = b->data_size;
+	b->inodes[ino].size = len;
+	return add_bytes(&b->data, &b->data_size, &b->max_data, target, len);
+}
+
+/**
+ * Add the entries of the directory path, relative to the branch root fd,
+ * which is inode dir
+ */
+static int walk_dir(builder_t *b, int root, const char *path, uint32_t dir) {
+	int fd = openat(root, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (fd == -1) return -1;
+
+	DIR *dp = fdopendir(fd);
+	if (!dp) {
+		close(fd);
+		return -1;
+	}
+
+	char **names = NULL;
+	uint64_t count = 0, max = 0;
+	int res = 0;
+
+	struct dirent *de;
+	while ((de = readdir(dp))) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+
+		if (grow((void **)&names, &max, count + 1, sizeof(char *)) ||
+		    !(names[count] = strdup(de->d_name))) {
+			res = -1;
+			break;
+		}
+		count++;
+	}
+
+	// lookups in the index do a binary search, like in images
+	if (!res) qsort(names, count, sizeof(char *), compare_names);
+
+	uint64_t first = b->ndirents;
+
+	uint64_t i;
+	for (i = 0; !res && i < count; i++) {
+		struct stat st;
+		char member[PATHLEN_MAX];
+
+		res = -1;
+		if (fstatat(fd, names[i], &st, AT_SYMLINK_NOFOLLOW)) break;
+		if (BUILD_PATH(member, path, "/", names[i])) {
+			errno = ENAMETOOLONG;
+			break;
+		}
+
+		int ino = add_inode(b, &st);
+		if (ino == -1) break;
+
+		if (S_ISLNK(st.st_mode) && add_link(b, fd, names[i], ino)) break;
+		if (S_ISDIR(st.st_mode) && queue_dir(b, member, ino)) break;
+
+		uint64_t name = b->names_size;
+		if (add_bytes(&b->names, &b->names_size, &b->max_names, names[i], strlen(names[i]) + 1)) break;
+		if (grow((void **)&b->dirents, &b->max_dirents, b->ndirents + 1, sizeof(struct image_dirent))) break;
+
+		b->dirents[b->ndirents].name = name;
+		b->dirents[b->ndirents].ino = ino;
+		b->ndirents++;
+		res = 0;
+	}
+
+	b->inodes[dir].data = first;
+	b->inodes[dir].size = b->ndirents - first;
+
+	int e = errno;
+	for (i = 0; i < count; i++) free(names[i]);
+	free(names);
+	closedir(dp);
+	errno = e;
+
+	return res;
+}
+
+static int write_all(int fd, const void *buf, size_t size) {
+	const char *p = buf;
+
+	while (size) {
+		ssize_t res = write(fd, p, size);
+		if (res == -1) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		p += res;
+		size -= res;
+	}
+
+	return 0;
+}
+
+/**
+ * Write the index of b into fd, with the same layout as an image
+ */
+static int write_index(builder_t *b, int fd) {
+	static const char zeros[IMAGE_ALIGN];
+
+	struct image_header hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic));
+	hdr.version = INDEX_VERSION;
+	hdr.ninodes = b->ninodes;
+
+	struct index_header idx;
+	memset(&idx, 0, sizeof(idx));
+	idx.generation = b->generation.tv_sec;
+	idx.generation_nsec = b->generation.tv_nsec;
+
+	uint64_t pos = sizeof(hdr) + sizeof(idx) + b->data_size;
+	size_t pad = (IMAGE_ALIGN - pos % IMAGE_ALIGN) % IMAGE_ALIGN;
+	hdr.inodes = pos + pad;
+	hdr.ndirents = b->ndirents;
+	hdr.dirents = hdr.inodes + b->ninodes * sizeof(struct image_inode);
+	hdr.names = hdr.dirents + b->ndirents * sizeof(struct image_dirent);
+	hdr.names_size = b->names_size;
+
+	// data offsets of symlinks were relative to the data area
+	uint64_t i;
+	for (i = 0; i < b->ninodes; i++) {
+		if (S_ISLNK(b->inodes[i].mode)) b->inodes[i].data += sizeof(hdr) + sizeof(idx);
+	}
+
+	if (write_all(fd, &hdr, sizeof(hdr)) ||
+	    write_all(fd, &idx, sizeof(idx)) ||
+	    write_all(fd, b->data, b->data_size) ||
+	    write_all(fd, zeros, pad) ||
+	    write_all(fd, b->inodes, b->ninodes * sizeof(struct image_inode)) ||
+	    write_all(fd, b->dirents, b->ndirents * sizeof(struct image_dirent)) ||
+	    write_all(fd, b->names, b->names_size)) return -1;
+
+	return 0;
+}
+
+static void free_builder(builder_t *b) {
+	uint64_t i;
+	for (i = 0; i < b->ndirs; i++) free(b->dirs[i]);
+	free(b->dirs);
+	free(b->dir_inodes);
+	free(b->inodes);
+	free(b->dirents);
+	free(b->names);
+	free(b->data);
+}
+
+/**
+ * Write the index of b as name into the index directory. Other processes
+ * only ever see the complete index.
+ */
+static int publish(builder_t *b, const char *name) {
+	char tmp[PATHLEN_MAX];
+	snprintf(tmp, sizeof(tmp), "%s.%d.tmp", name, (int)getpid());
+
+	int fd = openat(index_fd, tmp, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (fd == -1) return -1;
+
+	int res = write_index(b, fd) || fsync(fd) ? -1 : 0;
+	int e = errno;
+	if (close(fd) && !res) {
+		res = -1;
+		e = errno;
+	}
+	if (!res && renameat(index_fd, tmp, index_fd, name)) {
+		res = -1;
+		e = errno;
+	}
+	if (res) {
+		unlinkat(index_fd, tmp, 0);
+		errno = e;
+	}
+
+	return res;
+}
+
+/**
+ * Walk the directory branch root and write its index as name into the
+ * index directory
+ */
+static int build(int root, const char *path, const char *name) {
+	builder_t b;
+	memset(&b, 0, sizeof(b));
+
+	int res = -1;
+	struct stat st;
+	int ino;
+	if (fstat(root, &st) == 0 && (ino = add_inode(&b, &st)) != -1 && queue_dir(&b, ".", ino) == 0) {
+		res = 0;
+	}
+
+	uint64_t next;
+	for (next = 0; !res && next < b.ndirs; next++) {
+		res = walk_dir(&b, root, b.dirs[next], b.dir_inodes[next]);
+		if (res) {
+			USYSLOG(LOG_WARNING, "Indexing %s failed at %s: %s\n", path, b.dirs[next], strerror(errno));
+		}
+	}
+
+	if (!res) res = publish(&b, name);
+	if (!res) USYSLOG(LOG_INFO, "Indexed %s: %llu files\n", path, (unsigned long long)b.ninodes);
+
+	int e = errno;
+	free_builder(&b);
+	errno = e;
+	return res;
+}
+
+/**
+ * Use the index directory at path, which is opened once, before any chroot
+ */
+int index_init(const char *path) {
+	index_fd = open(path, O_RDONLY | O_DIRECTORY);
+	return index_fd == -1 ? -1 : 0;
+}
+
+/**
+ * Map the index name of branch, whose files are on device dev
+ */
+static int open_index(branch_entry_t *branch, const char *path, const char *name, dev_t dev) {
+	int fd = openat(index_fd, name, O_RDONLY);
+	if (fd == -1) return -1;
+
+	int res = image_open_index(branch, fd, path, dev);
+	int e = errno;
+	close(fd);
+	errno = e;
+
+	return res;
+}
+
+/**
+ * Switch the immutable directory branch over to its index, which is built
+ * first if there is none yet. path is where branch->fd was opened from.
+ */
+int index_attach(branch_entry_t *branch, const char *path) {
+	struct stat st;
+	if (fstat(branch->fd, &st) == -1) return -1;
+
+	char name[NAME_MAX];
+	snprintf(name, sizeof(name), "%jx-%jx-%jx.%lx.idx",
+		(uintmax_t)st.st_dev, (uintmax_t)st.st_ino,
+		(uintmax_t)st.st_ctim.tv_sec, (unsigned long)st.st_ctim.tv_nsec);
+
+	// several branches of this mount might be the same directory
+	pthread_mutex_lock(&index_lock);
+	int res = open_index(branch, path, name, st.st_dev);
+	// EINVAL: an index of another version or broken
+	if (res && (errno == ENOENT || errno == EINVAL)) {
+		res = build(branch->fd, path, name) || open_index(branch, path, name, st.st_dev);
+	} else if (!res && !image_index_current(branch)) {
+		USYSLOG(LOG_INFO, "%s changed since it was indexed\n", path);
+		image_close_index(branch);
+		res = build(branch->fd, path, name) || open_index(branch, path, name, st.st_dev);
+	}
+	pthread_mutex_unlock(&index_lock);
+
+	if (res) return -1;
+
+	branch->ops = &index_ops;
+	return 0;
+}
@@ -0,0 +1,15 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#ifndef INDEX_H
+#define INDEX_H
+
+#include "unionfs.h"
+
+int index_init(const char *path);
+int index_attach(branch_entry_t *branch, const char *path);
+
+#endif
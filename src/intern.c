@@ -0,0 +1,328 @@
+/*
+*  C Implementation: intern
+*
+* Description: Table of interned paths, shared by all caches
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+*
+* Details:
+*	Every cache used to keep its own copy of the full path of each entry,
+*	hashed over and over again. Now a path is interned once: a path_id_t
+*	only holds its last element and a pointer to the path_id_t of its
+*	parent directory, so common prefixes are stored only once. The same
+*	path always gives the same path_id_t, so the caches simply compare
+*	pointers and use the hash stored within it.
+*	path_ids are reference counted, each cache entry holds one reference
+*	and each path_id one of its parent. So if a path is interned, all of
+*	its parents are as well, e.g. if "/a" is not interned, there is no
+*	cache entry for anything below it.
+*	The hash of a path is combined from the hash of its parent and the
+*	hash of its name, so it can be computed for a path string in one go.
+*	The table is split into INTERN_STRIPES stripes by the hash, each with
+*	its own lock, so threads rarely wait for each other.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "debug.h"
+#include "string.h"
+#include "intern.h"
+
+#define INTERN_STRIPES 64
+
+typedef struct {
+	pthread_mutex_t lock;
+	path_id_t **buckets;
+	unsigned int nbuckets;	// a power of 2
+	unsigned int count;
+} stripe_t;
+
+static stripe_t stripes[INTERN_STRIPES] = {
+	[0 ... INTERN_STRIPES - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+
+// "/", never freed and not part of any stripe
+static path_id_t root = {
+	.parent = NULL,
+	.hash = 0,
+	.refs = 1,
+};
+
+static unsigned int combine(unsigned int parent, const char *name, size_t len) {
+	unsigned int hash = parent * 0x9E3779B1u;
+	return ((hash << 5) | (hash >> 27)) ^ hash_bytes(name, len);
+}
+
+static stripe_t *stripe_of(unsigned int hash) {
+	return &stripes[hash % INTERN_STRIPES];
+}
+
+static path_id_t **bucket_of(stripe_t *s, unsigned int hash) {
+	return &s->buckets[(hash / INTERN_STRIPES) & (s->nbuckets - 1)];
+}
+
+/**
+ * Hash of the first len bytes of path. Empty elements are skipped, so
+ * "/a//b/" is the same as "/a/b".
+ */
+static unsigned int path_hash(const char *path, size_t len) {
+	unsigned int hash = root.hash;
+	const char *end = path + len;
+
+	while (1) {
+		while (path < end && *path == '/') path++;
+		if (path == end) return hash;
+
+		const char *name = path;
+		while (path < end && *path != '/') path++;
+		hash = combine(hash, name, path - name);
+	}
+}
+
+/**
+ * Length of path without trailing slashes and of its parent directory
+ */
+static size_t parent_len(const char *path, size_t *len) {
+	while (*len && path[*len - 1] == '/') (*len)--;
+
+	size_t name = *len;
+	while (name && path[name - 1] != '/') name--;
+
+	return name;
+}
+
+/**
+ * Check if id is the path of len bytes at path, by walking both from the end
+ */
+static bool id_equal(const path_id_t *id, const char *path, size_t len) {
+	while (1) {
+		while (len && path[len - 1] == '/') len--;
+		if (id == &root) return len == 0;
+		if (len == 0) return false;
+
+		size_t end = len;
+		while (len && path[len - 1] != '/') len--;
+
+		if (end - len != id->len || memcmp(path + len, id->name, id->len) != 0) return false;
+
+		id = id->parent;
+	}
+}
+
+/**
+ * Look up path in its stripe, which has to be locked
+ */
+static path_id_t *lookup(stripe_t *s, unsigned int hash, const char *path, size_t len) {
+	if (!s->buckets) return NULL;
+
+	path_id_t *id;
+	for (id = *bucket_of(s, hash); id; id = id->next) {
+		if (id->hash == hash && id_equal(id, path, len)) return id;
+	}
+
+	return NULL;
+}
+
+/**
+ * Double the buckets of s, which has to be locked
+ */
+static void grow(stripe_t *s) {
+	unsigned int n = s->nbuckets ? s->nbuckets * 2 : 16;
+	path_id_t **buckets = calloc(n, sizeof(path_id_t *));
+	if (!buckets) return; // longer chains, but still correct
+
+	path_id_t **old = s->buckets;
+	unsigned int i, old_n = s->nbuckets;
+
+	s->buckets = buckets;
+	s->nbuckets = n;
+
+	for (i = 0; i < old_n; i++) {
+		while (old[i]) {
+			path_id_t *id = old[i];
+			old[i] = id->next;
+
+			path_id_t **b = bucket_of(s, id->hash);
+			id->next = *b;
+			*b = id;
+		}
+	}
+
+	free(old);
+}
+
+static path_id_t *find(const char *path, size_t len) {
+	parent_len(path, &len);
+	if (len == 0) return &root;
+
+	unsigned int hash = path_hash(path, len);
+	stripe_t *s = stripe_of(hash);
+
+	pthread_mutex_lock(&s->lock);
+	path_id_t *id = lookup(s, hash, path, len);
+	if (id) id->refs++;
+	pthread_mutex_unlock(&s->lock);
+
+	return id;
+}
+
+/**
+ * Find path in the table, without adding it. Returns a new reference,
+ * NULL if path is not interned.
+ */
+const path_id_t *intern_find(const char *path) {
+	return find(path, strlen(path));
+}
+
+static path_id_t *get(const char *path, size_t len) {
+	path_id_t *found = find(path, len);
+	if (found) return found;
+
+	// the parent has to exist first, its reference is passed to the new path_id
+	size_t name = parent_len(path, &len);
+
+	path_id_t *parent = get(path, name);
+	if (!parent) return NULL;
+
+	path_id_t *id = malloc(sizeof(path_id_t) + (len - name) + 1);
+	if (!id) {
+		intern_put(parent);
+		return NULL;
+	}
+	id->parent = parent;
+	id->hash = combine(parent->hash, path + name, len - name);
+	id->refs = 1;
+	id->len = len - name;
+	memcpy(id->name, path + name, id->len);
+	id->name[id->len] = '\0';
+
+	stripe_t *s = stripe_of(id->hash);
+
+	pthread_mutex_lock(&s->lock);
+
+	// another thread might have been faster
+	path_id_t *other = lookup(s, id->hash, path, len);
+	if (other) {
+		other->refs++;
+		pthread_mutex_unlock(&s->lock);
+		free(id);
+		intern_put(parent);
+		return other;
+	}
+
+	if (s->count >= s->nbuckets) grow(s);
+	if (!s->buckets) {
+		pthread_mutex_unlock(&s->lock);
+		free(id);
+		intern_put(parent);
+		return NULL;
+	}
+
+	path_id_t **b = bucket_of(s, id->hash);
+	id->next = *b;
+	*b = id;
+	s->count++;
+
+	pthread_mutex_unlock(&s->lock);
+
+	return id;
+}
+
+/**
+ * Intern path. Returns a new reference, NULL if we run out of memory.
+ */
+const path_id_t *intern_get(const char *path) {
+	return get(path, strlen(path));
+}
+
+/**
+ * Drop a reference, the last one removes id from the table
+ */
+void intern_put(const path_id_t *cid) {
+	path_id_t *id = (path_id_t *)cid;
+
+	while (id && id != &root) {
+		stripe_t *s = stripe_of(id->hash);
+
+		pthread_mutex_lock(&s->lock);
+
+		if (--id->refs > 0) {
+			pthread_mutex_unlock(&s->lock);
+			return;
+		}
+
+		path_id_t **b = bucket_of(s, id->hash);
+		while (*b != id) b = &(*b)->next;
+		*b = id->next;
+		s->count--;
+
+		pthread_mutex_unlock(&s->lock);
+
+		// our reference of the parent goes as well
+		path_id_t *parent = id->parent;
+		free(id);
+		id = parent;
+	}
+}
+
+/**
+ * Check if id is dir or anywhere below dir
+ */
+bool intern_below(const path_id_t *id, const path_id_t *dir) {
+	for (; id; id = id->parent) {
+		if (id == dir) return true;
+	}
+	return false;
+}
+
+/**
+ * Write the path of id into buf, returns -1 if it does not fit
+ */
+int intern_path(const path_id_t *id, char *buf, size_t size) {
+	if (id == &root) {
+		if (size < 2) return -1;
+		strcpy(buf, "/");
+		return 0;
+	}
+
+	size_t len = 0;
+	const path_id_t *walk;
+	for (walk = id; walk != &root; walk = walk->parent) len += walk->len + 1;
+
+	if (len + 1 > size) return -1;
+
+	// the path is built from its end
+	buf[len] = '\0';
+	for (walk = id; walk != &root; walk = walk->parent) {
+		len -= walk->len;
+		memcpy(buf + len, walk->name, walk->len);
+		buf[--len] = '/';
+	}
+
+	return 0;
+}
+
+/**
+ * Hash and equal functions for hashtables with path_ids as keys
+ */
+unsigned int intern_hash(void *id) {
+	return ((path_id_t *)id)->hash;
+}
+
+int intern_equal(void *id1, void *id2) {
+	return id1 == id2;
+}
+
+/**
+ * Free function for hashtable keys, the table holds a reference of them
+ */
+void intern_free_key(void *id) {
+	intern_put(id);
+}
@@ -0,0 +1,32 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#ifndef INTERN_H
+#define INTERN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct path_id {
+	struct path_id *parent;	// NULL for "/"
+	struct path_id *next;	// within the bucket
+	unsigned int hash;	// of the whole path
+	unsigned int refs;	// locked by the stripe
+	size_t len;		// of name
+	char name[];		// the last element of the path
+} path_id_t;
+
+const path_id_t *intern_find(const char *path);
+const path_id_t *intern_get(const char *path);
+void intern_put(const path_id_t *id);
+bool intern_below(const path_id_t *id, const path_id_t *dir);
+int intern_path(const path_id_t *id, char *buf, size_t size);
+
+unsigned int intern_hash(void *id);
+int intern_equal(void *id1, void *id2);
+void intern_free_key(void *id);
+
+#endif
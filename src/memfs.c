@@ -0,0 +1,1104 @@
+/*
+*  C Implementation: memfs
+*
+* Description: Read-write branch backend keeping all files in memory
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+*
+* Details:
+*	Jobs writing thousands of small temporary files pay for every create
+*	and unlink with metadata updates of the host filesystem. A memory
+*	branch ("dir=MEM") keeps its whole tree within the daemon instead,
+*	like a tmpfs. Since it is just another rw-branch backend, copy-up and
+*	whiteouts work unchanged. Its contents are gone once we umount.
+*	Inodes and file data are allocated from an arena, which grows by
+*	chunks of MEMFS_CHUNK up to -o mem_size, so creating and removing
+*	files does not even go to malloc(). It is a buddy allocator: blocks
+*	have power of two sizes, a larger free block is split in halves for
+*	a smaller allocation and freed blocks are merged with their free
+*	buddy again, so memory of removed files can be used for files of
+*	any size. Files growing beyond -o mem_spill, or
+*	for which the arena has no space left, are moved into an unlinked
+*	file within the branch directory, which otherwise only serves as
+*	spill area.
+*	All of a branch is protected by a single rwlock, readers do not
+*	update the access times.
+*/
+
+#if defined __linux__
+	// For pread()/pwrite()
+	#define _XOPEN_SOURCE 700
+	#define _DEFAULT_SOURCE 1
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "unionfs.h"
+#include "opts.h"
+#include "debug.h"
+#include "hashtable.h"
+#include "hashtable_itr.h"
+#include "string.h"
+#include "branch.h"
+#include "memfs.h"
+
+#define ARENA_MIN 32			// smallest size class
+#define ARENA_CLASSES 16		// ARENA_MIN << (ARENA_CLASSES - 1) == MEMFS_CHUNK
+
+// a free block of the arena
+struct arena_block {
+	struct arena_block *next, *prev;
+	int class;
+};
+
+struct arena_chunk {
+	char *base;			// aligned to MEMFS_CHUNK
+	uint64_t free[MEMFS_CHUNK / ARENA_MIN / 64];	// a free block starts at this ARENA_MIN unit
+};
+
+struct mem_node {
+	struct stat st;
+	struct mem_node *parent;	// directories only
+	struct hashtable *entries;	// directories: name -> struct mem_node
+	char *data;			// file contents or symlink target
+	size_t alloc;			// allocated size of data
+	int fd;				// spilled file, -1 if data are in memory
+	unsigned int opened;		// open files, keep the node even if unlinked
+};
+
+typedef struct {
+	pthread_rwlock_t lock;
+	struct mem_node *root;
+	ino_t next_ino;
+	int dirfd;			// the spill directory
+	dev_t dev;			// device of the spill directory, reported as st_dev
+	size_t max;			// -o mem_size
+	size_t spill;			// -o mem_spill
+
+	// the arena
+	struct arena_chunk **chunks;	// sorted by address
+	size_t nchunks;
+	size_t size;			// bytes of all chunks
+	struct arena_block *free_list[ARENA_CLASSES];
+} memfs_t;
+
+// an open file, independent of the index of its branch
+typedef struct {
+	memfs_t *m;
+	struct mem_node *node;
+	bool append;
+} mem_file_t;
+
+#define MEMFS(branch) ((memfs_t *)uopt.branches[branch].priv)
+
+static void now(struct timespec *ts) {
+	clock_gettime(CLOCK_REALTIME, ts);
+}
+
+/**
+ * Index of the smallest size class holding size bytes
+ */
+static int arena_class(size_t size) {
+	int c = 0;
+	while ((size_t)ARENA_MIN << c < size) c++;
+	return c;
+}
+
+static size_t arena_round(size_t size) {
+	return (size_t)ARENA_MIN << arena_class(size);
+}
+
+/**
+ * Find the chunk containing p
+ */
+static struct arena_chunk *arena_chunk(memfs_t *m, const void *p) {
+	const char *base = (const char *)((uintptr_t)p & ~(uintptr_t)(MEMFS_CHUNK - 1));
+
+	size_t lo = 0, hi = m->nchunks;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (m->chunks[mid]->base == base) return m->chunks[mid];
+		if (m->chunks[mid]->base < base) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return NULL;
+}
+
+static void set_free(struct arena_chunk *chunk, struct arena_block *b, bool on) {
+	size_t unit = ((char *)b - chunk->base) / ARENA_MIN;
+	uint64_t bit = (uint64_t)1 << (unit % 64);
+
+	if (on) {
+		chunk->free[unit / 64] |= bit;
+	} else {
+		chunk->free[unit / 64] &= ~bit;
+	}
+}
+
+static bool is_free(const struct arena_chunk *chunk, const struct arena_block *b) {
+	size_t unit = ((const char *)b - chunk->base) / ARENA_MIN;
+	return chunk->free[unit / 64] & (uint64_t)1 << (unit % 64);
+}
+
+static void push_block(memfs_t *m, struct arena_chunk *chunk, struct arena_block *b, int c) {
+	b->class = c;
+	b->prev = NULL;
+	b->next = m->free_list[c];
+	if (b->next) b->next->prev = b;
+	m->free_list[c] = b;
+	set_free(chunk, b, true);
+}
+
+static void unlink_block(memfs_t *m, struct arena_chunk *chunk, struct arena_block *b) {
+	if (b->prev) {
+		b->prev->next = b->next;
+	} else {
+		m->free_list[b->class] = b->next;
+	}
+	if (b->next) b->next->prev = b->prev;
+	set_free(chunk, b, false);
+}
+
+static void arena_free(memfs_t *m, void *p, size_t size) {
+	if (!p) return;
+
+	struct arena_chunk *chunk = arena_chunk(m, p);
+	struct arena_block *b = p;
+	int c = arena_class(size);
+
+	// merge with the free buddy, as long as there is one of the same size
+	while (c < ARENA_CLASSES - 1) {
+		size_t offset = (char *)b - chunk->base;
+		struct arena_block *buddy = (struct arena_block *)(chunk->base + (offset ^ ((size_t)ARENA_MIN << c)));
+		if (!is_free(chunk, buddy) || buddy->class != c) break;
+
+		unlink_block(m, chunk, buddy);
+		if (buddy < b) b = buddy;
+		c++;
+	}
+
+	push_block(m, chunk, b, c);
+}
+
+/**
+ * Add a new chunk to the arena, which becomes a single free block
+ */
+static int arena_grow(memfs_t *m) {
+	if (m->size + MEMFS_CHUNK > m->max) return -1;
+
+	struct arena_chunk **chunks = realloc(m->chunks, (m->nchunks + 1) * sizeof(*chunks));
+	if (!chunks) return -1;
+	m->chunks = chunks;
+
+	struct arena_chunk *chunk = calloc(1, sizeof(*chunk));
+	if (!chunk) return -1;
+
+	// aligned, so the chunk of a block is found by its address
+	chunk->base = aligned_alloc(MEMFS_CHUNK, MEMFS_CHUNK);
+	if (!chunk->base) {
+		free(chunk);
+		return -1;
+	}
+
+	// chunks are kept sorted by address
+	size_t i = m->nchunks;
+	while (i > 0 && m->chunks[i - 1]->base > chunk->base) {
+		m->chunks[i] = m->chunks[i - 1];
+		i--;
+	}
+	m->chunks[i] = chunk;
+	m->nchunks++;
+	m->size += MEMFS_CHUNK;
+
+	push_block(m, chunk, (struct arena_block *)chunk->base, ARENA_CLASSES - 1);
+	return 0;
+}
+
+/**
+ * Allocate size bytes, NULL if this would exceed -o mem_size
+ */
+static void *arena_alloc(memfs_t *m, size_t size) {
+	if (size > MEMFS_CHUNK) return NULL;
+
+	int c = arena_class(size);
+
+	// the smallest free block which is large enough
+	int k = c;
+	while (k < ARENA_CLASSES && !m->free_list[k]) k++;
+	if (k == ARENA_CLASSES) {
+		if (arena_grow(m)) return NULL;
+		k = ARENA_CLASSES - 1;
+	}
+
+	struct arena_block *b = m->free_list[k];
+	struct arena_chunk *chunk = arena_chunk(m, b);
+	unlink_block(m, chunk, b);
+
+	// split it, the upper halves stay free
+	while (k > c) {
+		k--;
+		push_block(m, chunk, (struct arena_block *)((char *)b + ((size_t)ARENA_MIN << k)), k);
+	}
+
+	return b;
+}
+
+static struct mem_node *new_node(memfs_t *m, mode_t mode, dev_t rdev) {
+	struct mem_node *node = arena_alloc(m, sizeof(struct mem_node));
+	if (!node) {
+		errno = ENOSPC;
+		return NULL;
+	}
+	memset(node, 0, sizeof(*node));
+
+	if (S_ISDIR(mode)) {
+		node->entries = create_hashtable(16, string_hash, string_equal);
+		if (!node->entries) {
+			arena_free(m, node, sizeof(*node));
+			errno = ENOMEM;
+			return NULL;
+		}
+	}
+
+	node->st.st_dev = m->dev;
+	node->st.st_ino = m->next_ino++;
+	node->st.st_mode = mode;
+	node->st.st_nlink = S_ISDIR(mode) ? 2 : 1;
+	node->st.st_uid = geteuid();
+	node->st.st_gid = getegid();
+	node->st.st_rdev = rdev;
+	node->st.st_blksize = 4096;
+	now(&node->st.st_atim);
+	node->st.st_mtim = node->st.st_atim;
+	node->st.st_ctim = node->st.st_atim;
+	node->fd = -1;
+
+	return node;
+}
+
+/**
+ * Free node once it is neither linked nor open anymore
+ */
+static void put_node(memfs_t *m, struct mem_node *node) {
+	if (node->st.st_nlink > 0 || node->opened > 0) return;
+
+	if (node->entries) hashtable_destroy(node->entries, 0);
+	if (node->fd != -1) close(node->fd);
+	arena_free(m, node->data, node->alloc);
+	arena_free(m, node, sizeof(*node));
+}
+
+/**
+ * Find the node of path
+ */
+static struct mem_node *lookup(memfs_t *m, const char *path) {
+	struct mem_node *node = m->root;
+	char name[NAME_MAX + 1];
+	const char *walk = path;
+
+	while (1) {
+		while (*walk == '/') walk++;
+		if (*walk == '\0') return node;
+
+		const char *end = walk;
+		while (*end != '\0' && *end != '/') end++;
+		size_t len = end - walk;
+
+		if (!S_ISDIR(node->st.st_mode)) {
+			errno = ENOTDIR;
+			return NULL;
+		}
+		if (len > NAME_MAX) {
+			errno = ENAMETOOLONG;
+			return NULL;
+		}
+
+		memcpy(name, walk, len);
+		name[len] = '\0';
+
+		node = hashtable_search(node->entries, name);
+		if (!node) {
+			errno = ENOENT;
+			return NULL;
+		}
+
+		walk = end;
+	}
+}
+
+/**
+ * Find the directory containing path, the last element of path is
+ * copied into name.
+ */
+static struct mem_node *lookup_parent(memfs_t *m, const char *path, char *name) {
+	size_t end = strlen(path);
+	while (end > 0 && path[end - 1] == '/') end--;
+
+	size_t start = end;
+	while (start > 0 && path[start - 1] != '/') start--;
+
+	if (start == end) {
+		// the root directory itself
+		errno = EBUSY;
+		return NULL;
+	}
+	if (end - start > NAME_MAX) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+	if (start >= PATHLEN_MAX) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+
+	char dir[PATHLEN_MAX];
+	memcpy(dir, path, start);
+	dir[start] = '\0';
+
+	memcpy(name, path + start, end - start);
+	name[end - start] = '\0';
+
+	struct mem_node *parent = lookup(m, dir);
+	if (!parent) return NULL;
+
+	if (!S_ISDIR(parent->st.st_mode)) {
+		errno = ENOTDIR;
+		return NULL;
+	}
+
+	return parent;
+}
+
+static void touch_dir(struct mem_node *dir) {
+	now(&dir->st.st_mtim);
+	dir->st.st_ctim = dir->st.st_mtim;
+}
+
+static int add_entry(struct mem_node *dir, const char *name, struct mem_node *node) {
+	char *key = strdup(name);
+	if (!key || !hashtable_insert(dir->entries, key, node)) {
+		free(key);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	if (S_ISDIR(node->st.st_mode)) {
+		node->parent = dir;
+		dir->st.st_nlink++;
+	}
+
+	touch_dir(dir);
+	return 0;
+}
+
+static void remove_entry(struct mem_node *dir, const char *name, struct mem_node *node) {
+	hashtable_remove(dir->entries, (void *)name);
+
+	if (S_ISDIR(node->st.st_mode)) dir->st.st_nlink--;
+
+	touch_dir(dir);
+}
+
+/**
+ * Create a new node at path, data of symlinks is the target
+ */
+static struct mem_node *create_node(memfs_t *m, const char *path, mode_t mode, dev_t rdev, const char *data) {
+	char name[NAME_MAX + 1];
+	struct mem_node *parent = lookup_parent(m, path, name);
+	if (!parent) return NULL;
+
+	if (hashtable_search(parent->entries, name)) {
+		errno = EEXIST;
+		return NULL;
+	}
+
+	struct mem_node *node = new_node(m, mode, rdev);
+	if (!node) return NULL;
+
+	if (data) {
+		size_t len = strlen(data);
+		node->data = arena_alloc(m, len);
+		if (!node->data) {
+			node->st.st_nlink = 0;
+			put_node(m, node);
+			errno = ENOSPC;
+			return NULL;
+		}
+		memcpy(node->data, data, len);
+		node->alloc = len;
+		node->st.st_size = len;
+	}
+
+	if (add_entry(parent, name, node)) {
+		node->st.st_nlink = 0;
+		put_node(m, node);
+		return NULL;
+	}
+
+	return node;
+}
+
+/**
+ * Move the data of node into an unlinked file within the branch directory
+ */
+static int spill(memfs_t *m, struct mem_node *node) {
+	int dirfd = m->dirfd;
+
+	char name[64];
+	snprintf(name, sizeof(name), ".unionfs-spill-%ld-%llu",
+		(long)getpid(), (unsigned long long)node->st.st_ino);
+
+	// might be left over from a crashed daemon with the same pid
+	unlinkat(dirfd, name, 0);
+
+	int fd = openat(dirfd, name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+	if (fd == -1) return -1;
+	unlinkat(dirfd, name, 0);
+
+	size_t done = 0;
+	while (done < (size_t)node->st.st_size) {
+		ssize_t res = pwrite(fd, node->data + done, node->st.st_size - done, done);
+		if (res == -1) {
+			if (errno == EINTR) continue;
+			int err = errno;
+			close(fd);
+			errno = err;
+			return -1;
+		}
+		done += res;
+	}
+
+	DBG("inode %llu spilled\n", (unsigned long long)node->st.st_ino);
+
+	arena_free(m, node->data, node->alloc);
+	node->data = NULL;
+	node->alloc = 0;
+	node->fd = fd;
+
+	return 0;
+}
+
+/**
+ * Make sure node can hold size bytes of data, zeroing anything beyond its
+ * current size
+ */
+static int reserve(memfs_t *m, struct mem_node *node, off_t size) {
+	if (node->fd != -1) return 0;
+
+	if ((size_t)size > node->alloc) {
+		char *data = NULL;
+		if ((size_t)size <= m->spill) data = arena_alloc(m, size);
+
+		if (!data) return spill(m, node);
+
+		if (node->data) memcpy(data, node->data, node->st.st_size);
+		arena_free(m, node->data, node->alloc);
+		node->data = data;
+		node->alloc = arena_round(size);
+	}
+
+	if (size > node->st.st_size) memset(node->data + node->st.st_size, 0, size - node->st.st_size);
+
+	return 0;
+}
+
+static int set_size(memfs_t *m, struct mem_node *node, off_t size) {
+	if (node->fd != -1) {
+		if (ftruncate(node->fd, size) == -1) return -1;
+	} else if (size == 0) {
+		arena_free(m, node->data, node->alloc);
+		node->data = NULL;
+		node->alloc = 0;
+	} else if (reserve(m, node, size) == -1) {
+		return -1;
+	} else if (node->fd != -1 && ftruncate(node->fd, size) == -1) {
+		return -1; // just spilled
+	}
+
+	node->st.st_size = size;
+	now(&node->st.st_mtim);
+	node->st.st_ctim = node->st.st_mtim;
+
+	return 0;
+}
+
+static int memfs_lstat(int branch, const char *path, struct stat *stbuf) {
+	memfs_t *m = MEMFS(branch);
+
+	pthread_rwlock_rdlock(&m->lock);
+
+	struct mem_node *node = lookup(m, path);
+	if (node) {
+		*stbuf = node->st;
+		if (S_ISDIR(node->st.st_mode)) stbuf->st_size = 4096;
+		stbuf->st_blocks = (stbuf->st_size + 511) / 512;
+	}
+
+	pthread_rwlock_unlock(&m->lock);
+
+	return node ? 0 : -1;
+}
+
+static int memfs_open_file(int branch, const char *path, int flags, mode_t mode, branch_file_t *file) {
+	memfs_t *m = MEMFS(branch);
+
+	mem_file_t *mf = malloc(sizeof(mem_file_t));
+	if (!mf) return -1;
+
+	pthread_rwlock_wrlock(&m->lock);
+
+	struct mem_node *node = lookup(m, path);
+	if (!node) {
+		if (errno == ENOENT && (flags & O_CREAT))
+			node = create_node(m, path, S_IFREG | (mode & S_PROT_MASK), 0, NULL);
+	} else if ((flags & O_CREAT) && (flags & O_EXCL)) {
+		node = NULL;
+		errno = EEXIST;
+	} else if (S_ISDIR(node->st.st_mode)) {
+		node = NULL;
+		errno = EISDIR;
+	} else if (S_ISLNK(node->st.st_mode)) {
+		node = NULL;
+		errno = ELOOP;
+	} else if (!S_ISREG(node->st.st_mode)) {
+		node = NULL;
+		errno = ENXIO;
+	} else if ((flags & O_TRUNC) && (flags & O_ACCMODE) != O_RDONLY) {
+		if (set_size(m, node, 0)) node = NULL;
+	}
+
+	if (node) node->opened++;
+
+	pthread_rwlock_unlock(&m->lock);
+
+	if (!node) {
+		int err = errno;
+		free(mf);
+		errno = err;
+		return -1;
+	}
+
+	mf->m = m;
+	mf->node = node;
+	mf->append = flags & O_APPEND;
+
+	file->branch = branch;
+	file->fd = -1;
+	file->data = NULL;
+	file->size = 0;
+	file->priv = mf;
+
+	return 0;
+}
+
+static ssize_t memfs_read(branch_file_t *file, char *buf, size_t size, off_t offset) {
+	mem_file_t *mf = file->priv;
+	memfs_t *m = mf->m;
+	struct mem_node *node = mf->node;
+	ssize_t res;
+
+	pthread_rwlock_rdlock(&m->lock);
+
+	if (node->fd != -1) {
+		res = pread(node->fd, buf, size, offset);
+	} else if (offset >= node->st.st_size) {
+		res = 0;
+	} else {
+		if (size > (size_t)(node->st.st_size - offset)) size = node->st.st_size - offset;
+		memcpy(buf, node->data + offset, size);
+		res = size;
+	}
+
+	pthread_rwlock_unlock(&m->lock);
+
+	return res;
+}
+
+static ssize_t memfs_write(branch_file_t *file, const char *buf, size_t size, off_t offset) {
+	mem_file_t *mf = file->priv;
+	memfs_t *m = mf->m;
+	struct mem_node *node = mf->node;
+	ssize_t res = -1;
+
+	pthread_rwlock_wrlock(&m->lock);
+
+	if (mf->append) offset = node->st.st_size;
+
+	if (reserve(m, node, offset + size) == 0) {
+		if (node->fd != -1) {
+			res = pwrite(node->fd, buf, size, offset);
+		} else {
+			memcpy(node->data + offset, buf, size);
+			res = size;
+		}
+	}
+
+	if (res > 0) {
+		if (offset + res > node->st.st_size) node->st.st_size = offset + res;
+		now(&node->st.st_mtim);
+		node->st.st_ctim = node->st.st_mtim;
+	}
+
+	pthread_rwlock_unlock(&m->lock);
+
+	return res;
+}
+
+static int memfs_close(branch_file_t *file) {
+	mem_file_t *mf = file->priv;
+	memfs_t *m = mf->m;
+
+	pthread_rwlock_wrlock(&m->lock);
+
+	mf->node->opened--;
+	put_node(m, mf->node);
+
+	pthread_rwlock_unlock(&m->lock);
+
+	free(mf);
+	return 0;
+}
+
+struct mem_dirent {
+	char *name;
+	ino_t ino;
+	unsigned char type;
+};
+
+/**
+ * The entries are copied while we hold the lock, filler is called without
+ * it, so it may access the branch itself.
+ */
+static int memfs_readdir(int branch, const char *path, branch_filler_t filler, void *priv) {
+	memfs_t *m = MEMFS(branch);
+
+	pthread_rwlock_rdlock(&m->lock);
+
+	struct mem_node *dir = lookup(m, path);
+	if (dir && !S_ISDIR(dir->st.st_mode)) {
+		dir = NULL;
+		errno = ENOTDIR;
+	}
+	if (!dir) {
+		pthread_rwlock_unlock(&m->lock);
+		return -1;
+	}
+
+	unsigned int count = hashtable_count(dir->entries);
+	struct mem_dirent *entries = malloc((count + 2) * sizeof(struct mem_dirent));
+	if (!entries) {
+		pthread_rwlock_unlock(&m->lock);
+		return -1;
+	}
+
+	entries[0] = (struct mem_dirent){".", dir->st.st_ino, DT_DIR};
+	entries[1] = (struct mem_dirent){"..", dir->parent->st.st_ino, DT_DIR};
+
+	unsigned int n = 2;
+	struct hashtable_itr *itr = count > 0 ? hashtable_iterator(dir->entries) : NULL;
+	if (itr) {
+		do {
+			struct mem_node *node = hashtable_iterator_value(itr);
+			char *name = strdup(hashtable_iterator_key(itr));
+			if (!name) break;
+
+			entries[n++] = (struct mem_dirent){name, node->st.st_ino, IFTODT(node->st.st_mode)};
+		} while (hashtable_iterator_advance(itr));
+		free(itr);
+	}
+
+	pthread_rwlock_unlock(&m->lock);
+
+	unsigned int i;
+	for (i = 0; i < n; i++) {
+		if (filler(priv, entries[i].name, entries[i].ino, entries[i].type)) break;
+	}
+
+	for (i = 2; i < n; i++) free(entries[i].name);
+	free(entries);
+
+	return 0;
+}
+
+static ssize_t memfs_readlink(int branch, const char *path, char *buf, size_t size) {
+	memfs_t *m = MEMFS(branch);
+
+	pthread_rwlock_rdlock(&m->lock);
+
+	struct mem_node *node = lookup(m, path);
+	if (node && !S_ISLNK(node->st.st_mode)) {
+		node = NULL;
+		errno = EINVAL;
+	}
+
+	ssize_t res = -1;
+	if (node) {
+		// readlink() silently truncates, so do we
+		if (size > (size_t)node->st.st_size) size = node->st.st_size;
+		memcpy(buf, node->data, size);
+		res = size;
+	}
+
+	pthread_rwlock_unlock(&m->lock);
+
+	return res;
+}
+
+static int memfs_mknod(int branch, const char *path, mode_t mode, dev_t rdev) {
+	memfs_t *m = MEMFS(branch);
+
+	pthread_rwlock_wrlock(&m->lock);
+	struct mem_node *node = create_node(m, path, mode, rdev, NULL);
+	pthread_rwlock_unlock(&m->lock);
+
+	return node ? 0 : -1;
+}
+
+static int memfs_mkdir(int branch, const char *path, mode_t mode) {
+	return memfs_mknod(branch, path, S_IFDIR | (mode & S_PROT_MASK), 0);
+}
+
+static int memfs_symlink(int branch, const char *target, const char *path) {
+	memfs_t *m = MEMFS(branch);
+
+	pthread_rwlock_wrlock(&m->lock);
+	struct mem_node *node = create_node(m, path, S_IFLNK | S_IRWXU | S_IRWXG | S_IRWXO, 0, target);
+	pthread_rwlock_unlock(&m->lock);
+
+	return node ? 0 : -1;
+}
+
+static int memfs_link(int branch, const char *from, const char *to) {
+	memfs_t *m = MEMFS(branch);
+	char name[NAME_MAX + 1];
+	int res = -1;
+
+	pthread_rwlock_wrlock(&m->lock);
+
+	struct mem_node *node = lookup(m, from);
+	struct mem_node *parent = node ? lookup_parent(m, to, name) : NULL;
+
+	if (!parent) {
+		// errno already set
+	} else if (S_ISDIR(node->st.st_mode)) {
+		errno = EPERM;
+	} else if (hashtable_search(parent->entries, name)) {
+		errno = EEXIST;
+	} else if (add_entry(parent, name, node) == 0) {
+		node->st.st_nlink++;
+		now(&node->st.st_ctim);
+		res = 0;
+	}
+
+	pthread_rwlock_unlock(&m->lock);
+
+	return res;
+}
+
+static int memfs_unlink(int branch, const char *path) {
+	memfs_t *m = MEMFS(branch);
+	char name[NAME_MAX + 1];
+	int res = -1;
+
+	pthread_rwlock_wrlock(&m->lock);
+
+	struct mem_node *parent = lookup_parent(m, path, name);
+	struct mem_node *node = parent ? hashtable_search(parent->entries, name) : NULL;
+
+	if (!parent) {
+		// errno already set
+	} else if (!node) {
+		errno = ENOENT;
+	} else if (S_ISDIR(node->st.st_mode)) {
+		errno = EISDIR;
+	} else {
+		remove_entry(parent, name, node);
+		node->st.st_nlink--;
+		now(&node->st.st_ctim);
+		put_node(m, node);
+		res = 0;
+	}
+
+	pthread_rwlock_unlock(&m->lock);
+
+	return res;
+}
+
+static int memfs_rmdir(int branch, const char *path) {
+	memfs_t *m = MEMFS(branch);
+	char name[NAME_MAX + 1];
+	int res = -1;
+
+	pthread_rwlock_wrlock(&m->lock);
+
+	struct mem_node *parent = lookup_parent(m, path, name);
+	struct mem_node *node = parent ? hashtable_search(parent->entries, name) : NULL;
+
+	if (!parent) {
+		// errno already set
+	} else if (!node) {
+		errno = ENOENT;
+	} else if (!S_ISDIR(node->st.st_mode)) {
+		errno = ENOTDIR;
+	} else if (hashtable_count(node->entries) > 0) {
+		errno = ENOTEMPTY;
+	} else {
+		remove_entry(parent, name, node);
+		node->st.st_nlink = 0;
+		put_node(m, node);
+		res = 0;
+	}
+
+	pthread_rwlock_unlock(&m->lock);
+
+	return res;
+}
+
+static int memfs_rename(int branch, const char *from, const char *to) {
+	memfs_t *m = MEMFS(branch);
+	char from_name[NAME_MAX + 1], to_name[NAME_MAX + 1];
+	int res = -1;
+
+	pthread_rwlock_wrlock(&m->lock);
+
+	struct mem_node *from_dir = lookup_parent(m, from, from_name);
+	struct mem_node *to_dir = from_dir ? lookup_parent(m, to, to_name) : NULL;
+	if (!to_dir) goto out;
+
+	struct mem_node *node = hashtable_search(from_dir->entries, from_name);
+	if (!node) {
+		errno = ENOENT;
+		goto out;
+	}
+
+	struct mem_node *old = hashtable_search(to_dir->entries, to_name);
+	if (old == node) {
+		res = 0;
+		goto out;
+	}
+
+	if (S_ISDIR(node->st.st_mode)) {
+		// a directory must not be moved into itself
+		struct mem_node *walk;
+		for (walk = to_dir; walk != m->root; walk = walk->parent) {
+			if (walk == node) {
+				errno = EINVAL;
+				goto out;
+			}
+		}
+	}
+
+	if (old) {
+		if (S_ISDIR(node->st.st_mode) && !S_ISDIR(old->st.st_mode)) {
+			errno = ENOTDIR;
+			goto out;
+		}
+		if (!S_ISDIR(node->st.st_mode) && S_ISDIR(old->st.st_mode)) {
+			errno = EISDIR;
+			goto out;
+		}
+		if (S_ISDIR(old->st.st_mode) && hashtable_count(old->entries) > 0) {
+			errno = ENOTEMPTY;
+			goto out;
+		}
+	}
+
+	// copy the new name before anything is modified
+	char *key = strdup(to_name);
+	if (!key) goto out;
+
+	if (old) {
+		remove_entry(to_dir, to_name, old);
+		if (S_ISDIR(old->st.st_mode)) old->st.st_nlink = 0;
+		else old->st.st_nlink--;
+		now(&old->st.st_ctim);
+		put_node(m, old);
+	}
+
+	remove_entry(from_dir, from_name, node);
+
+	if (!hashtable_insert(to_dir->entries, key, node)) {
+		// out of memory, put it back where it was
+		free(key);
+		add_entry(from_dir, from_name, node);
+		errno = ENOMEM;
+		goto out;
+	}
+
+	if (S_ISDIR(node->st.st_mode)) {
+		node->parent = to_dir;
+		to_dir->st.st_nlink++;
+	}
+	touch_dir(to_dir);
+	now(&node->st.st_ctim);
+	res = 0;
+
+out:
+	pthread_rwlock_unlock(&m->lock);
+
+	return res;
+}
+
+static int memfs_chmod(int branch, const char *path, mode_t mode) {
+	memfs_t *m = MEMFS(branch);
+
+	pthread_rwlock_wrlock(&m->lock);
+
+	struct mem_node *node = lookup(m, path);
+	if (node) {
+		node->st.st_mode = (node->st.st_mode & S_IFMT) | (mode & S_PROT_MASK);
+		now(&node->st.st_ctim);
+	}
+
+	pthread_rwlock_unlock(&m->lock);
+
+	return node ? 0 : -1;
+}
+
+static int memfs_chown(int branch, const char *path, uid_t uid, gid_t gid) {
+	memfs_t *m = MEMFS(branch);
+
+	pthread_rwlock_wrlock(&m->lock);
+
+	struct mem_node *node = lookup(m, path);
+	if (node) {
+		if (uid != (uid_t)-1) node->st.st_uid = uid;
+		if (gid != (gid_t)-1) node->st.st_gid = gid;
+
+		// just as chown() on other filesystems
+		if (!S_ISDIR(node->st.st_mode)) {
+			node->st.st_mode &= ~S_ISUID;
+			if (node->st.st_mode & S_IXGRP) node->st.st_mode &= ~S_ISGID;
+		}
+		now(&node->st.st_ctim);
+	}
+
+	pthread_rwlock_unlock(&m->lock);
+
+	return node ? 0 : -1;
+}
+
+static int memfs_truncate(int branch, const char *path, off_t size) {
+	memfs_t *m = MEMFS(branch);
+	int res = -1;
+
+	pthread_rwlock_wrlock(&m->lock);
+
+	struct mem_node *node = lookup(m, path);
+	if (!node) {
+		// errno already set
+	} else if (S_ISDIR(node->st.st_mode)) {
+		errno = EISDIR;
+	} else if (!S_ISREG(node->st.st_mode)) {
+		errno = EINVAL;
+	} else {
+		res = set_size(m, node, size);
+	}
+
+	pthread_rwlock_unlock(&m->lock);
+
+	return res;
+}
+
+static void set_time(struct timespec *dst, const struct timespec *ts, const struct timespec *t) {
+	if (ts->tv_nsec == UTIME_OMIT) return;
+	*dst = ts->tv_nsec == UTIME_NOW ? *t : *ts;
+}
+
+static int memfs_utimens(int branch, const char *path, const struct timespec ts[2]) {
+	memfs_t *m = MEMFS(branch);
+
+	pthread_rwlock_wrlock(&m->lock);
+
+	struct mem_node *node = lookup(m, path);
+	if (node) {
+		struct timespec t;
+		now(&t);
+		set_time(&node->st.st_atim, &ts[0], &t);
+		set_time(&node->st.st_mtim, &ts[1], &t);
+		node->st.st_ctim = t;
+	}
+
+	pthread_rwlock_unlock(&m->lock);
+
+	return node ? 0 : -1;
+}
+
+const struct branch_ops memfs_ops = {
+	.lstat = memfs_lstat,
+	.open = memfs_open_file,
+	.read = memfs_read,
+	.close = memfs_close,
+	.readdir = memfs_readdir,
+	.readlink = memfs_readlink,
+	.xattrs = false,
+
+	.write = memfs_write,
+	.mkdir = memfs_mkdir,
+	.mknod = memfs_mknod,
+	.symlink = memfs_symlink,
+	.link = memfs_link,
+	.unlink = memfs_unlink,
+	.rmdir = memfs_rmdir,
+	.rename = memfs_rename,
+	.chmod = memfs_chmod,
+	.chown = memfs_chown,
+	.truncate = memfs_truncate,
+	.utimens = memfs_utimens,
+};
+
+/**
+ * Set up an empty memory branch, which is already opened as branch->fd.
+ * The root directory gets the permissions of the spill directory.
+ */
+int memfs_open(branch_entry_t *branch, const char *path) {
+	struct stat st;
+	if (fstat(branch->fd, &st) == -1) return -1;
+
+	if (!S_ISDIR(st.st_mode)) {
+		fprintf(stderr, "%s: the spill area of a memory branch has to be a directory\n", path);
+		errno = ENOTDIR;
+		return -1;
+	}
+
+	memfs_t *m = calloc(1, sizeof(memfs_t));
+	if (!m) return -1;
+
+	pthread_rwlock_init(&m->lock, NULL);
+	m->dirfd = branch->fd;
+	m->dev = st.st_dev;
+	m->next_ino = 1;
+	m->max = uopt.mem_size < MEMFS_CHUNK ? MEMFS_CHUNK : uopt.mem_size;
+	m->spill = uopt.mem_spill < MEMFS_CHUNK ? uopt.mem_spill : MEMFS_CHUNK;
+
+	m->root = new_node(m, st.st_mode, 0);
+	if (!m->root) {
+		free(m);
+		return -1;
+	}
+	m->root->parent = m->root;
+	m->root->st.st_uid = st.st_uid;
+	m->root->st.st_gid = st.st_gid;
+
+	branch->priv = m;
+
+	return 0;
+}
@@ -0,0 +1,22 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#ifndef MEMFS_H
+#define MEMFS_H
+
+#define MEMFS_CHUNK (1 << 20)			// the arena grows by chunks of this size
+#define MEMFS_SIZE_DEFAULT (128 << 20)		// -o mem_size
+#define MEMFS_SPILL_DEFAULT MEMFS_CHUNK		// -o mem_spill, at most MEMFS_CHUNK
+
+#include "unionfs.h"
+
+struct branch_ops;
+
+extern const struct branch_ops memfs_ops;
+
+int memfs_open(branch_entry_t *branch, const char *path);
+
+#endif
@@ -16,11 +16,20 @@
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #include "conf.h"
 #include "opts.h"
 #include "version.h"
 #include "string.h"
+#include "branch.h"
+#include "memfs.h"
+#include "hide.h"
+#include "index.h"
+#include "peers.h"
+#include "policy.h"
+#include "trace.h"
 
 
 /**
@@ -74,6 +83,35 @@ bool set_debug_onoff(int value)
 }
 
 
+/**
+ * Parse the number of bytes of option name, which may have a k, m or g suffix
+ */
+static size_t parse_size(const char *arg, const char *name)
+{
+	char *end;
+	const char *str = index(arg, '=');
+	unsigned long long size = str ? strtoull(str + 1, &end, 10) : 0;
+
+	if (!str || end == str + 1) {
+		fprintf(stderr, "%s Converting %s to number failed, aborting!\n",
+			__func__, arg);
+		exit(1);
+	}
+
+	switch (*end) {
+		case 'g': case 'G': size <<= 10; // fall through
+		case 'm': case 'M': size <<= 10; // fall through
+		case 'k': case 'K': size <<= 10; end++; break;
+	}
+
+	if (*end != '\0') {
+		fprintf(stderr, "-o %s: invalid size %s, aborting!\n", name, str + 1);
+		exit(1);
+	}
+
+	return size;
+}
+
 /**
  * Set the maximum number of open files
  */
@@ -104,6 +142,10 @@ void uopt_init() {
 	memset(&uopt, 0, sizeof(uopt_t)); // initialize options with zeros first
 
 	pthread_rwlock_init(&uopt.dbgpath_lock, NULL);
+
+	uopt.mem_size = MEMFS_SIZE_DEFAULT;
+	uopt.mem_spill = MEMFS_SPILL_DEFAULT;
+	uopt.trace_time = TRACE_TIME_DEFAULT;
 }
 
 /**
@@ -187,11 +229,20 @@ static void add_branch(char *branch) {
 	// make_absolute() and add_trailing_slash() will corrupt our input (parse string)
 	uopt.branches[uopt.nbranches].path = strdup(res);
 	uopt.branches[uopt.nbranches].rw = 0;
+	uopt.branches[uopt.nbranches].immutable = 0;
+	uopt.branches[uopt.nbranches].memory = 0;
 
 	res = strsep(ptr, "=");
 	if (res) {
 		if (strcasecmp(res, "rw") == 0) {
 			uopt.branches[uopt.nbranches].rw = 1;
+		} else if (strcasecmp(res, "mem") == 0) {
+			// rw-branch kept in memory, the directory takes what does not fit
+			uopt.branches[uopt.nbranches].rw = 1;
+			uopt.branches[uopt.nbranches].memory = 1;
+		} else if (strcasecmp(res, "immutable") == 0) {
+			// read-only and we may cache everything about it forever
+			uopt.branches[uopt.nbranches].immutable = 1;
 		} else if (strcasecmp(res, "ro") == 0) {
 			// no action needed here
 		} else {
@@ -271,9 +322,12 @@ static void print_help(const char *progname) {
 	"unionfs-fuse version "VERSION"\n"
 	"by Radek Podgorny <radek@podgorny.cz>\n"
 	"\n"
-	"Usage: %s [options] branch[=RO/RW][:branch...] mountpoint\n"
+	"Usage: %s [options] branch[=RO/RW/MEM/immutable][:branch...] mountpoint\n"
 	"The first argument is a colon separated list of directories to merge\n"
 	"When neither RO nor RW is specified, selection defaults to RO.\n"
+	"Immutable branches are RO and must not be modified while mounted.\n"
+	"MEM branches are RW and kept in memory, the directory only takes\n"
+	"files which do not fit.\n"
 	"\n"
 	"general options:\n"
 	"    -d                     Enable debug output\n"
@@ -287,15 +341,42 @@ static void print_help(const char *progname) {
 	"    -o cow                 enable copy-on-write\n"
 	"                           mountpoint\n"
 	"    -o debug_file          file to write debug information into\n"
-	"    -o dirs=branch[=RO/RW][:branch...]\n"
+	"    -o dir_cache           answer lookups from the names of directories\n"
+	"                           read before\n"
+	"    -o dirs=branch[=RO/RW/MEM/immutable][:branch...]\n"
 	"                           alternate way to specify directories to merge\n"
+	"    -o drop_behind         drop the page cache of branches behind\n"
+	"                           large sequential reads\n"
 	"    -o hide_meta_files     \".unionfs\" is a secret directory not\n"
 	"                           visible by readdir(), and so are\n" 
         "                           .fuse_hidden* files\n"
+	"    -o hide_patterns=glob[:glob...]\n"
+	"                           hide these names instead, globs with a\n"
+	"                           '/' match the whole path\n"
+	"    -o index_dir=dir       share indexes of immutable branches with\n"
+	"                           other mounts in this directory\n"
 	"    -o max_files=number    Increase the maximum number of open files\n"
+	"    -o mem_size=bytes[kmg] memory of each MEM branch (default 128m)\n"
+	"    -o mem_spill=bytes[kmg]\n"
+	"                           MEM branches keep larger files in their\n"
+	"                           directory (default and maximum 1m)\n"
+	"    -o peers=file          keep caches coherent with other mounts\n"
+	"                           sharing this log file\n"
+	"    -o policy=file         per-subtree settings, e.g. direct_io\n"
+	"    -o prefetch=file       prefetch the files of a manifest on mount\n"
+	"    -o prewarm             fill the caches from immutable branches\n"
+	"                           on mount\n"
 	"    -o relaxed_permissions Disable permissions checks, but only if\n"
 	"                           running neither as UID=0 or GID=0\n"
+	"    -o statfs_cache=seconds\n"
+	"                           cache statfs() results for that long\n"
 	"    -o statfs_omit_ro      do not count blocks of ro-branches\n"
+	"    -o symlink_cache       cache symlink targets\n"
+	"    -o trace=file          record a manifest of the files read after\n"
+	"                           mount, for -o prefetch\n"
+	"    -o trace_time=seconds  record for that long (default 60)\n"
+	"    -o xattr_cache         cache extended attributes, including\n"
+	"                           non-existing ones\n"
 	"\n",
 	progname);
 }
@@ -314,6 +395,40 @@ void unionfs_post_opts(void) {
 		}
 	}
 
+	// the directory of the indexes is needed by branch_init(), also for
+	// branches added later on, so it is opened once like the branches
+	if (uopt.index_dir) {
+		char path[PATHLEN_MAX];
+
+		if (!uopt.chroot) {
+			BUILD_PATH(path, uopt.index_dir);
+		} else {
+			BUILD_PATH(path, uopt.chroot, uopt.index_dir);
+		}
+
+		if (index_init(path)) {
+			fprintf(stderr, "Failed to open index directory %s: %s. Aborting!\n",
+				path, strerror(errno));
+			exit(1);
+		}
+	}
+
+	if (uopt.peers_file) {
+		char path[PATHLEN_MAX];
+
+		if (!uopt.chroot) {
+			BUILD_PATH(path, uopt.peers_file);
+		} else {
+			BUILD_PATH(path, uopt.chroot, uopt.peers_file);
+		}
+
+		if (peers_init(path)) {
+			fprintf(stderr, "Failed to open peers log %s: %s. Aborting!\n",
+				path, strerror(errno));
+			exit(1);
+		}
+	}
+
 	// Make the pathes absolute and add trailing slashes
 	int i;
 	for (i = 0; i<uopt.nbranches; i++) {
@@ -323,7 +438,6 @@ void unionfs_post_opts(void) {
 		if (!uopt.chroot) {
 			uopt.branches[i].path = make_absolute(uopt.branches[i].path);
 		}
-		uopt.branches[i].path = add_trailing_slash(uopt.branches[i].path);
 
 		// Prevent accidental umounts. Especially system shutdown scripts tend
 		// to umount everything they can. If we don't have an open file descriptor,
@@ -336,6 +450,12 @@ void unionfs_post_opts(void) {
 			BUILD_PATH(path, uopt.chroot, uopt.branches[i].path);
 		}
 
+		// image files must not get a trailing slash
+		struct stat st;
+		if (stat(path, &st) || S_ISDIR(st.st_mode)) {
+			uopt.branches[i].path = add_trailing_slash(uopt.branches[i].path);
+		}
+
 		int fd = open(path, O_RDONLY);
 		if (fd == -1) {
 			fprintf(stderr, "\nFailed to open %s: %s. Aborting!\n\n",
@@ -344,6 +464,35 @@ void unionfs_post_opts(void) {
 		}
 		uopt.branches[i].fd = fd;
 		uopt.branches[i].path_len = strlen(path);
+
+		if (branch_init(&uopt.branches[i], path)) {
+			fprintf(stderr, "\nFailed to set up branch %s: %s. Aborting!\n\n",
+				path, strerror(errno));
+			exit(1);
+		}
+	}
+
+	hide_init(uopt.hide_patterns);
+
+	if (uopt.policy_file) {
+		// like the branches, with -ochroot= it is a path within the chroot,
+		// where reloads will look for it
+		char path[PATHLEN_MAX];
+		int res = -ENAMETOOLONG;
+
+		if (!uopt.chroot) {
+			uopt.policy_file = make_absolute(uopt.policy_file);
+			if (!uopt.policy_file) exit(1);
+			if (!BUILD_PATH(path, uopt.policy_file)) res = policy_load(path);
+		} else {
+			if (!BUILD_PATH(path, uopt.chroot, uopt.policy_file)) res = policy_load(path);
+		}
+
+		if (res) {
+			fprintf(stderr, "Failed to load policy file %s: %s. Aborting!\n",
+				uopt.policy_file, strerror(-res));
+			exit(1);
+		}
 	}
 }
 
@@ -374,6 +523,12 @@ int unionfs_opt_proc(void *data, const char *arg, int key, struct fuse_args *out
 			uopt.dbgpath = get_opt_str(arg, "debug_file");
 			uopt.debug = true;
 			return 0;
+		case KEY_DIR_CACHE:
+			uopt.dir_cache = true;
+			return 0;
+		case KEY_DROP_BEHIND:
+			uopt.drop_behind = true;
+			return 0;
 		case KEY_HELP:
 			print_help(outargs->argv[0]);
 			fuse_opt_add_arg(outargs, "-ho");
@@ -383,15 +538,60 @@ int unionfs_opt_proc(void *data, const char *arg, int key, struct fuse_args *out
 		case KEY_HIDE_METADIR:
 			uopt.hide_meta_files = true;
 			return 0;
+		case KEY_HIDE_PATTERNS:
+			uopt.hide_patterns = get_opt_str(arg, "hide_patterns");
+			uopt.hide_meta_files = true;
+			return 0;
+		case KEY_INDEX_DIR:
+			uopt.index_dir = get_opt_str(arg, "index_dir");
+			return 0;
 		case KEY_MAX_FILES:
 			set_max_open_files(arg);
 			return 0;
+		case KEY_MEM_SIZE:
+			uopt.mem_size = parse_size(arg, "mem_size");
+			return 0;
+		case KEY_MEM_SPILL:
+			uopt.mem_spill = parse_size(arg, "mem_spill");
+			return 0;
+		case KEY_PEERS:
+			uopt.peers_file = get_opt_str(arg, "peers");
+			return 0;
 		case KEY_NOINITGROUPS:
 			// option only for compatibility with older versions
 			return 0;
+		case KEY_POLICY:
+			uopt.policy_file = get_opt_str(arg, "policy");
+			return 0;
+		case KEY_PREFETCH:
+			uopt.prefetch_file = get_opt_str(arg, "prefetch");
+			return 0;
+		case KEY_PREWARM:
+			uopt.prewarm = true;
+			return 0;
+		case KEY_STATFS_CACHE:
+			if (sscanf(arg, "statfs_cache=%u", &uopt.statfs_cache) != 1) {
+				fprintf(stderr, "%s Converting %s to number failed, aborting!\n",
+					__func__, arg);
+				exit(1);
+			}
+			return 0;
 		case KEY_STATFS_OMIT_RO:
 			uopt.statfs_omit_ro = true;
 			return 0;
+		case KEY_SYMLINK_CACHE:
+			uopt.symlink_cache = true;
+			return 0;
+		case KEY_TRACE:
+			uopt.trace_file = get_opt_str(arg, "trace");
+			return 0;
+		case KEY_TRACE_TIME:
+			if (sscanf(arg, "trace_time=%u", &uopt.trace_time) != 1) {
+				fprintf(stderr, "%s Converting %s to number failed, aborting!\n",
+					__func__, arg);
+				exit(1);
+			}
+			return 0;
 		case KEY_RELAXED_PERMISSIONS:
 			uopt.relaxed_permissions = true;
 			return 0;
@@ -402,6 +602,9 @@ int unionfs_opt_proc(void *data, const char *arg, int key, struct fuse_args *out
 #endif
 			uopt.doexit = 1;
 			return 1;
+		case KEY_XATTR_CACHE:
+			uopt.xattr_cache = true;
+			return 0;
 		default:
  			uopt.retval = 1;
 			return 1;
@@ -22,6 +22,7 @@ typedef struct {
 
 	bool cow_enabled;
 	bool statfs_omit_ro;
+	unsigned int statfs_cache; // seconds to cache statfs() results, 0 disables
 	int doexit;
 	int retval;
 	char *chroot; 		// chroot we might go into
@@ -29,7 +30,21 @@ typedef struct {
 	char *dbgpath;		// debug file we write debug information into
 	pthread_rwlock_t dbgpath_lock; // locks dbgpath
 	bool hide_meta_files;
+	char *hide_patterns;	// ':' separated globs to hide, NULL for the defaults
+	char *index_dir;	// indexes of immutable branches, see index.c
 	bool relaxed_permissions;
+	bool xattr_cache;	// cache getxattr()/listxattr() results
+	bool symlink_cache;	// cache readlink() results
+	bool dir_cache;		// answer lookups from complete directory listings
+	bool drop_behind;	// drop the page cache of branches behind streaming reads
+	bool prewarm;		// populate caches from immutable branches on mount
+	char *peers_file;	// log shared with other mounts, see peers.c
+	char *policy_file;	// per-subtree settings, see policy.c
+	char *prefetch_file;	// manifest to prefetch on mount, see trace.c
+	char *trace_file;	// manifest to record after mount
+	unsigned int trace_time; // seconds to record
+	size_t mem_size;	// memory branches: maximum size of the arena
+	size_t mem_spill;	// memory branches: files larger than this go to disk
 
 } uopt_t;
 
@@ -37,15 +52,30 @@ enum {
 	KEY_CHROOT,
 	KEY_COW,
 	KEY_DEBUG_FILE,
+	KEY_DIR_CACHE,
 	KEY_DIRS,
+	KEY_DROP_BEHIND,
 	KEY_HELP,
 	KEY_HIDE_META_FILES,
 	KEY_HIDE_METADIR,
+	KEY_HIDE_PATTERNS,
+	KEY_INDEX_DIR,
 	KEY_MAX_FILES,
+	KEY_MEM_SIZE,
+	KEY_MEM_SPILL,
 	KEY_NOINITGROUPS,
+	KEY_PEERS,
+	KEY_POLICY,
+	KEY_PREFETCH,
+	KEY_PREWARM,
 	KEY_RELAXED_PERMISSIONS,
+	KEY_STATFS_CACHE,
 	KEY_STATFS_OMIT_RO,
-	KEY_VERSION
+	KEY_SYMLINK_CACHE,
+	KEY_TRACE,
+	KEY_TRACE_TIME,
+	KEY_VERSION,
+	KEY_XATTR_CACHE
 };
 
 
@@ -0,0 +1,189 @@
+/*
+*  C Implementation: pathlock
+*
+* Description: Striped locks serializing modifications of the same path
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+*
+* Details:
+*	Modifications are sequences of branch operations, e.g. a copy-up,
+*	then the modification itself and then removing a whiteout. Two such
+*	sequences on the same path must not interleave, but sequences on
+*	different paths should still run in parallel. So paths are hashed to
+*	one of PATHLOCK_STRIPES mutexes. Unrelated paths only rarely share a
+*	stripe and if they do, they just wait a little.
+*	A sequence also depends on the parent directories of its path, e.g.
+*	a copy-up recreates them on the rw branch. So the stripes of all
+*	parents are taken as well, but shared: operations on different files
+*	of a directory still run in parallel, while a rename() or rmdir() of
+*	the directory, which takes its own path exclusively, waits for them.
+*	rename() and link() lock two paths. To avoid deadlocks all stripes
+*	are always taken in ascending order, each of them only once, and
+*	exclusively if any of the paths needs it exclusively. Nobody holding
+*	a path lock waits for another one, path_trylock() gives up instead.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "unionfs.h"
+#include "debug.h"
+#include "string.h"
+#include "uioctl.h"
+#include "pathlock.h"
+
+static pthread_rwlock_t stripes[PATHLOCK_STRIPES] = {
+	[0 ... PATHLOCK_STRIPES - 1] = PTHREAD_RWLOCK_INITIALIZER
+};
+
+// stripes needed by an operation, one bit each
+typedef struct {
+	uint64_t exclusive[PATHLOCK_STRIPES / 64];
+	uint64_t shared[PATHLOCK_STRIPES / 64];
+} stripe_set_t;
+
+static uint64_t acquired;
+static uint64_t contended;	// had to wait for another thread
+static uint64_t wait_ns;	// total time spent waiting
+
+static int stripe(const char *path) {
+	return string_hash((void *)path) & (PATHLOCK_STRIPES - 1);
+}
+
+static void set_bit(uint64_t *bits, int s) {
+	bits[s / 64] |= 1ULL << (s % 64);
+}
+
+static bool test_bit(const uint64_t *bits, int s) {
+	return bits[s / 64] & (1ULL << (s % 64));
+}
+
+/**
+ * Add path exclusively and its parents, except the root, shared to set
+ */
+static void add_path(stripe_set_t *set, const char *path) {
+	if (!path) return;
+
+	set_bit(set->exclusive, stripe(path));
+
+	char parent[PATHLEN_MAX];
+	size_t len = strlen(path);
+	if (len >= sizeof(parent)) return;
+	memcpy(parent, path, len + 1);
+
+	size_t i;
+	for (i = 1; i < len; i++) {
+		if (parent[i] != '/') continue;
+
+		parent[i] = '\0';
+		set_bit(set->shared, stripe(parent));
+		parent[i] = '/';
+	}
+}
+
+static void get_set(stripe_set_t *set, const char *path1, const char *path2) {
+	memset(set, 0, sizeof(*set));
+	add_path(set, path1);
+	add_path(set, path2);
+}
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void lock_stripe(int s, bool exclusive) {
+	__sync_fetch_and_add(&acquired, 1);
+
+	pthread_rwlock_t *lock = &stripes[s];
+	if ((exclusive ? pthread_rwlock_trywrlock(lock) : pthread_rwlock_tryrdlock(lock)) == 0) return;
+
+	uint64_t start = now_ns();
+	if (exclusive) {
+		pthread_rwlock_wrlock(lock);
+	} else {
+		pthread_rwlock_rdlock(lock);
+	}
+
+	__sync_fetch_and_add(&contended, 1);
+	__sync_fetch_and_add(&wait_ns, now_ns() - start);
+}
+
+/**
+ * Lock path1 and path2, either might be NULL, and share the locks of
+ * their parents
+ */
+void path_lock(const char *path1, const char *path2) {
+	stripe_set_t set;
+	get_set(&set, path1, path2);
+
+	int s;
+	for (s = 0; s < PATHLOCK_STRIPES; s++) {
+		if (test_bit(set.exclusive, s)) {
+			lock_stripe(s, true);
+		} else if (test_bit(set.shared, s)) {
+			lock_stripe(s, false);
+		}
+	}
+}
+
+/**
+ * Lock path like path_lock(), but without waiting. Returns -1 if one of
+ * the stripes is busy, possibly because of a lock the caller holds.
+ */
+int path_trylock(const char *path) {
+	stripe_set_t set;
+	get_set(&set, path, NULL);
+
+	int s;
+	for (s = 0; s < PATHLOCK_STRIPES; s++) {
+		int res = 0;
+		if (test_bit(set.exclusive, s)) {
+			res = pthread_rwlock_trywrlock(&stripes[s]);
+		} else if (test_bit(set.shared, s)) {
+			res = pthread_rwlock_tryrdlock(&stripes[s]);
+		} else {
+			continue;
+		}
+
+		if (res) {
+			while (--s >= 0) {
+				if (test_bit(set.exclusive, s) || test_bit(set.shared, s)) {
+					pthread_rwlock_unlock(&stripes[s]);
+				}
+			}
+			errno = EBUSY;
+			return -1;
+		}
+		__sync_fetch_and_add(&acquired, 1);
+	}
+
+	return 0;
+}
+
+void path_unlock(const char *path1, const char *path2) {
+	stripe_set_t set;
+	get_set(&set, path1, path2);
+
+	int s;
+	for (s = 0; s < PATHLOCK_STRIPES; s++) {
+		if (test_bit(set.exclusive, s) || test_bit(set.shared, s)) {
+			pthread_rwlock_unlock(&stripes[s]);
+		}
+	}
+}
+
+void path_lock_stats(struct unionfs_stats *stats) {
+	stats->path_lock_acquired = acquired;
+	stats->path_lock_contended = contended;
+	stats->path_lock_wait_ns = wait_ns;
+}
@@ -0,0 +1,19 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#ifndef PATHLOCK_H
+#define PATHLOCK_H
+
+#define PATHLOCK_STRIPES 256 // must be a power of two
+
+struct unionfs_stats;
+
+void path_lock(const char *path1, const char *path2);
+int path_trylock(const char *path);
+void path_unlock(const char *path1, const char *path2);
+void path_lock_stats(struct unionfs_stats *stats);
+
+#endif
@@ -0,0 +1,245 @@
+/*
+*  C Implementation: peers
+*
+* Description: Keep the caches of several mounts of the same branches
+*              coherent
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+*
+* Details:
+*	Our caches (see cache.c) only know about changes made through this
+*	mount. If the same rw branch is mounted by several unionfs processes,
+*	each of them has to learn about the changes of the others. With
+*	-o peers=file, all of them map the same log file, typically on the
+*	filesystem of the shared branch. Every cache_invalidate() appends the
+*	path to the log and a thread of each mount reads the records of the
+*	others every PEERS_POLL_MS milliseconds and drops the matching cache
+*	entries, so a change made by a peer is seen after at most that time.
+*	The log is a ring of PEERS_SLOTS records. A writer takes the next
+*	sequence number from the header and marks its slot as busy while it
+*	fills it in. A reader which got too far behind, or finds a record
+*	overwritten while reading it, can not know what it missed and drops
+*	all cache entries instead. A record which stays busy for
+*	PEERS_STALL_POLLS polls, because its writer died, is skipped the same way.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "unionfs.h"
+#include "opts.h"
+#include "debug.h"
+#include "usyslog.h"
+#include "cache.h"
+#include "uioctl.h"
+#include "peers.h"
+
+#define PEERS_MAGIC "UNIONLOG"
+#define PEERS_VERSION 1
+#define PEERS_SLOTS 1024
+#define PEERS_POLL_MS 100
+#define PEERS_STALL_POLLS 10
+
+struct peers_record {
+	uint64_t seq;		// sequence number + 1 once written, 0 while busy
+	uint64_t instance;	// the mount which wrote it
+	uint32_t tree;		// everything below path changed as well
+	uint32_t unused;
+	char path[PATHLEN_MAX];
+};
+
+struct peers_log {
+	char magic[8];		// PEERS_MAGIC, not '\0' terminated
+	uint32_t version;	// PEERS_VERSION
+	uint32_t nslots;	// PEERS_SLOTS
+	uint64_t seq;		// sequence number of the next record
+	uint64_t unused[5];
+	struct peers_record records[PEERS_SLOTS];
+};
+
+static struct peers_log *plog;
+static uint64_t instance;	// tells our own records from those of peers
+static uint64_t next_seq;	// the next record to read
+static unsigned int stalled;	// polls the record next_seq was busy
+static uint64_t invalidations;
+
+/**
+ * Map the log file at path, which is created if it does not exist yet
+ */
+int peers_init(const char *path) {
+	int fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+	if (fd == -1) return -1;
+
+	// peers mounting at the same time must not see a half initialized log
+	if (flock(fd, LOCK_EX) == -1) goto err;
+
+	struct stat st;
+	if (fstat(fd, &st) == -1) goto err;
+
+	// a new log is all zeros
+	if (st.st_size < (off_t)sizeof(struct peers_log) &&
+	    ftruncate(fd, sizeof(struct peers_log)) == -1) goto err;
+
+	struct peers_log *log = mmap(NULL, sizeof(struct peers_log), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (log == MAP_FAILED) goto err;
+
+	if (log->magic[0] == '\0') {
+		log->version = PEERS_VERSION;
+		log->nslots = PEERS_SLOTS;
+		memcpy(log->magic, PEERS_MAGIC, sizeof(log->magic));
+	}
+	// the mapping keeps the file open, so the lock is not dropped by close()
+	flock(fd, LOCK_UN);
+	close(fd);
+
+	if (memcmp(log->magic, PEERS_MAGIC, sizeof(log->magic)) != 0 ||
+	    log->version != PEERS_VERSION || log->nslots != PEERS_SLOTS) {
+		fprintf(stderr, "%s: not a unionfs peers log\n", path);
+		munmap(log, sizeof(struct peers_log));
+		errno = EINVAL;
+		return -1;
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	instance = ((uint64_t)getpid() << 32) ^ (uint64_t)now.tv_sec ^ ((uint64_t)now.tv_nsec << 16);
+
+	// records written before we were mounted do not concern us
+	next_seq = __atomic_load_n(&log->seq, __ATOMIC_ACQUIRE);
+	plog = log;
+
+	return 0;
+
+err:;
+	int e = errno;
+	close(fd);
+	errno = e;
+	return -1;
+}
+
+/**
+ * Tell the peers that path, or everything below it with tree, changed
+ */
+void peers_publish(const char *path, bool tree) {
+	if (!plog) return;
+
+	uint64_t seq = __atomic_fetch_add(&plog->seq, 1, __ATOMIC_ACQ_REL);
+	struct peers_record *r = &plog->records[seq % PEERS_SLOTS];
+
+	__atomic_store_n(&r->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	r->instance = instance;
+	r->tree = tree;
+	strncpy(r->path, path, sizeof(r->path) - 1);
+	r->path[sizeof(r->path) - 1] = '\0';
+
+	__atomic_store_n(&r->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * We lost track of what changed, forget everything
+ */
+static void lost(uint64_t head) {
+	USYSLOG(LOG_WARNING, "lost %llu records of peers, dropping all cache entries\n",
+		(unsigned long long)(head - next_seq));
+	cache_drop_tree("/");
+	next_seq = head;
+	stalled = 0;
+}
+
+/**
+ * Apply the new records of peers
+ */
+static void poll_log(void) {
+	uint64_t head = __atomic_load_n(&plog->seq, __ATOMIC_ACQUIRE);
+
+	if (head - next_seq > PEERS_SLOTS) {
+		lost(head);
+		return;
+	}
+
+	while (next_seq != head) {
+		struct peers_record *r = &plog->records[next_seq % PEERS_SLOTS];
+
+		uint64_t seq = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE);
+		if (seq != next_seq + 1) {
+			// still being written, or already overwritten by a newer one
+			if (seq <= next_seq && ++stalled < PEERS_STALL_POLLS) return;
+			lost(head);
+			return;
+		}
+
+		struct peers_record rec;
+		rec.instance = r->instance;
+		rec.tree = r->tree;
+		memcpy(rec.path, r->path, sizeof(rec.path));
+		rec.path[sizeof(rec.path) - 1] = '\0';
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&r->seq, __ATOMIC_RELAXED) != seq) {
+			lost(head);
+			return;
+		}
+
+		if (rec.instance != instance) {
+			if (rec.tree) {
+				cache_drop_tree(rec.path);
+			} else {
+				cache_drop(rec.path);
+			}
+			__atomic_add_fetch(&invalidations, 1, __ATOMIC_RELAXED);
+		}
+
+		next_seq++;
+		stalled = 0;
+	}
+}
+
+static void *peers_thread(void *arg) {
+	(void)arg;
+
+	struct timespec interval = {
+		.tv_sec = PEERS_POLL_MS / 1000,
+		.tv_nsec = (PEERS_POLL_MS % 1000) * 1000000L,
+	};
+
+	while (1) {
+		nanosleep(&interval, NULL);
+		poll_log();
+	}
+
+	return NULL;
+}
+
+/**
+ * Start reading the records of peers, after we daemonized
+ */
+void peers_start(void) {
+	if (!plog) return;
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, peers_thread, NULL)) {
+		USYSLOG(LOG_ERR, "Failed to start the peers thread, caches might be stale\n");
+		return;
+	}
+	pthread_detach(thread);
+}
+
+void peers_stats(struct unionfs_stats *stats) {
+	stats->peer_invalidations = __atomic_load_n(&invalidations, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,19 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#ifndef PEERS_H
+#define PEERS_H
+
+#include <stdbool.h>
+
+struct unionfs_stats;
+
+int peers_init(const char *path);
+void peers_start(void);
+void peers_publish(const char *path, bool tree);
+void peers_stats(struct unionfs_stats *stats);
+
+#endif
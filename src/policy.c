@@ -0,0 +1,267 @@
+/*
+*  C Implementation: policy
+*
+* Description: Per-subtree settings, read from a policy file
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+*
+* Details:
+*	Each line of the policy file is a path within the union followed by
+*	the settings of everything below it, e.g.
+*
+*		/var/log	direct_io nocache
+*		/usr		keep_cache
+*		/srv/db		cow=open
+*
+*	A path element which is just a '*' matches any name. The rule of the
+*	longest matching path applies as a whole, settings are not merged with
+*	those of shorter paths, so a path without any setting restores the
+*	defaults for its subtree. Empty lines and lines starting with '#' are ignored.
+*	The rules are kept as a trie of path elements, so a lookup only walks
+*	the elements of the path once, no matter how many rules there are.
+*	A reload builds a new trie and swaps it in, so lookups never see a
+*	half-read file, and a broken file keeps the old rules.
+*/
+
+#if defined __linux__
+	// For getline()
+	#define _XOPEN_SOURCE 700
+	#define _DEFAULT_SOURCE 1
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "unionfs.h"
+#include "opts.h"
+#include "debug.h"
+#include "usyslog.h"
+#include "cache.h"
+#include "policy.h"
+
+typedef struct node {
+	struct node *children;	// by their exact name
+	struct node *any;	// the child named '*'
+	struct node *next;	// next sibling
+	bool has_rule;
+	unsigned int policy;
+	size_t len;
+	char name[];
+} node_t;
+
+static node_t *rules;
+static pthread_rwlock_t rules_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static node_t *new_node(const char *name, size_t len) {
+	node_t *n = calloc(1, sizeof(node_t) + len + 1);
+	if (!n) return NULL;
+
+	n->len = len;
+	memcpy(n->name, name, len);
+	n->name[len] = '\0';
+
+	return n;
+}
+
+static void free_node(node_t *n) {
+	while (n) {
+		node_t *next = n->next;
+		free_node(n->children);
+		free_node(n->any);
+		free(n);
+		n = next;
+	}
+}
+
+/**
+ * Find or add the node of path below root
+ */
+static node_t *add_path(node_t *root, const char *path) {
+	node_t *n = root;
+
+	while (1) {
+		while (*path == '/') path++;
+		if (!*path) return n;
+
+		size_t len = strcspn(path, "/");
+
+		node_t **child;
+		if (len == 1 && path[0] == '*') {
+			child = &n->any;
+		} else {
+			for (child = &n->children; *child; child = &(*child)->next) {
+				if ((*child)->len == len && memcmp((*child)->name, path, len) == 0) break;
+			}
+		}
+
+		if (!*child) {
+			*child = new_node(path, len);
+			if (!*child) return NULL;
+		}
+
+		n = *child;
+		path += len;
+	}
+}
+
+static int parse_setting(const char *word, unsigned int *policy) {
+	if (strcmp(word, "direct_io") == 0) {
+		*policy |= POLICY_DIRECT_IO;
+	} else if (strcmp(word, "keep_cache") == 0) {
+		*policy |= POLICY_KEEP_CACHE;
+	} else if (strcmp(word, "nocache") == 0) {
+		*policy |= POLICY_NOCACHE;
+	} else if (strcmp(word, "cow=open") == 0) {
+		*policy |= POLICY_COW_OPEN;
+	} else if (strcmp(word, "cow=write") == 0) {
+		*policy &= ~POLICY_COW_OPEN;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Parse one line into root, returns 0 or -errno
+ */
+static int parse_line(node_t *root, char *line, const char *file, int lineno) {
+	char *save;
+	char *path = strtok_r(line, " \t\r\n", &save);
+	if (!path || path[0] == '#') return 0;
+
+	if (path[0] != '/') {
+		USYSLOG(LOG_ERR, "%s:%d: %s is not an absolute path\n", file, lineno, path);
+		return -EINVAL;
+	}
+
+	unsigned int policy = 0;
+	char *word;
+	while ((word = strtok_r(NULL, " \t\r\n", &save))) {
+		if (parse_setting(word, &policy)) {
+			USYSLOG(LOG_ERR, "%s:%d: unknown setting %s\n", file, lineno, word);
+			return -EINVAL;
+		}
+	}
+
+	node_t *n = add_path(root, path);
+	if (!n) return -ENOMEM;
+
+	// a later rule for the same path wins
+	n->has_rule = true;
+	n->policy = policy;
+
+	return 0;
+}
+
+static int parse(const char *file, node_t **root) {
+	FILE *fp = fopen(file, "r");
+	if (!fp) return -errno;
+
+	int res = 0;
+	*root = new_node("", 0);
+	if (!*root) res = -ENOMEM;
+
+	char *line = NULL;
+	size_t size = 0;
+	int lineno = 0;
+	while (!res && getline(&line, &size, fp) != -1) {
+		res = parse_line(*root, line, file, ++lineno);
+	}
+	if (!res && ferror(fp)) res = -EIO;
+
+	free(line);
+	fclose(fp);
+
+	if (res) {
+		free_node(*root);
+		*root = NULL;
+	}
+	return res;
+}
+
+/**
+ * Read the rules from file and use them from now on. Returns 0 or -errno,
+ * the previous rules stay in place on failure.
+ */
+int policy_load(const char *file) {
+	node_t *root;
+
+	int res = parse(file, &root);
+	if (res) return res;
+
+	pthread_rwlock_wrlock(&rules_lock);
+	node_t *old = rules;
+	rules = root;
+	pthread_rwlock_unlock(&rules_lock);
+
+	free_node(old);
+	return 0;
+}
+
+/**
+ * Read the policy file given on mount again
+ */
+int policy_reload(void) {
+	if (!uopt.policy_file) return -ENOENT;
+
+	int res = policy_load(uopt.policy_file);
+	if (res) return res;
+
+	// a subtree might just have become nocache, peers have their own policy
+	cache_drop_tree("/");
+
+	USYSLOG(LOG_INFO, "reloaded policy file %s\n", uopt.policy_file);
+	return 0;
+}
+
+/**
+ * Find the most specific rule for path below n, which is at depth. An
+ * exact name is tried before '*', so it wins at the same depth.
+ */
+static void match(const node_t *n, const char *path, int depth, const node_t **best, int *best_depth) {
+	if (n->has_rule && depth > *best_depth) {
+		*best = n;
+		*best_depth = depth;
+	}
+
+	while (*path == '/') path++;
+	if (!*path) return;
+
+	size_t len = strcspn(path, "/");
+
+	const node_t *child;
+	for (child = n->children; child; child = child->next) {
+		if (child->len == len && memcmp(child->name, path, len) == 0) {
+			match(child, path + len, depth + 1, best, best_depth);
+			break;
+		}
+	}
+
+	if (n->any) match(n->any, path + len, depth + 1, best, best_depth);
+}
+
+/**
+ * The POLICY_* settings of path
+ */
+unsigned int policy_of(const char *path) {
+	if (!uopt.policy_file) return 0;
+
+	const node_t *best = NULL;
+	int best_depth = -1;
+
+	pthread_rwlock_rdlock(&rules_lock);
+
+	if (rules) match(rules, path, 0, &best, &best_depth);
+	unsigned int policy = best ? best->policy : 0;
+
+	pthread_rwlock_unlock(&rules_lock);
+
+	return policy;
+}
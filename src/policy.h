@@ -0,0 +1,24 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#ifndef POLICY_H
+#define POLICY_H
+
+/**
+ * Settings of a subtree, see policy.c
+ */
+enum {
+	POLICY_DIRECT_IO  = 1 << 0,	// open files with direct_io
+	POLICY_KEEP_CACHE = 1 << 1,	// keep the page cache of the kernel on open
+	POLICY_NOCACHE    = 1 << 2,	// do not keep cache entries of our own
+	POLICY_COW_OPEN   = 1 << 3,	// copy-up on open, not on the first write
+};
+
+int policy_load(const char *file);
+int policy_reload(void);
+unsigned int policy_of(const char *path);
+
+#endif
@@ -0,0 +1,143 @@
+/*
+*  C Implementation: prewarm
+*
+* Description: Populate caches from immutable branches at mount time
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+*
+* Details:
+*	Immutable branches do not change while we are mounted, so everything
+*	we learn about them stays valid unless it gets hidden or copied up by
+*	operations on the union, which invalidate the caches anyway.
+*	A background thread walks all immutable branches once and fills the
+*	caches, so that even the first access is a cache hit.
+*	An entry is only added, if the immutable branch is the one serving
+*	the path in the union, i.e. it is not hidden by a higher branch.
+*	The scan stops early if branches are added or removed meanwhile.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "unionfs.h"
+#include "opts.h"
+#include "debug.h"
+#include "findbranch.h"
+#include "string.h"
+#include "symlink_cache.h"
+#include "usyslog.h"
+#include "prewarm.h"
+#include "branch.h"
+#include "reconf.h"
+
+static void prewarm_symlink(const char *path, int branch) {
+	if (!uopt.symlink_cache) return;
+
+	unsigned int gen = symlink_cache_generation();
+
+	if (find_rorw_branch(path) != branch) return; // hidden by another branch
+
+	char target[PATHLEN_MAX];
+	int res = branch_readlink(branch, path, target, sizeof(target) - 1);
+	if (res == -1) return;
+	target[res] = '\0';
+
+	symlink_cache_set(path, branch, target, gen);
+}
+
+static void prewarm_dir(const char *path, int branch);
+
+struct prewarm_state {
+	const char *path;
+	int branch;
+};
+
+static int prewarm_entry(void *priv, const char *name, ino_t ino, unsigned char type) {
+	(void)ino;
+
+	struct prewarm_state *state = priv;
+
+	// branches are about to change, we must not keep them waiting
+	if (reconf_pending()) return 1;
+
+	if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) return 0;
+	if (strcmp(state->path, "/") == 0 && strcmp(name, METANAME) == 0) return 0;
+
+	char member[PATHLEN_MAX];
+	if (BUILD_PATH(member, state->path, "/", name)) return 0;
+
+	if (type == DT_UNKNOWN) {
+		struct stat st;
+		if (branch_lstat(state->branch, member, &st)) return 0;
+		type = IFTODT(st.st_mode);
+	}
+
+	switch (type) {
+		case DT_DIR:
+			prewarm_dir(member, state->branch);
+			break;
+		case DT_LNK:
+			prewarm_symlink(member, state->branch);
+			break;
+	}
+
+	return 0;
+}
+
+/**
+ * Recursively walk the directory path of branch
+ */
+static void prewarm_dir(const char *path, int branch) {
+	DBG("%s\n", path);
+
+	struct prewarm_state state = {
+		.path = path,
+		.branch = branch,
+	};
+
+	branch_readdir(branch, path, prewarm_entry, &state);
+}
+
+static void *prewarm_thread(void *arg) {
+	(void)arg;
+
+	reconf_enter();
+
+	int i;
+	for (i = 0; i < uopt.nbranches && !reconf_pending(); i++) {
+		if (!uopt.branches[i].immutable) continue;
+
+		DBG("pre-warming branch %s\n", uopt.branches[i].path);
+		prewarm_dir("/", i);
+	}
+
+	reconf_leave();
+
+	DBG("pre-warming done\n");
+	return NULL;
+}
+
+/**
+ * Start the pre-warm scan in the background. Must be called after we went
+ * into the chroot, if any.
+ */
+void prewarm_start(void) {
+	pthread_t thread;
+
+	int res = pthread_create(&thread, NULL, prewarm_thread, NULL);
+	if (res) {
+		USYSLOG(LOG_WARNING, "Failed to start the pre-warm thread: %s\n", strerror(res));
+		return;
+	}
+
+	pthread_detach(thread);
+}
@@ -0,0 +1,12 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#ifndef PREWARM_H
+#define PREWARM_H
+
+void prewarm_start(void);
+
+#endif
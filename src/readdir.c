@@ -22,6 +22,7 @@
 #include <errno.h>
 #include <sys/statvfs.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "unionfs.h"
 #include "opts.h"
@@ -29,41 +30,16 @@
 #include "hashtable.h"
 #include "general.h"
 #include "string.h"
+#include "branch.h"
+#include "hide.h"
+#include "dircache.h"
 
 
-/**
-  * Hide metadata. As is causes a slight slowndown this is optional
-  * 
-  */
-static bool hide_meta_files(int branch, const char *path, struct dirent *de)
-{
-
-	if (uopt.hide_meta_files == false) RETURN(false);
-
-	fprintf(stderr, "uopt.branches[branch].path = %s path = %s\n", uopt.branches[branch].path, path);
-	fprintf(stderr, "METANAME = %s, de->d_name = %s\n", METANAME, de->d_name);
-
-	// TODO Would it be faster to add hash comparison?
-
-	// HIDE out .unionfs directory
-	if (strcmp(uopt.branches[branch].path, path) == 0
-	&&  strcmp(METANAME, de->d_name) == 0) {
-		RETURN(true);
-	}
-
-	// HIDE fuse META files
-	if  (strncmp(FUSE_META_FILE, de->d_name, FUSE_META_LENGTH) == 0) 
-		RETURN(true);
-
-	RETURN(false);
-}
-
 /**
  * Check if fname has a hiding tag and return its status.
- * Also, add this file and to the hiding hash table.
- * Warning: If fname has the tag, fname gets modified.
+ * Also, add this file without the tag to the hiding hash table.
  */
-static bool is_hiding(struct hashtable *hides, char *fname) {
+static bool is_hiding(struct hashtable *hides, const char *fname) {
 	DBG("%s\n", fname);
 
 	char *tag;
@@ -71,12 +47,15 @@ static bool is_hiding(struct hashtable *hides, char *fname) {
 	tag = whiteout_tag(fname);
 	if (tag) {
 		// even more important, ignore the file without the tag!
-		// hint: tag is a pointer to the flag-suffix within de->d_name
-		*tag = '\0'; // this modifies fname!
+		// hint: tag is a pointer to the flag-suffix within fname
+		char *name = strndup(fname, tag - fname);
+		if (!name) RETURN(true);
 
 		// add to hides (only if not there already)
-		if (!hashtable_search(hides, fname)) {
-			hashtable_insert(hides, strdup(fname), malloc(1));
+		if (!hashtable_search(hides, name)) {
+			hashtable_insert(hides, name, malloc(1));
+		} else {
+			free(name);
 		}
 
 		RETURN(true);
@@ -85,6 +64,14 @@ static bool is_hiding(struct hashtable *hides, char *fname) {
 	RETURN(false);
 }
 
+static int add_whiteout(void *priv, const char *name, ino_t ino, unsigned char type) {
+	(void)ino;
+	(void)type;
+
+	is_hiding(priv, name);
+	return 0;
+}
+
 /**
  * Read whiteout files
  */
@@ -92,17 +79,76 @@ static void read_whiteouts(const char *path, struct hashtable *whiteouts, int br
 	DBG("%s\n", path);
 
 	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[branch].path, METADIR, path)) return;
+	if (BUILD_PATH(p, METADIR, path)) return;
+
+	branch_readdir(branch, p, add_whiteout, whiteouts);
+}
+
+struct readdir_state {
+	int branch;
+	const char *path;
+	struct hashtable *files;	// names already added, dircache_entry_t as value
+	struct hashtable *whiteouts;
+	void *buf;			// of filler
+	fuse_fill_dir_t filler;
+	bool full;			// filler does not take any more entries
+	bool found;			// dir_not_empty() found an entry
+	bool incomplete;		// files misses some names, e.g. out of memory
+};
+
+/**
+ * Pass name on to the filler of readdir(), unless it is to be hidden
+ */
+static int add_entry(struct readdir_state *state, const char *name, ino_t ino, unsigned char type) {
+	if (hide_name(state->path, name)) return 0;
 
-	DIR *dp = opendir(p);
-	if (dp == NULL) return;
+	struct stat st;
+	memset(&st, 0, sizeof(st));
+	st.st_ino = ino;
+	st.st_mode = type << 12;
 
-	struct dirent *de;
-	while ((de = readdir(dp)) != NULL) {
-		is_hiding(whiteouts, de->d_name);
+	if (state->filler(state->buf, name, &st, 0)) {
+		state->full = true;
+		return 1;
 	}
 
-	closedir(dp);
+	return 0;
+}
+
+static int fill_entry(void *priv, const char *name, ino_t ino, unsigned char type) {
+	struct readdir_state *state = priv;
+
+	// already added in some other branch
+	if (hashtable_search(state->files, (void *)name) != NULL) return 0;
+
+	// check if we need file hiding
+	if (uopt.cow_enabled) {
+		// file should be hidden from the user
+		if (hashtable_search(state->whiteouts, (void *)name) != NULL) return 0;
+	}
+
+	// hidden names still exist for lookups, so they are part of the listing
+	char *key = strdup(name);
+	dircache_entry_t *entry = malloc(sizeof(dircache_entry_t));
+	if (entry) {
+		entry->branch = state->branch;
+		entry->type = type;
+		entry->ino = ino;
+	}
+	if (!key || !entry || !hashtable_insert(state->files, key, entry)) {
+		free(key);
+		free(entry);
+		state->incomplete = true;
+	}
+
+	return add_entry(state, name, ino, type);
+}
+
+/**
+ * dircache_filler_t for unionfs_readdir(), the listing is complete already
+ */
+static int fill_cached(void *priv, const char *name, const dircache_entry_t *entry) {
+	return add_entry(priv, name, entry->ino, entry->type);
 }
 
 /**
@@ -115,24 +161,27 @@ int unionfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t o
 	(void)fi;
 	int i = 0;
 	int rc = 0;
-	
-	// we will store already added files here to handle same file names across different branches
-	struct hashtable *files = create_hashtable(16, string_hash, string_equal);
 
-	struct hashtable *whiteouts = NULL;
+	struct readdir_state state;
+	memset(&state, 0, sizeof(state));
+	state.path = path;
+	state.buf = buf;
+	state.filler = filler;
 
-	if (uopt.cow_enabled) whiteouts = create_hashtable(16, string_hash, string_equal);
+	// e.g. "ls" of the same directory again
+	if (dircache_list(path, fill_cached, &state)) RETURN(0);
+
+	unsigned int gen = dircache_generation();
+
+	// we will store already added files here to handle same file names across different branches
+	state.files = create_hashtable(16, string_hash, string_equal);
+
+	if (uopt.cow_enabled) state.whiteouts = create_hashtable(16, string_hash, string_equal);
 
 	bool subdir_hidden = false;
 
 	for (i = 0; i < uopt.nbranches; i++) {
-		if (subdir_hidden) break;
-
-		char p[PATHLEN_MAX];
-		if (BUILD_PATH(p, uopt.branches[i].path, path)) {
-			rc = -ENAMETOOLONG;
-			goto out;
-		}
+		if (subdir_hidden || state.full) break;
 
 		// check if branches below this branch are hidden
 		int res = path_hidden(path, i);
@@ -143,54 +192,53 @@ int unionfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t o
 
 		if (res > 0) subdir_hidden = true;
 
-		DIR *dp = opendir(p);
-		if (dp == NULL) {
-			if (uopt.cow_enabled) read_whiteouts(path, whiteouts, i);
-			continue;
+		state.branch = i;
+		if (branch_readdir(i, path, fill_entry, &state) == -1 && errno != ENOENT && errno != ENOTDIR) {
+			// lookups might still find something there
+			state.incomplete = true;
 		}
 
-		struct dirent *de;
-		while ((de = readdir(dp)) != NULL) {
-			// already added in some other branch
-			if (hashtable_search(files, de->d_name) != NULL) continue;
+		if (uopt.cow_enabled) read_whiteouts(path, state.whiteouts, i);
+	}
 
-			// check if we need file hiding
-			if (uopt.cow_enabled) {
-				// file should be hidden from the user
-				if (hashtable_search(whiteouts, de->d_name) != NULL) continue;
-			}
+out:
+	if (rc == 0 && !state.full && !state.incomplete) {
+		dircache_set(path, state.files, gen);
+	} else {
+		hashtable_destroy(state.files, 1);
+	}
 
-			if (hide_meta_files(i, p, de) == true) continue;
+	if (uopt.cow_enabled) hashtable_destroy(state.whiteouts, 1);
 
-			// fill with something dummy, we're interested in key existence only
-			hashtable_insert(files, strdup(de->d_name), malloc(1));
+	RETURN(rc);
+}
 
-			struct stat st;
-			memset(&st, 0, sizeof(st));
-			st.st_ino = de->d_ino;
-			st.st_mode = de->d_type << 12;
+static int find_entry(void *priv, const char *name, ino_t ino, unsigned char type) {
+	(void)ino;
+	(void)type;
 
-			if (filler(buf, de->d_name, &st, 0)) break;
-		}
+	struct readdir_state *state = priv;
 
-		closedir(dp);
-		if (uopt.cow_enabled) read_whiteouts(path, whiteouts, i);
-	}
+	// Ignore . and ..
+	if ((strcmp(name, ".") == 0) ||  (strcmp(name, "..") == 0)) 
+		return 0;
 
-out:
-	hashtable_destroy(files, 1);
+	// check if we need file hiding
+	if (uopt.cow_enabled) {
+		// file should be hidden from the user
+		if (hashtable_search(state->whiteouts, (void *)name) != NULL) return 0;
+	}
 
-	if (uopt.cow_enabled) hashtable_destroy(whiteouts, 1);
+	if (hide_name(state->path, name)) return 0;
 
-	RETURN(rc);
+	// When we arrive here, a valid entry was found
+	state->found = true;
+	return 1;
 }
 
 /**
  * check if a directory on all paths is empty
  * return 0 if empty, 1 if not and negative value on error
- *
- * TODO: This shares lots of code with unionfs_readdir(), can we merge 
- *       both functions?
  */
 int dir_not_empty(const char *path) {
 
@@ -198,22 +246,17 @@ int dir_not_empty(const char *path) {
 
 	int i = 0;
 	int rc = 0;
-	int not_empty = 0;
-	
-	struct hashtable *whiteouts = NULL;
 
-	if (uopt.cow_enabled) whiteouts = create_hashtable(16, string_hash, string_equal);
+	struct readdir_state state;
+	memset(&state, 0, sizeof(state));
+	state.path = path;
+
+	if (uopt.cow_enabled) state.whiteouts = create_hashtable(16, string_hash, string_equal);
 
 	bool subdir_hidden = false;
 
 	for (i = 0; i < uopt.nbranches; i++) {
-		if (subdir_hidden) break;
-
-		char p[PATHLEN_MAX];
-		if (BUILD_PATH(p, uopt.branches[i].path, path)) {
-			rc = -ENAMETOOLONG;
-			goto out;
-		}
+		if (subdir_hidden || state.found) break;
 
 		// check if branches below this branch are hidden
 		int res = path_hidden(path, i);
@@ -224,43 +267,16 @@ int dir_not_empty(const char *path) {
 
 		if (res > 0) subdir_hidden = true;
 
-		DIR *dp = opendir(p);
-		if (dp == NULL) {
-			if (uopt.cow_enabled) read_whiteouts(path, whiteouts, i);
-			continue;
-		}
+		state.branch = i;
+		branch_readdir(i, path, find_entry, &state);
 
-		struct dirent *de;
-		while ((de = readdir(dp)) != NULL) {
-			
-			// Ignore . and ..
-			if ((strcmp(de->d_name, ".") == 0) ||  (strcmp(de->d_name, "..") == 0)) 
-				continue;
-
-			// check if we need file hiding
-			if (uopt.cow_enabled) {
-				// file should be hidden from the user
-				if (hashtable_search(whiteouts, de->d_name) != NULL) continue;
-			}
-
-			if (hide_meta_files(i, p, de) == true) continue;
-
-			// When we arrive here, a valid entry was found
-			not_empty = 1;
-			closedir(dp);
-			goto out;
-		}
-
-		closedir(dp);
-		if (uopt.cow_enabled) read_whiteouts(path, whiteouts, i);
+		if (uopt.cow_enabled) read_whiteouts(path, state.whiteouts, i);
 	}
 
 out:
-	if (uopt.cow_enabled) hashtable_destroy(whiteouts, 1);
+	if (uopt.cow_enabled) hashtable_destroy(state.whiteouts, 1);
 
 	if (rc) RETURN(rc);
 	
-	RETURN(not_empty);
+	RETURN(state.found);
 }
-
-
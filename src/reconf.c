@@ -0,0 +1,460 @@
+/*
+*  C Implementation: reconf
+*
+* Description: Add, remove and reorder branches of a running mount
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+*
+* Details:
+*	Operations find a branch by its index in uopt.branches and keep using
+*	that index until they are done, so the table must not change while an
+*	operation runs. Taking a lock for every operation would be way too
+*	expensive for something that happens once in a blue moon, so instead
+*	every thread has its own reader mark, which reconf_enter() and
+*	reconf_leave() set and clear without any shared write.
+*	A reconfiguration announces itself, waits until all marks are clear
+*	(the grace period) and only then changes the table. Readers seeing
+*	the announcement step back and wait for the reconfiguration to finish.
+*	Open files do not depend on the index of their branch (see
+*	branch_file_t), so they survive a reconfiguration. The data of removed
+*	image and memory branches are kept until unmount for the same reason.
+*	Only the cache entries a changed branch might serve are dropped, see
+*	cache_forget_branch(). The kernel keeps the page cache of files of
+*	immutable branches across opens (keep_cache), which is only right as
+*	long as the path still is the same file. So the first open of every
+*	path after a reconfiguration drops it, see reconf_first_open().
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "unionfs.h"
+#include "opts.h"
+#include "debug.h"
+#include "usyslog.h"
+#include "branch.h"
+#include "image.h"
+#include "cache.h"
+#include "statfs.h"
+#include "uioctl.h"
+#include "hashtable.h"
+#include "string.h"
+#include "reconf.h"
+
+#define OPENED_MAX 65536 // forget the opened paths if there are more
+
+typedef struct reader {
+	unsigned int depth;		// nesting of reconf_enter(), only the owner writes it
+	struct reader *next;
+} reader_t;
+
+static pthread_mutex_t reconf_lock = PTHREAD_MUTEX_INITIALIZER; // held by a reconfiguration
+static pthread_once_t reader_once = PTHREAD_ONCE_INIT;
+static pthread_key_t reader_key;
+static reader_t *readers;		// all threads which ever entered, locked by reconf_lock
+static unsigned int anonymous;		// readers without a mark, e.g. out of memory
+static bool pending;			// a reconfiguration waits for the grace period
+static unsigned int generation;		// number of reconfigurations
+
+static struct hashtable *opened;	// paths opened since opened_generation
+static unsigned int opened_generation;
+static pthread_mutex_t opened_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void reader_exit(void *data) {
+	reader_t *r = data;
+
+	pthread_mutex_lock(&reconf_lock);
+
+	reader_t **walk = &readers;
+	while (*walk != r) walk = &(*walk)->next;
+	*walk = r->next;
+
+	pthread_mutex_unlock(&reconf_lock);
+
+	free(r);
+}
+
+static void reader_key_init(void) {
+	pthread_key_create(&reader_key, reader_exit);
+}
+
+static reader_t *reader_self(void) {
+	pthread_once(&reader_once, reader_key_init);
+
+	reader_t *r = pthread_getspecific(reader_key);
+	if (r) return r;
+
+	r = calloc(1, sizeof(reader_t));
+	if (!r) return NULL;
+
+	if (pthread_setspecific(reader_key, r)) {
+		free(r);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&reconf_lock);
+	r->next = readers;
+	readers = r;
+	pthread_mutex_unlock(&reconf_lock);
+
+	return r;
+}
+
+/**
+ * The calling thread is going to use branch indices, the branch table
+ * will not change until reconf_leave(). Calls may be nested.
+ */
+void reconf_enter(void) {
+	reader_t *r = reader_self();
+
+	if (!r) {
+		// still correct, just slower for the reconfiguration
+		__atomic_add_fetch(&anonymous, 1, __ATOMIC_SEQ_CST);
+		while (__atomic_load_n(&pending, __ATOMIC_SEQ_CST)) {
+			__atomic_sub_fetch(&anonymous, 1, __ATOMIC_SEQ_CST);
+			pthread_mutex_lock(&reconf_lock);
+			pthread_mutex_unlock(&reconf_lock);
+			__atomic_add_fetch(&anonymous, 1, __ATOMIC_SEQ_CST);
+		}
+		return;
+	}
+
+	// nested, a reconfiguration is already waiting for us
+	if (r->depth > 0) {
+		r->depth++;
+		return;
+	}
+
+	while (1) {
+		// the mark must be visible before we check, seq_cst pairs with
+		// reconf_begin()
+		__atomic_store_n(&r->depth, 1, __ATOMIC_SEQ_CST);
+		if (!__atomic_load_n(&pending, __ATOMIC_SEQ_CST)) return;
+
+		// step back until the reconfiguration is done
+		__atomic_store_n(&r->depth, 0, __ATOMIC_RELEASE);
+		pthread_mutex_lock(&reconf_lock);
+		pthread_mutex_unlock(&reconf_lock);
+	}
+}
+
+void reconf_leave(void) {
+	reader_t *r = pthread_getspecific(reader_key);
+
+	if (!r) {
+		__atomic_sub_fetch(&anonymous, 1, __ATOMIC_RELEASE);
+		return;
+	}
+
+	// all our accesses to the table are done before the mark is cleared
+	__atomic_store_n(&r->depth, r->depth - 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * A reconfiguration is waiting, long running readers (e.g. the pre-warm
+ * scan) should leave as soon as possible
+ */
+bool reconf_pending(void) {
+	return __atomic_load_n(&pending, __ATOMIC_RELAXED);
+}
+
+/**
+ * Take reconf_lock and wait until no reader is left
+ */
+static void reconf_begin(void) {
+	pthread_mutex_lock(&reconf_lock);
+
+	__atomic_store_n(&pending, true, __ATOMIC_SEQ_CST);
+
+	reader_t *r;
+	for (r = readers; r; r = r->next) {
+		while (__atomic_load_n(&r->depth, __ATOMIC_SEQ_CST)) usleep(1000);
+	}
+	while (__atomic_load_n(&anonymous, __ATOMIC_SEQ_CST)) usleep(1000);
+}
+
+static void reconf_end(void) {
+	// statfs() needs to know about the new devices
+	statfs_init();
+	statfs_invalidate();
+
+	__atomic_add_fetch(&generation, 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&pending, false, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&reconf_lock);
+}
+
+/**
+ * Check if this is the first open of path since the branches changed, as
+ * the kernel might then still cache the file path was before. Without any
+ * reconfiguration, there is no first open. Called within reconf_enter().
+ */
+bool reconf_first_open(const char *path) {
+	unsigned int gen = __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+	if (gen == 0) return false;
+
+	bool first = true;
+
+	pthread_mutex_lock(&opened_lock);
+
+	if (opened && (opened_generation != gen || hashtable_count(opened) >= OPENED_MAX)) {
+		hashtable_destroy(opened, 0);
+		opened = NULL;
+	}
+	if (!opened) {
+		opened = create_hashtable(256, string_hash, string_equal);
+		opened_generation = gen;
+	}
+
+	if (opened && hashtable_search(opened, (void *)path)) {
+		first = false;
+	} else if (opened) {
+		char *key = strdup(path);
+		if (key && !hashtable_insert(opened, key, key)) free(key);
+	}
+
+	pthread_mutex_unlock(&opened_lock);
+
+	return first;
+}
+
+/**
+ * Compute the new indices of the branches for cache_renumber(), map[old
+ * index] is the new index of the branch or -1 if it gets removed
+ */
+static void renumber(int *map, int removed, int inserted) {
+	int i, j;
+	for (i = 0, j = 0; i < uopt.nbranches; i++, j++) {
+		if (j == inserted) j++;
+		if (i == removed) {
+			map[i] = -1;
+			j--;
+			continue;
+		}
+		map[i] = j;
+	}
+}
+
+/**
+ * Release what we do not need anymore of a removed branch. Files of it
+ * might still be open, see the top of this file.
+ */
+static void branch_retire(branch_entry_t *branch) {
+	if (branch->ops == &dir_ops || branch->ops == &index_ops) close(branch->fd);
+	free(branch->path);
+}
+
+static int parse_mode(branch_entry_t *branch, int mode) {
+	switch (mode) {
+		case UNIONFS_BRANCH_RO:
+			break;
+		case UNIONFS_BRANCH_RW:
+			branch->rw = 1;
+			break;
+		case UNIONFS_BRANCH_MEM:
+			branch->rw = 1;
+			branch->memory = 1;
+			break;
+		case UNIONFS_BRANCH_IMMUTABLE:
+			branch->immutable = 1;
+			break;
+		default:
+			return -EINVAL;
+	}
+	return 0;
+}
+
+/**
+ * Add the branch path at position index, a negative or too large index
+ * adds it as the lowest branch
+ */
+int reconf_add_branch(int index, const char *path, int mode) {
+	DBG("%s at %d, mode %d\n", path, index, mode);
+
+	if (path[0] != '/') return -EINVAL;
+
+	branch_entry_t branch;
+	memset(&branch, 0, sizeof(branch));
+
+	int res = parse_mode(&branch, mode);
+	if (res) return res;
+
+	// everything which might take long is done before readers have to wait
+	branch.fd = open(path, O_RDONLY);
+	if (branch.fd == -1) return -errno;
+
+	struct stat st;
+	if (fstat(branch.fd, &st) == -1) {
+		res = -errno;
+		close(branch.fd);
+		return res;
+	}
+
+	size_t len = strlen(path);
+	branch.path = malloc(len + 2);
+	if (!branch.path) {
+		close(branch.fd);
+		return -ENOMEM;
+	}
+	strcpy(branch.path, path);
+
+	// image files must not get a trailing slash
+	if (S_ISDIR(st.st_mode) && path[len - 1] != '/') strcat(branch.path, "/");
+	branch.path_len = strlen(branch.path);
+
+	if (branch_init(&branch, path)) {
+		res = -errno;
+		close(branch.fd);
+		free(branch.path);
+		return res;
+	}
+
+	reconf_begin();
+
+	int n = uopt.nbranches;
+	branch_entry_t *branches = realloc(uopt.branches, (n + 1) * sizeof(branch_entry_t));
+	if (!branches) {
+		reconf_end();
+		branch_retire(&branch);
+		return -ENOMEM;
+	}
+	uopt.branches = branches;
+
+	if (index < 0 || index > n) index = n;
+
+	int map[n];
+	renumber(map, -1, index);
+
+	memmove(&uopt.branches[index + 1], &uopt.branches[index], (n - index) * sizeof(branch_entry_t));
+	uopt.branches[index] = branch;
+	uopt.nbranches++;
+
+	cache_renumber(map, n);
+	cache_forget_branch(index);
+
+	USYSLOG(LOG_INFO, "added branch %s at %d\n", branch.path, index);
+
+	reconf_end();
+	return 0;
+}
+
+int reconf_remove_branch(int index) {
+	DBG("%d\n", index);
+
+	reconf_begin();
+
+	int n = uopt.nbranches;
+	if (index < 0 || index >= n) {
+		reconf_end();
+		return -EINVAL;
+	}
+
+	// the union must not end up without any branch
+	if (n == 1) {
+		reconf_end();
+		return -EBUSY;
+	}
+
+	cache_forget_branch(index);
+
+	int map[n];
+	renumber(map, index, -1);
+
+	branch_entry_t branch = uopt.branches[index];
+	memmove(&uopt.branches[index], &uopt.branches[index + 1], (n - index - 1) * sizeof(branch_entry_t));
+	uopt.nbranches--;
+
+	cache_renumber(map, n);
+
+	reconf_end();
+
+	USYSLOG(LOG_INFO, "removed branch %s\n", branch.path);
+	branch_retire(&branch);
+	return 0;
+}
+
+/**
+ * Move the branch at index to position to
+ */
+int reconf_move_branch(int index, int to) {
+	DBG("%d to %d\n", index, to);
+
+	reconf_begin();
+
+	int n = uopt.nbranches;
+	if (index < 0 || index >= n || to < 0 || to >= n) {
+		reconf_end();
+		return -EINVAL;
+	}
+
+	cache_forget_branch(index);
+
+	int map[n];
+	renumber(map, index, -1);
+
+	// to is an index of the table without the moved branch
+	int i;
+	for (i = 0; i < n; i++) {
+		if (map[i] >= to) map[i]++;
+	}
+	map[index] = to;
+
+	branch_entry_t branch = uopt.branches[index];
+	if (to < index) {
+		memmove(&uopt.branches[to + 1], &uopt.branches[to], (index - to) * sizeof(branch_entry_t));
+	} else {
+		memmove(&uopt.branches[index], &uopt.branches[index + 1], (to - index) * sizeof(branch_entry_t));
+	}
+	uopt.branches[to] = branch;
+
+	cache_renumber(map, n);
+	cache_forget_branch(to);
+
+	USYSLOG(LOG_INFO, "moved branch %s from %d to %d\n", branch.path, index, to);
+
+	reconf_end();
+	return 0;
+}
+
+/**
+ * Switch the branch at index between RO, RW and immutable. The contents do
+ * not change, so all caches stay valid.
+ */
+int reconf_set_mode(int index, int mode) {
+	DBG("%d, mode %d\n", index, mode);
+
+	branch_entry_t flags;
+	memset(&flags, 0, sizeof(flags));
+
+	int res = parse_mode(&flags, mode);
+	if (res) return res;
+	if (flags.memory) return -EINVAL;
+
+	reconf_begin();
+
+	if (index < 0 || index >= uopt.nbranches) {
+		res = -EINVAL;
+	} else if (uopt.branches[index].memory) {
+		res = -EINVAL; // a memory branch does not exist without us
+	} else if (flags.rw && uopt.branches[index].ops != &dir_ops) {
+		res = -EROFS;
+	} else if (!flags.immutable && uopt.branches[index].ops != &dir_ops) {
+		res = -EINVAL; // images and indexed branches are always immutable
+	} else {
+		uopt.branches[index].rw = flags.rw;
+		uopt.branches[index].immutable = flags.immutable;
+		USYSLOG(LOG_INFO, "branch %s is now mode %d\n", uopt.branches[index].path, mode);
+	}
+
+	reconf_end();
+	return res;
+}
@@ -0,0 +1,22 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#ifndef RECONF_H
+#define RECONF_H
+
+#include <stdbool.h>
+
+void reconf_enter(void);
+void reconf_leave(void);
+bool reconf_pending(void);
+bool reconf_first_open(const char *path);
+
+int reconf_add_branch(int index, const char *path, int mode);
+int reconf_remove_branch(int index);
+int reconf_move_branch(int index, int to);
+int reconf_set_mode(int index, int mode);
+
+#endif
@@ -33,6 +33,8 @@
 #include "string.h"
 #include "readdir.h"
 #include "usyslog.h"
+#include "cache.h"
+#include "branch.h"
 
 /**
   * If the branch that has the directory to be removed is in read-write mode,
@@ -41,10 +43,7 @@
 static int rmdir_rw(const char *path, int branch_rw) {
 	DBG("%s\n", path);
 
-	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[branch_rw].path, path)) return ENAMETOOLONG;
-
-	int res = rmdir(p);
+	int res = branch_rmdir(branch_rw, path);
 	if (res == -1) return errno;
 
 	return 0;
@@ -93,6 +92,8 @@ int unionfs_rmdir(const char *path) {
 	int i = find_rorw_branch(path);
 	if (i == -1) return -errno;
 
+	cache_invalidate(path);
+
 	int res;
 	if (!uopt.branches[i].rw) {
 		// read-only branch
@@ -109,5 +110,8 @@ int unionfs_rmdir(const char *path) {
 		}
 	}
 
+	// lookups since the invalidation above might have cached path again
+	cache_invalidate(path);
+
 	return -res;
 }
@@ -0,0 +1,828 @@
+/*
+*  C Implementation: squash
+*
+* Description: Offline tool to flatten a stack of branches into one new
+*              directory. The result is exactly what a unionfs mount of
+*              the same branches would show, so it may be used later on
+*              as a single read-only branch, e.g. below a fresh rw-branch.
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+*
+* Details:
+*	We do not implement our own branch logic here, but use the very same
+*	functions the filesystem uses: unionfs_readdir() to get the merged
+*	directory listing (including whiteouts and hidden meta files) and
+*	find_rorw_branch() to find the branch serving a path.
+*	Directories are walked by the main thread, all other files are copied
+*	by a pool of worker threads. File data are shared by the filesystem
+*	(reflink) if possible, with -l hard links to the source branch are
+*	used instead of copies. Hard links within the union are preserved.
+*	Since the directory time stamps get modified while we fill them, their
+*	stat() data are set once all files are copied.
+*	With -i the union is written into a single image file instead (see
+*	image.h), which may be used as read-only branch by itself. Images are
+*	written by the main thread only, directories are walked breadth-first,
+*	so that the entries of every directory end up contiguous.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "unionfs.h"
+#include "opts.h"
+#include "debug.h"
+#include "findbranch.h"
+#include "readdir.h"
+#include "cow_utils.h"
+#include "hashtable.h"
+#include "string.h"
+#include "usyslog.h"
+#include "branch.h"
+#include "image.h"
+
+#define MAX_QUEUED_JOBS 1024 // the directory walker waits if there are more
+
+typedef struct job {
+	char *from;		// source path on the branch serving the file
+	char *path;		// path within the union
+	int branch;		// the branch serving the file
+	char *to;		// destination path
+	struct stat st;		// lstat() data of from
+	struct job *next;
+} job_t;
+
+// a directory or hard link, which needs to be handled after all files are copied
+typedef struct fixup {
+	char *from;		// directory: path within the union, link: first copy of the file
+	char *to;
+	struct stat st;
+	struct fixup *next;
+} fixup_t;
+
+static struct {
+	const char *target;	// the directory or image we squash into
+	int branch;		// target directory, written like a rw-branch
+	bool hardlink;		// hardlink files from the branches instead of copying them
+	bool image;		// write an image instead of a directory
+	mode_t umask;
+	uid_t uid;
+
+	pthread_mutex_t lock;	// protects the job queue and the counters below
+	pthread_cond_t cond_jobs;  // jobs were queued or we are done
+	pthread_cond_t cond_space; // the queue has space again
+	job_t *head, *tail;
+	int queued;
+	bool done;		// no more jobs will be queued
+	int errors;
+
+	struct hashtable *inodes; // "dev:ino" of files with several links -> first copy
+	fixup_t *dirs;		// directories, deepest first
+	fixup_t *links;
+} sq;
+
+static void print_help(const char *progname) {
+	fprintf(stderr, "Usage:\n");
+	fprintf(stderr, "     %s [-j jobs] [-l] branch[=RO/RW][:branch...] target-dir\n", progname);
+	fprintf(stderr, "     %s -i branch[=RO/RW][:branch...] image-file\n", progname);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "     Copy the union view of the given branches into target-dir or\n");
+	fprintf(stderr, "     image-file, which then may be used as a single read-only branch.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "       -i           write an image file instead of a directory\n");
+	fprintf(stderr, "       -j <number>  number of copy threads (default: number of cpus)\n");
+	fprintf(stderr, "       -l           hardlink files from the branches instead of copying\n");
+	fprintf(stderr, "                    them, if they are on the same filesystem as target-dir\n");
+	fprintf(stderr, "\n");
+}
+
+static void count_error(void) {
+	pthread_mutex_lock(&sq.lock);
+	sq.errors++;
+	pthread_mutex_unlock(&sq.lock);
+}
+
+/**
+ * Copy a single non-directory file, which is what cow_cp() does for us
+ * in the filesystem.
+ */
+static int squash_file(job_t *job) {
+	DBG("from %s to %s\n", job->from, job->to);
+
+	if (sq.hardlink && S_ISREG(job->st.st_mode)) {
+		if (link(job->from, job->to) == 0) RETURN(0);
+		DBG("link(%s) failed: %s, copying\n", job->from, strerror(errno));
+	}
+
+	struct cow cow;
+	cow.uid = sq.uid;
+	cow.umask = sq.umask;
+	cow.stat = &job->st;
+	cow.branch = job->branch;
+	cow.path = job->path;
+	cow.to_branch = sq.branch;
+	cow.to_path = job->path;
+
+	int res;
+	switch (job->st.st_mode & S_IFMT) {
+		case S_IFLNK:
+			res = copy_link(&cow);
+			break;
+		case S_IFBLK:
+		case S_IFCHR:
+			res = copy_special(&cow);
+			break;
+		case S_IFIFO:
+			res = copy_fifo(&cow);
+			break;
+		case S_IFSOCK:
+			fprintf(stderr, "Skipping socket %s\n", job->from);
+			res = 0;
+			break;
+		default:
+			res = copy_file(&cow);
+	}
+
+	if (res) fprintf(stderr, "Copying %s to %s failed\n", job->from, job->to);
+
+	RETURN(res);
+}
+
+static void *squash_worker(void *arg) {
+	(void)arg;
+
+	while (1) {
+		pthread_mutex_lock(&sq.lock);
+		while (!sq.head && !sq.done) pthread_cond_wait(&sq.cond_jobs, &sq.lock);
+
+		job_t *job = sq.head;
+		if (!job) {
+			// queue is empty and the walker is done
+			pthread_mutex_unlock(&sq.lock);
+			return NULL;
+		}
+
+		sq.head = job->next;
+		if (!sq.head) sq.tail = NULL;
+		sq.queued--;
+		pthread_cond_signal(&sq.cond_space);
+		pthread_mutex_unlock(&sq.lock);
+
+		if (squash_file(job)) count_error();
+
+		free(job->from);
+		free(job->path);
+		free(job->to);
+		free(job);
+	}
+}
+
+static void queue_job(const char *from, int branch, const char *path, const char *to, const struct stat *st) {
+	job_t *job = malloc(sizeof(job_t));
+	if (job) {
+		job->from = strdup(from);
+		job->path = strdup(path);
+		job->to = strdup(to);
+	}
+	if (!job || !job->from || !job->path || !job->to) {
+		fprintf(stderr, "%s: malloc failed\n", __func__);
+		exit(1);
+	}
+	job->branch = branch;
+	job->st = *st;
+	job->next = NULL;
+
+	pthread_mutex_lock(&sq.lock);
+	while (sq.queued >= MAX_QUEUED_JOBS) pthread_cond_wait(&sq.cond_space, &sq.lock);
+
+	if (sq.tail) sq.tail->next = job;
+	else sq.head = job;
+	sq.tail = job;
+	sq.queued++;
+
+	pthread_cond_signal(&sq.cond_jobs);
+	pthread_mutex_unlock(&sq.lock);
+}
+
+static void add_fixup(fixup_t **list, const char *from, const char *to, const struct stat *st) {
+	fixup_t *fix = malloc(sizeof(fixup_t));
+	if (fix) {
+		fix->from = strdup(from);
+		fix->to = strdup(to);
+	}
+	if (!fix || !fix->from || !fix->to) {
+		fprintf(stderr, "%s: malloc failed\n", __func__);
+		exit(1);
+	}
+	fix->st = *st;
+	fix->next = *list;
+	*list = fix;
+}
+
+/**
+ * Files with several hard links within the union are only copied once,
+ * further names are linked to the first copy.
+ * Return true if to is going to be a link to an already queued file.
+ */
+static bool is_hardlink(const char *to, const struct stat *st) {
+	if (S_ISDIR(st->st_mode) || st->st_nlink < 2) return false;
+
+	char key[64];
+	snprintf(key, sizeof(key), "%llu:%llu",
+		(unsigned long long)st->st_dev, (unsigned long long)st->st_ino);
+
+	char *first = hashtable_search(sq.inodes, key);
+	if (first) {
+		add_fixup(&sq.links, first, to, st);
+		return true;
+	}
+
+	char *k = strdup(key);
+	char *v = strdup(to);
+	if (!k || !v) {
+		fprintf(stderr, "%s: malloc failed\n", __func__);
+		exit(1);
+	}
+	hashtable_insert(sq.inodes, k, v);
+
+	return false;
+}
+
+typedef struct {
+	char **names;
+	int count;
+	int max;
+} namelist_t;
+
+/**
+ * fuse_fill_dir_t for unionfs_readdir(), just remember the names
+ */
+static int collect_name(void *buf, const char *name, const struct stat *st, off_t off) {
+	(void)st;
+	(void)off;
+
+	namelist_t *list = buf;
+
+	if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) return 0;
+
+	if (list->count == list->max) {
+		list->max = list->max ? list->max * 2 : 64;
+		list->names = realloc(list->names, list->max * sizeof(char *));
+		if (!list->names) {
+			fprintf(stderr, "%s: realloc failed\n", __func__);
+			exit(1);
+		}
+	}
+
+	list->names[list->count] = strdup(name);
+	if (!list->names[list->count]) {
+		fprintf(stderr, "%s: strdup failed\n", __func__);
+		exit(1);
+	}
+	list->count++;
+
+	return 0;
+}
+
+/**
+ * Recursively squash the union directory path into the target directory.
+ */
+static int squash_dir(const char *path) {
+	DBG("%s\n", path);
+
+	namelist_t list;
+	memset(&list, 0, sizeof(list));
+
+	int res = unionfs_readdir(path, &list, collect_name, 0, NULL);
+	if (res) {
+		fprintf(stderr, "Reading directory %s failed: %s\n", path, strerror(-res));
+		RETURN(1);
+	}
+
+	int i;
+	for (i = 0; i < list.count; i++) {
+		char member[PATHLEN_MAX], from[PATHLEN_MAX], to[PATHLEN_MAX];
+		if (BUILD_PATH(member, path, "/", list.names[i])) {
+			fprintf(stderr, "Path too long: %s/%s\n", path, list.names[i]);
+			count_error();
+			continue;
+		}
+
+		int branch = find_rorw_branch(member);
+		if (branch == -1) {
+			fprintf(stderr, "%s vanished: %s\n", member, strerror(errno));
+			count_error();
+			continue;
+		}
+
+		if (BUILD_PATH(from, uopt.branches[branch].path, member)
+		||  BUILD_PATH(to, sq.target, member)) {
+			fprintf(stderr, "Path too long: %s\n", member);
+			count_error();
+			continue;
+		}
+
+		struct stat st;
+		if (branch_lstat(branch, member, &st)) {
+			fprintf(stderr, "lstat(%s) failed: %s\n", from, strerror(errno));
+			count_error();
+			continue;
+		}
+
+		if (S_ISDIR(st.st_mode)) {
+			// owner only for now, we need to write into it even if the
+			// source directory is read-only
+			if (mkdir(to, S_IRWXU) && errno != EEXIST) {
+				fprintf(stderr, "mkdir(%s) failed: %s\n", to, strerror(errno));
+				count_error();
+				continue;
+			}
+			add_fixup(&sq.dirs, member, to, &st);
+
+			if (squash_dir(member)) count_error();
+		} else if (!is_hardlink(to, &st)) {
+			queue_job(from, branch, member, to, &st);
+		}
+	}
+
+	for (i = 0; i < list.count; i++) free(list.names[i]);
+	free(list.names);
+
+	RETURN(0);
+}
+
+/**
+ * Now that all files are copied, create hard links and set directory
+ * permissions and time stamps.
+ */
+static void squash_fixups(void) {
+	fixup_t *fix;
+
+	for (fix = sq.links; fix; fix = fix->next) {
+		if (link(fix->from, fix->to)) {
+			fprintf(stderr, "link(%s, %s) failed: %s\n",
+				fix->from, fix->to, strerror(errno));
+			sq.errors++;
+		}
+	}
+
+	// sq.dirs is a stack, so sub-directories come before their parents
+	for (fix = sq.dirs; fix; fix = fix->next) {
+		if (setfile(sq.branch, fix->from, &fix->st)) sq.errors++;
+	}
+}
+
+// the image we write with -i, see image.h
+static struct {
+	int fd;
+	uint64_t pos;			// end of the data written so far
+	struct image_inode *inodes;
+	uint64_t ninodes, max_inodes;
+	struct image_dirent *dirents;
+	uint64_t ndirents, max_dirents;
+	char *names;
+	uint64_t names_size, max_names;
+	struct hashtable *links;	// "dev:ino" of files with several links -> inode
+
+	// directories still to be written, breadth-first
+	char **dirs;
+	uint32_t *dir_inodes;
+	uint64_t ndirs, max_dirs, next_dir;
+} img;
+
+/**
+ * Make sure array has space for count elements of size bytes
+ */
+static void *grow(void *array, uint64_t *max, uint64_t count, size_t size) {
+	if (count <= *max) return array;
+
+	uint64_t n = *max ? *max * 2 : 1024;
+	while (n < count) n *= 2;
+
+	array = realloc(array, n * size);
+	if (!array) {
+		fprintf(stderr, "%s: realloc failed\n", __func__);
+		exit(1);
+	}
+	*max = n;
+
+	return array;
+}
+
+static int image_write(const void *buf, size_t size) {
+	const char *p = buf;
+
+	while (size > 0) {
+		ssize_t res = pwrite(img.fd, p, size, img.pos);
+		if (res == -1) {
+			if (errno == EINTR) continue;
+			fprintf(stderr, "Writing %s failed: %s\n", sq.target, strerror(errno));
+			return -1;
+		}
+		p += res;
+		size -= res;
+		img.pos += res;
+	}
+
+	return 0;
+}
+
+static int image_align(void) {
+	static const char zeros[IMAGE_ALIGN];
+
+	if (img.pos % IMAGE_ALIGN == 0) return 0;
+	return image_write(zeros, IMAGE_ALIGN - img.pos % IMAGE_ALIGN);
+}
+
+static uint32_t image_add_inode(const struct stat *st) {
+	if (img.ninodes >= UINT32_MAX) {
+		fprintf(stderr, "Too many files for an image\n");
+		exit(1);
+	}
+
+	img.inodes = grow(img.inodes, &img.max_inodes, img.ninodes + 1, sizeof(struct image_inode));
+
+	struct image_inode *inode = &img.inodes[img.ninodes];
+	memset(inode, 0, sizeof(*inode));
+	inode->mode = st->st_mode;
+	inode->uid = st->st_uid;
+	inode->gid = st->st_gid;
+	inode->nlink = S_ISDIR(st->st_mode) ? 2 : 1;
+	inode->rdev = st->st_rdev;
+	inode->atime = st->st_atim.tv_sec;
+	inode->atime_nsec = st->st_atim.tv_nsec;
+	inode->mtime = st->st_mtim.tv_sec;
+	inode->mtime_nsec = st->st_mtim.tv_nsec;
+	inode->ctime = st->st_ctim.tv_sec;
+	inode->ctime_nsec = st->st_ctim.tv_nsec;
+
+	return img.ninodes++;
+}
+
+static uint32_t image_add_name(const char *name) {
+	size_t len = strlen(name) + 1;
+
+	if (img.names_size + len > UINT32_MAX) {
+		fprintf(stderr, "Too many names for an image\n");
+		exit(1);
+	}
+
+	img.names = grow(img.names, &img.max_names, img.names_size + len, 1);
+	memcpy(img.names + img.names_size, name, len);
+	img.names_size += len;
+
+	return img.names_size - len;
+}
+
+/**
+ * Copy the data of the regular file path into the image
+ */
+static int image_add_file(int branch, const char *path, uint32_t ino) {
+	branch_file_t file;
+	if (branch_open(branch, path, O_RDONLY, 0, &file) == -1) {
+		fprintf(stderr, "Opening %s failed: %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	uint64_t start = img.pos;
+	int res = 0;
+
+	if (file.fd == -1) {
+		res = image_write(file.data, file.size);
+	} else {
+		char buf[65536];
+		off_t off = 0;
+		ssize_t n;
+		while ((n = branch_read(&file, buf, sizeof(buf), off)) > 0) {
+			if (image_write(buf, n)) {
+				res = 1;
+				break;
+			}
+			off += n;
+		}
+		if (n == -1) {
+			fprintf(stderr, "Reading %s failed: %s\n", path, strerror(errno));
+			res = 1;
+		}
+	}
+
+	branch_close(&file);
+
+	// the file might have changed since lstat()
+	img.inodes[ino].data = start;
+	img.inodes[ino].size = img.pos - start;
+
+	return res;
+}
+
+static int image_add_link(int branch, const char *path, uint32_t ino) {
+	char target[PATHLEN_MAX];
+	ssize_t len = branch_readlink(branch, path, target, sizeof(target) - 1);
+	if (len == -1) {
+		fprintf(stderr, "readlink(%s) failed: %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	img.inodes[ino].data = img.pos;
+	img.inodes[ino].size = len;
+
+	return image_write(target, len) ? 1 : 0;
+}
+
+static void image_queue_dir(const char *path, uint32_t ino) {
+	img.dirs = grow(img.dirs, &img.max_dirs, img.ndirs + 1, sizeof(char *));
+	uint64_t max = img.max_dirs;
+	img.dir_inodes = realloc(img.dir_inodes, max * sizeof(uint32_t));
+
+	img.dirs[img.ndirs] = strdup(path);
+	if (!img.dir_inodes || !img.dirs[img.ndirs]) {
+		fprintf(stderr, "%s: malloc failed\n", __func__);
+		exit(1);
+	}
+	img.dir_inodes[img.ndirs] = ino;
+	img.ndirs++;
+}
+
+static int compare_names(const void *a, const void *b) {
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/**
+ * Write the entries of the union directory path, which is inode dir
+ */
+static int image_dir(const char *path, uint32_t dir) {
+	DBG("%s\n", path);
+
+	namelist_t list;
+	memset(&list, 0, sizeof(list));
+
+	int res = unionfs_readdir(path, &list, collect_name, 0, NULL);
+	if (res) {
+		fprintf(stderr, "Reading directory %s failed: %s\n", path, strerror(-res));
+		RETURN(1);
+	}
+
+	// lookups in the image do a binary search
+	qsort(list.names, list.count, sizeof(char *), compare_names);
+
+	uint64_t first = img.ndirents;
+
+	int i;
+	for (i = 0; i < list.count; i++) {
+		char member[PATHLEN_MAX];
+		if (BUILD_PATH(member, path, "/", list.names[i])) {
+			fprintf(stderr, "Path too long: %s/%s\n", path, list.names[i]);
+			sq.errors++;
+			continue;
+		}
+
+		int branch = find_rorw_branch(member);
+		struct stat st;
+		if (branch == -1 || branch_lstat(branch, member, &st)) {
+			fprintf(stderr, "%s vanished: %s\n", member, strerror(errno));
+			sq.errors++;
+			continue;
+		}
+
+		if (S_ISSOCK(st.st_mode)) {
+			fprintf(stderr, "Skipping socket %s\n", member);
+			continue;
+		}
+
+		char key[64];
+		uint32_t *link = NULL;
+		if (!S_ISDIR(st.st_mode) && st.st_nlink > 1) {
+			snprintf(key, sizeof(key), "%llu:%llu",
+				(unsigned long long)st.st_dev, (unsigned long long)st.st_ino);
+			link = hashtable_search(img.links, key);
+		}
+
+		uint32_t ino;
+		if (link) {
+			ino = *link;
+			img.inodes[ino].nlink++;
+		} else {
+			ino = image_add_inode(&st);
+
+			if (S_ISREG(st.st_mode)) res = image_add_file(branch, member, ino);
+			else if (S_ISLNK(st.st_mode)) res = image_add_link(branch, member, ino);
+			else if (S_ISDIR(st.st_mode)) image_queue_dir(member, ino);
+			if (res) {
+				sq.errors++;
+				res = 0;
+			}
+
+			if (!S_ISDIR(st.st_mode) && st.st_nlink > 1) {
+				char *k = strdup(key);
+				uint32_t *v = malloc(sizeof(uint32_t));
+				if (!k || !v) {
+					fprintf(stderr, "%s: malloc failed\n", __func__);
+					exit(1);
+				}
+				*v = ino;
+				hashtable_insert(img.links, k, v);
+			}
+		}
+
+		img.dirents = grow(img.dirents, &img.max_dirents, img.ndirents + 1, sizeof(struct image_dirent));
+		img.dirents[img.ndirents].name = image_add_name(list.names[i]);
+		img.dirents[img.ndirents].ino = ino;
+		img.ndirents++;
+	}
+
+	img.inodes[dir].data = first;
+	img.inodes[dir].size = img.ndirents - first;
+
+	for (i = 0; i < list.count; i++) free(list.names[i]);
+	free(list.names);
+
+	RETURN(0);
+}
+
+/**
+ * Squash the union into the image file sq.target
+ */
+static int squash_image(void) {
+	img.fd = open(sq.target, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (img.fd == -1) {
+		fprintf(stderr, "Failed to create %s: %s\n", sq.target, strerror(errno));
+		return 1;
+	}
+	img.links = create_hashtable(16, string_hash, string_equal);
+
+	// the header is written last
+	struct image_header hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	img.pos = sizeof(hdr);
+
+	struct stat st;
+	int branch = find_rorw_branch("/");
+	if (branch == -1 || branch_lstat(branch, "/", &st)) {
+		fprintf(stderr, "Failed to stat the root directory: %s\n", strerror(errno));
+		return 1;
+	}
+	image_queue_dir("/", image_add_inode(&st));
+
+	for (img.next_dir = 0; img.next_dir < img.ndirs; img.next_dir++) {
+		char *path = img.dirs[img.next_dir];
+		if (image_dir(path, img.dir_inodes[img.next_dir])) sq.errors++;
+		free(path);
+	}
+
+	memcpy(hdr.magic, IMAGE_MAGIC, sizeof(hdr.magic));
+	hdr.version = IMAGE_VERSION;
+	hdr.ninodes = img.ninodes;
+
+	if (image_align()) return 1;
+	hdr.inodes = img.pos;
+	if (image_write(img.inodes, img.ninodes * sizeof(struct image_inode))) return 1;
+
+	hdr.ndirents = img.ndirents;
+	hdr.dirents = img.pos;
+	if (image_write(img.dirents, img.ndirents * sizeof(struct image_dirent))) return 1;
+
+	hdr.names = img.pos;
+	hdr.names_size = img.names_size;
+	if (image_write(img.names, img.names_size)) return 1;
+
+	img.pos = 0;
+	if (image_write(&hdr, sizeof(hdr))) return 1;
+
+	if (close(img.fd)) {
+		fprintf(stderr, "Writing %s failed: %s\n", sq.target, strerror(errno));
+		return 1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	char *progname = basename(argv[0]);
+	long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+	init_syslog();
+	uopt_init();
+
+	int opt;
+	while ((opt = getopt(argc, argv, "hij:l")) != -1) {
+		switch (opt) {
+		case 'i':
+			sq.image = true;
+			break;
+		case 'j':
+			jobs = strtol(optarg, NULL, 10);
+			if (jobs < 1) {
+				fprintf(stderr, "Invalid number of jobs: %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'l':
+			sq.hardlink = true;
+			break;
+		default:
+			print_help(progname);
+			exit(1);
+		}
+	}
+
+	if (argc - optind != 2 || (sq.image && sq.hardlink)) {
+		print_help(progname);
+		exit(1);
+	}
+	if (jobs < 1) jobs = 1;
+
+	if (unionfs_opt_proc(NULL, argv[optind], FUSE_OPT_KEY_NONOPT, NULL)) {
+		fprintf(stderr, "You need to specify at least one branch!\n");
+		exit(1);
+	}
+
+	// whiteouts and meta files have to be taken into account, exactly as
+	// unionfs -o cow,hide_meta_files would do
+	uopt.cow_enabled = true;
+	uopt.hide_meta_files = true;
+	unionfs_post_opts();
+
+	sq.target = argv[optind + 1];
+
+	if (sq.image) {
+		if (squash_image() || sq.errors) {
+			fprintf(stderr, "%d errors, %s is incomplete!\n", sq.errors, sq.target);
+			return 1;
+		}
+		return 0;
+	}
+
+	if (mkdir(sq.target, S_IRWXU) && errno != EEXIST) {
+		fprintf(stderr, "Failed to create %s: %s\n", sq.target, strerror(errno));
+		exit(1);
+	}
+
+	// the copies are written through the directory backend, as if the
+	// target was a rw-branch, which is not part of the union
+	sq.branch = uopt.nbranches;
+	uopt.branches = realloc(uopt.branches, (sq.branch + 1) * sizeof(branch_entry_t));
+	if (!uopt.branches) {
+		fprintf(stderr, "%s: realloc failed\n", __func__);
+		exit(1);
+	}
+	memset(&uopt.branches[sq.branch], 0, sizeof(branch_entry_t));
+	uopt.branches[sq.branch].path = (char *)sq.target;
+	uopt.branches[sq.branch].fd = -1;
+	uopt.branches[sq.branch].rw = 1;
+	uopt.branches[sq.branch].ops = &dir_ops;
+
+	sq.uid = getuid();
+	sq.umask = umask(0);
+	umask(sq.umask);
+
+	pthread_mutex_init(&sq.lock, NULL);
+	pthread_cond_init(&sq.cond_jobs, NULL);
+	pthread_cond_init(&sq.cond_space, NULL);
+	sq.inodes = create_hashtable(16, string_hash, string_equal);
+
+	pthread_t threads[jobs];
+	long i;
+	for (i = 0; i < jobs; i++) {
+		if (pthread_create(&threads[i], NULL, squash_worker, NULL)) {
+			fprintf(stderr, "Failed to start the copy threads\n");
+			exit(1);
+		}
+	}
+
+	// the root directory itself, as first entry its fixup is done last
+	struct stat st;
+	int branch = find_rorw_branch("/");
+	if (branch == -1 || branch_lstat(branch, "/", &st)) {
+		fprintf(stderr, "Failed to stat the root directory: %s\n", strerror(errno));
+		exit(1);
+	}
+	add_fixup(&sq.dirs, "/", sq.target, &st);
+
+	if (squash_dir("/")) sq.errors++;
+
+	pthread_mutex_lock(&sq.lock);
+	sq.done = true;
+	pthread_cond_broadcast(&sq.cond_jobs);
+	pthread_mutex_unlock(&sq.lock);
+
+	for (i = 0; i < jobs; i++) pthread_join(threads[i], NULL);
+
+	squash_fixups();
+
+	if (sq.errors) {
+		fprintf(stderr, "%d errors, %s is incomplete!\n", sq.errors, sq.target);
+		return 1;
+	}
+
+	return 0;
+}
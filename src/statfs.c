@@ -0,0 +1,296 @@
+/*
+*  C Implementation: statfs
+*
+* Description: Aggregate and cache statfs() results of all branches
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+*
+* Details:
+*	Branches on the same device must only be counted once. The device of
+*	each branch is resolved once on mount, so statfs() only needs to call
+*	statfs() on the first branch of every device.
+*	df and monitoring agents call statfs() all the time, so with
+*	-o statfs_cache=seconds the aggregated result is cached. An expired
+*	result is still returned, but refreshed in the background. Only large
+*	writes and truncates through the union invalidate the result, so that
+*	the next statfs() has to wait for a fresh one.
+*/
+
+#if defined __linux__
+	#define _DEFAULT_SOURCE 1
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef linux
+	#include <sys/vfs.h>
+#endif
+#include <sys/statvfs.h>
+
+#include "unionfs.h"
+#include "opts.h"
+#include "debug.h"
+#include "usyslog.h"
+#include "statfs.h"
+#include "reconf.h"
+
+#define STATFS_DIRTY_MAX (64 * 1024 * 1024) // invalidate after writing that much
+
+static bool *duplicate;		// the branch is on the device of a higher branch
+
+static pthread_mutex_t statfs_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct statvfs cached;
+static bool valid;		// cached is usable
+static time_t stamp;		// when cached was taken
+static unsigned int generation;	// increased on every invalidation
+static bool refreshing;		// a background refresh is running
+static uint64_t dirty;		// bytes written since cached was taken
+
+/**
+ * Wrapper function to convert the result of statfs() to statvfs()
+ * libfuse uses statvfs, since it conforms to POSIX. Unfortunately,
+ * glibc's statvfs parses /proc/mounts, which then results in reading
+ * the filesystem itself again - which would result in a deadlock.
+ * TODO: BSD/MacOSX
+ */
+static int statvfs_local(const char *path, struct statvfs *stbuf) {
+#ifdef linux
+	/* glibc's statvfs walks /proc/mounts and stats entries found there
+	 * in order to extract their mount flags, which may deadlock if they
+	 * are mounted under the unionfs. As a result, we have to do this
+	 * ourselves.
+	 */
+	struct statfs stfs;
+	int res = statfs(path, &stfs);
+	if (res == -1) RETURN(res);
+
+	memset(stbuf, 0, sizeof(*stbuf));
+	stbuf->f_bsize = stfs.f_bsize;
+	if (stfs.f_frsize) {
+		stbuf->f_frsize = stfs.f_frsize;
+	} else {
+		stbuf->f_frsize = stfs.f_bsize;
+	}
+	stbuf->f_blocks = stfs.f_blocks;
+	stbuf->f_bfree = stfs.f_bfree;
+	stbuf->f_bavail = stfs.f_bavail;
+	stbuf->f_files = stfs.f_files;
+	stbuf->f_ffree = stfs.f_ffree;
+	stbuf->f_favail = stfs.f_ffree; /* nobody knows */
+
+	/* We don't worry about flags, exactly because this would
+	 * require reading /proc/mounts, and avoiding that and the
+	 * resulting deadlocks is exactly what we're trying to avoid
+	 * by doing this rather than using statvfs.
+	 */
+	stbuf->f_flag = 0;
+	stbuf->f_namemax = stfs.f_namelen;
+
+	RETURN(0);
+#else
+	RETURN(statvfs(path, stbuf));
+#endif
+}
+
+static time_t now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/**
+ * Resolve the devices of all branches. Must be called after we went into the
+ * chroot, if any, and again whenever the branches changed.
+ */
+void statfs_init(void) {
+	dev_t devno[uopt.nbranches];
+
+	free(duplicate);
+	duplicate = calloc(uopt.nbranches, sizeof(bool));
+	if (!duplicate) {
+		USYSLOG(LOG_WARNING, "%s: out of memory, not eliminating same devices\n", __func__);
+		return;
+	}
+
+	int i;
+	for (i = 0; i < uopt.nbranches; i++) {
+		struct stat st;
+		if (stat(uopt.branches[i].path, &st) == -1) {
+			USYSLOG(LOG_WARNING, "%s: stat(%s) failed: %s\n",
+				__func__, uopt.branches[i].path, strerror(errno));
+			devno[i] = (dev_t)-1;
+			continue;
+		}
+		devno[i] = st.st_dev;
+
+		// Eliminate same devices
+		int j;
+		for (j = 0; j < i; j++) {
+			if (devno[j] == st.st_dev) {
+				DBG("%s is on the device of %s\n", uopt.branches[i].path, uopt.branches[j].path);
+				duplicate[i] = true;
+				break;
+			}
+		}
+	}
+}
+
+/**
+ * Sum up the statfs() results of all devices
+ */
+static int statfs_branches(struct statvfs *stbuf) {
+	int first = 1;
+
+	int i = 0;
+	for (i = 0; i < uopt.nbranches; i++) {
+		if (duplicate && duplicate[i]) continue;
+
+		struct statvfs stb;
+		int res = statvfs_local(uopt.branches[i].path, &stb);
+		if (res == -1) return -errno;
+
+		if (first) {
+			memcpy(stbuf, &stb, sizeof(*stbuf));
+			first = 0;
+			stbuf->f_fsid = stb.f_fsid << 8;
+			continue;
+		}
+
+		// Filesystem can have different block sizes -> normalize to first's block size
+		double ratio = (double)stb.f_bsize / (double)stbuf->f_bsize;
+
+		if (uopt.branches[i].rw) {
+			stbuf->f_blocks += stb.f_blocks * ratio;
+			stbuf->f_bfree += stb.f_bfree * ratio;
+			stbuf->f_bavail += stb.f_bavail * ratio;
+
+			stbuf->f_files += stb.f_files;
+			stbuf->f_ffree += stb.f_ffree;
+			stbuf->f_favail += stb.f_favail;
+		} else if (!uopt.statfs_omit_ro) {
+			// omitting the RO branches is not correct regarding
+			// the block counts but it actually fixes the
+			// percentage of free space. so, let the user decide.
+			stbuf->f_blocks += stb.f_blocks * ratio;
+			stbuf->f_files  += stb.f_files;
+		}
+
+		if (!(stb.f_flag & ST_RDONLY)) stbuf->f_flag &= ~ST_RDONLY;
+		if (!(stb.f_flag & ST_NOSUID)) stbuf->f_flag &= ~ST_NOSUID;
+
+		if (stb.f_namemax < stbuf->f_namemax) stbuf->f_namemax = stb.f_namemax;
+	}
+
+	return 0;
+}
+
+/**
+ * Store a fresh result, unless the cache got invalidated since gen was taken.
+ * Must be called locked.
+ */
+static void store(const struct statvfs *stbuf, unsigned int gen) {
+	if (gen != generation) return;
+
+	memcpy(&cached, stbuf, sizeof(cached));
+	stamp = now();
+	valid = true;
+	dirty = 0;
+}
+
+static void *refresh_thread(void *arg) {
+	(void)arg;
+
+	pthread_mutex_lock(&statfs_lock);
+	unsigned int gen = generation;
+	pthread_mutex_unlock(&statfs_lock);
+
+	struct statvfs stb;
+	reconf_enter();
+	int res = statfs_branches(&stb);
+	reconf_leave();
+
+	pthread_mutex_lock(&statfs_lock);
+	if (res == 0) store(&stb, gen);
+	refreshing = false;
+	pthread_mutex_unlock(&statfs_lock);
+
+	return NULL;
+}
+
+/**
+ * Start a background refresh, if none is running yet. Must be called locked.
+ */
+static void refresh(void) {
+	if (refreshing) return;
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, refresh_thread, NULL)) {
+		// no thread, the next call will try again
+		return;
+	}
+	pthread_detach(thread);
+	refreshing = true;
+}
+
+/**
+ * statfs() of the union
+ */
+int statfs_union(struct statvfs *stbuf) {
+	if (!uopt.statfs_cache) return statfs_branches(stbuf);
+
+	pthread_mutex_lock(&statfs_lock);
+
+	if (valid) {
+		memcpy(stbuf, &cached, sizeof(*stbuf));
+		if (now() - stamp >= (time_t)uopt.statfs_cache) refresh();
+		pthread_mutex_unlock(&statfs_lock);
+		return 0;
+	}
+
+	unsigned int gen = generation;
+	pthread_mutex_unlock(&statfs_lock);
+
+	int res = statfs_branches(stbuf);
+	if (res) return res;
+
+	pthread_mutex_lock(&statfs_lock);
+	store(stbuf, gen);
+	pthread_mutex_unlock(&statfs_lock);
+
+	return 0;
+}
+
+/**
+ * The cached result is definitely wrong, e.g. after a truncate
+ */
+void statfs_invalidate(void) {
+	if (!uopt.statfs_cache) return;
+
+	pthread_mutex_lock(&statfs_lock);
+	generation++;
+	valid = false;
+	pthread_mutex_unlock(&statfs_lock);
+}
+
+/**
+ * Account bytes written, too many of them invalidate the cached result
+ */
+void statfs_written(size_t bytes) {
+	if (!uopt.statfs_cache) return;
+
+	if (__sync_add_and_fetch(&dirty, bytes) < STATFS_DIRTY_MAX) return;
+
+	DBG("%llu bytes written, invalidating statfs cache\n", (unsigned long long)dirty);
+	statfs_invalidate();
+}
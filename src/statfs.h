@@ -0,0 +1,18 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#ifndef STATFS_H
+#define STATFS_H
+
+#include <stddef.h>
+#include <sys/statvfs.h>
+
+void statfs_init(void);
+int statfs_union(struct statvfs *stbuf);
+void statfs_invalidate(void);
+void statfs_written(size_t bytes);
+
+#endif
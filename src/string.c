@@ -17,6 +17,7 @@
 #include <strings.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <errno.h>
 
 #include "unionfs.h"
@@ -25,18 +26,21 @@
 #include "general.h"
 #include "usyslog.h"
 
+#define HIDETAG_LEN (sizeof(HIDETAG) - 1)
+
 /**
  * Check if the given fname suffixes the hide tag
  */
 char *whiteout_tag(const char *fname) {
 	DBG("%s\n", fname);
 
-	char *tag = strstr(fname, HIDETAG);
+	// only the end of fname matters, so no need to search all of it
+	size_t len = strlen(fname);
 
-	// check if fname has tag, fname is not only the tag, file name ends with the tag
-	// TODO: static strlen(HIDETAG)
-	if (tag && tag != fname && strlen(tag) == strlen(HIDETAG)) {
-		return tag;
+	// check if fname is not only the tag and ends with the tag
+	if (len > HIDETAG_LEN) {
+		char *tag = (char *)fname + len - HIDETAG_LEN;
+		if (memcmp(tag, HIDETAG, HIDETAG_LEN) == 0) return tag;
 	}
 
 	return NULL;
@@ -156,39 +160,46 @@ char *u_dirname(const char *path) {
 }
 
 /**
- * general elf hash (32-bit) function
- *
- * Algorithm taken from URL: http://www.partow.net/programming/hashfunctions/index.html,
- * but rewritten from scratch due to incompatible license.
+ * Hash of len bytes at str, 8 bytes at a time
  *
- * str needs to NULL terminated
+ * The elf hash we used before has to process one byte after the other,
+ * each step depending on the last one. Here every 8 bytes are mixed in by
+ * a single multiplication. The result is only used in memory, so it does
+ * not need to be stable across versions.
  */
-static unsigned int elfhash(const char *str) {
-	DBG("%s\n", str);
-
-	unsigned int hash = 0;
-
-	while (*str) {
-		hash = (hash << 4) + (*str); // hash * 16 + c
-
-		// 0xF is 1111 in dual system, so highbyte is the highest byte of hash (which is 32bit == 4 Byte)
-		unsigned int highbyte = hash & 0xF0000000UL;
+unsigned int hash_bytes(const char *str, size_t len) {
+	const uint64_t mul = 0x9E3779B97F4A7C15ULL; // 2^64 / golden ratio
+	uint64_t hash = len * mul;
+	uint64_t word;
+
+	while (len >= sizeof(word)) {
+		memcpy(&word, str, sizeof(word)); // unaligned and endianness does not matter
+		hash = (hash ^ word) * mul;
+		hash ^= hash >> 29;
+		str += sizeof(word);
+		len -= sizeof(word);
+	}
 
-		if (highbyte != 0) hash ^= (highbyte >> 24);
-		// example (if the condition is met):
-		//               hash = 10110000000000000000000010100000
-		//           highbyte = 10110000000000000000000000000000
-		//   (highbyte >> 24) = 00000000000000000000000010110000
-		// after XOR:    hash = 10110000000000000000000000010000
+	if (len) {
+		word = 0;
+		memcpy(&word, str, len);
+		hash = (hash ^ word) * mul;
+		hash ^= hash >> 29;
+	}
 
-		hash &= ~highbyte;
-		//          ~highbyte = 01001111111111111111111111111111
-		// after AND:    hash = 00000000000000000000000000010000
+	// fold the high bits into the low ones, the hashtable uses those
+	hash *= mul;
+	return (unsigned int)(hash ^ (hash >> 32));
+}
 
-		str++;
-	}
+/**
+ * hash_bytes() of a NULL terminated string, its length is found by
+ * strlen(), which libc does a vector at a time
+ */
+static unsigned int wordhash(const char *str) {
+	DBG("%s\n", str);
 
-	return hash;
+	return hash_bytes(str, strlen(str));
 }
 
 /**
@@ -196,5 +207,5 @@ static unsigned int elfhash(const char *str) {
  * hash algorith.
  */
 unsigned int string_hash(void *s) {
-	return elfhash(s);
+	return wordhash(s);
 }
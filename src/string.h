@@ -12,6 +12,7 @@
 char *whiteout_tag(const char *fname);
 int build_path(char *dest, int max_len, const char *callfunc, int line, ...);
 char *u_dirname(const char *path);
+unsigned int hash_bytes(const char *str, size_t len);
 unsigned int string_hash(void *s);
 
 /**
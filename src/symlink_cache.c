@@ -0,0 +1,202 @@
+/*
+*  C Implementation: symlink_cache
+*
+* Description: Cache of symlink targets for readlink()
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+*
+* Details:
+*	Toolchains resolve the same symlink chains over and over again, each
+*	time we needed a branch lookup plus a readlink(). So we remember the
+*	branch and the target of a symlink. Entries are dropped by symlink(),
+*	unlink(), rename() and copy-up, see cache_invalidate().
+*	A lookup might race with an invalidation of the same path, e.g.
+*	readlink() found the link, but before it is added to the cache,
+*	another thread unlinks it. So every invalidation increases a
+*	generation counter and entries are only added, if the generation did
+*	not change since the caller started its lookup.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "unionfs.h"
+#include "opts.h"
+#include "debug.h"
+#include "hashtable.h"
+#include "hashtable_itr.h"
+#include "string.h"
+#include "cache.h"
+#include "uioctl.h"
+#include "policy.h"
+#include "symlink_cache.h"
+
+#define SYMLINK_CACHE_MAX 65536 // flush the cache if it grows larger
+
+typedef struct {
+	int branch;		// the branch the link was found on
+	char *target;
+} symlink_entry_t;
+
+static struct hashtable *symlinks;	// path -> symlink_entry_t
+static pthread_rwlock_t symlinks_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static unsigned int generation;		// increased on every invalidation
+
+static uint64_t hits;
+static uint64_t misses;
+
+void symlink_cache_init(void) {
+	symlinks = cache_create(256);
+}
+
+static void free_entry(void *data) {
+	symlink_entry_t *entry = data;
+
+	free(entry->target);
+	free(entry);
+}
+
+/**
+ * Copy the target of the link path into buf, just like readlink() would do.
+ * Return true on a cache hit.
+ */
+bool symlink_cache_get(const char *path, char *buf, size_t size) {
+	if (!uopt.symlink_cache) return false;
+
+	pthread_rwlock_rdlock(&symlinks_lock);
+
+	symlink_entry_t *entry = cache_search(symlinks, path);
+	if (entry) {
+		// readlink() silently truncates, so do we
+		strncpy(buf, entry->target, size - 1);
+		buf[size - 1] = '\0';
+	}
+
+	pthread_rwlock_unlock(&symlinks_lock);
+
+	if (entry) {
+		__sync_fetch_and_add(&hits, 1);
+		DBG("%s: cached %s\n", path, buf);
+		return true;
+	}
+
+	__sync_fetch_and_add(&misses, 1);
+	return false;
+}
+
+/**
+ * Get the generation to be given to symlink_cache_set() later on, this has
+ * to be called before the branch lookup.
+ */
+unsigned int symlink_cache_generation(void) {
+	return __sync_fetch_and_add(&generation, 0);
+}
+
+/**
+ * Remember the target of the link path, which was found on branch
+ */
+void symlink_cache_set(const char *path, int branch, const char *target, unsigned int gen) {
+	if (!uopt.symlink_cache || (policy_of(path) & POLICY_NOCACHE)) return;
+
+	pthread_rwlock_wrlock(&symlinks_lock);
+
+	// an invalidation in the mean time, our result might be outdated
+	if (gen != generation) goto out;
+
+	if (cache_search(symlinks, path)) goto out;
+
+	if (hashtable_count(symlinks) >= SYMLINK_CACHE_MAX) {
+		DBG("symlink cache full, flushing it\n");
+		cache_flush(symlinks, free_entry);
+	}
+
+	symlink_entry_t *entry = malloc(sizeof(symlink_entry_t));
+	if (entry) entry->target = strdup(target);
+
+	if (!entry || !entry->target || !cache_insert(symlinks, path, entry)) {
+		if (entry) free(entry->target);
+		free(entry);
+		goto out;
+	}
+	entry->branch = branch;
+
+out:
+	pthread_rwlock_unlock(&symlinks_lock);
+}
+
+void symlink_cache_invalidate(const char *path) {
+	if (!uopt.symlink_cache) return;
+
+	pthread_rwlock_wrlock(&symlinks_lock);
+
+	generation++;
+	symlink_entry_t *entry = cache_remove(symlinks, path);
+	if (entry) free_entry(entry);
+
+	pthread_rwlock_unlock(&symlinks_lock);
+}
+
+void symlink_cache_invalidate_tree(const char *path) {
+	if (!uopt.symlink_cache) return;
+
+	pthread_rwlock_wrlock(&symlinks_lock);
+
+	generation++;
+	cache_remove_tree(symlinks, path, free_entry);
+
+	pthread_rwlock_unlock(&symlinks_lock);
+}
+
+/**
+ * Forget every link branch might serve, see cache_forget_branch()
+ */
+void symlink_cache_forget_branch(int branch) {
+	if (!uopt.symlink_cache) return;
+
+	pthread_rwlock_wrlock(&symlinks_lock);
+
+	generation++;
+	cache_remove_branch(symlinks, branch, free_entry);
+
+	pthread_rwlock_unlock(&symlinks_lock);
+}
+
+/**
+ * The branches got new indices, see cache_renumber()
+ */
+void symlink_cache_renumber(const int *map, int n) {
+	if (!uopt.symlink_cache) return;
+
+	pthread_rwlock_wrlock(&symlinks_lock);
+
+	generation++;
+
+	struct hashtable_itr *itr = hashtable_count(symlinks) ? hashtable_iterator(symlinks) : NULL;
+	bool more = itr != NULL;
+	while (more) {
+		symlink_entry_t *entry = hashtable_iterator_value(itr);
+
+		if (entry->branch >= n || map[entry->branch] == -1) {
+			free_entry(entry);
+			more = hashtable_iterator_remove(itr);
+		} else {
+			entry->branch = map[entry->branch];
+			more = hashtable_iterator_advance(itr);
+		}
+	}
+	free(itr);
+
+	pthread_rwlock_unlock(&symlinks_lock);
+}
+
+void symlink_cache_stats(struct unionfs_stats *stats) {
+	stats->symlink_cache_hits = hits;
+	stats->symlink_cache_misses = misses;
+}
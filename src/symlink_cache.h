@@ -0,0 +1,25 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#ifndef SYMLINK_CACHE_H
+#define SYMLINK_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct unionfs_stats;
+
+void symlink_cache_init(void);
+bool symlink_cache_get(const char *path, char *buf, size_t size);
+unsigned int symlink_cache_generation(void);
+void symlink_cache_set(const char *path, int branch, const char *target, unsigned int generation);
+void symlink_cache_invalidate(const char *path);
+void symlink_cache_invalidate_tree(const char *path);
+void symlink_cache_forget_branch(int branch);
+void symlink_cache_renumber(const int *map, int n);
+void symlink_cache_stats(struct unionfs_stats *stats);
+
+#endif
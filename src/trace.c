@@ -0,0 +1,468 @@
+/*
+*  C Implementation: trace
+*
+* Description: Record the files read after mount and prefetch them on the
+*              next mount
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+*
+* Details:
+*	Containers and services usually read the same files in the same order
+*	whenever they start. With -otrace= we record the files of ro-branches
+*	opened during the first -otrace_time= seconds, in the order of their
+*	first open, together with the byte ranges read from them. The result
+*	is a manifest, one file per line:
+*
+*		<path> TAB <start>-<end> <start>-<end> ...
+*
+*	With -oprefetch= a manifest is replayed right after mount by a few
+*	threads in parallel: each file is looked up and opened, so that the
+*	branch directories and inodes are cached by the kernel, and the
+*	recorded ranges are read ahead with posix_fadvise(WILLNEED), so the
+*	start-up is served from memory instead of the disk.
+*	Both files are opened on mount, before we go into the chroot, so the
+*	same file may be given for both to refine the manifest on every mount.
+*/
+
+#if defined __linux__
+	// For getline() and posix_fadvise()
+	#define _XOPEN_SOURCE 700
+	#define _DEFAULT_SOURCE 1
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <inttypes.h>
+
+#include "unionfs.h"
+#include "opts.h"
+#include "debug.h"
+#include "string.h"
+#include "usyslog.h"
+#include "hashtable.h"
+#include "cache.h"
+#include "findbranch.h"
+#include "branch.h"
+#include "reconf.h"
+#include "trace.h"
+
+#define TRACE_MAX_FILES 65536	// files recorded at most
+#define TRACE_RANGES 16		// ranges of a file, more are merged
+#define PREFETCH_THREADS 4
+
+typedef struct {
+	off_t start;
+	off_t end;
+} range_t;
+
+typedef struct trace_file {
+	struct trace_file *next;	// in the order of the first open
+	unsigned int nranges;
+	range_t ranges[TRACE_RANGES];
+	char path[];
+} trace_file_t;
+
+// the recording, locked by trace_lock
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct hashtable *traced;	// path -> trace_file_t
+static trace_file_t *first, **last = &first;
+static unsigned int count;
+static int trace_fd = -1;
+static bool recording;
+
+// the manifest to prefetch, read-only once the threads run
+static trace_file_t **manifest;
+static unsigned int manifest_len;
+static unsigned int manifest_next;	// the next file to prefetch
+static unsigned int prefetchers;	// threads still running
+
+static trace_file_t *new_file(const char *path) {
+	size_t len = strlen(path);
+
+	trace_file_t *f = malloc(sizeof(trace_file_t) + len + 1);
+	if (!f) return NULL;
+
+	f->next = NULL;
+	f->nranges = 0;
+	memcpy(f->path, path, len + 1);
+
+	return f;
+}
+
+static void free_files(trace_file_t *f) {
+	while (f) {
+		trace_file_t *next = f->next;
+		free(f);
+		f = next;
+	}
+}
+
+/**
+ * Add the range start-end to f, merging it with the ranges it touches. If
+ * f is full, the last range is extended, which prefetches a bit more than
+ * needed.
+ */
+static void add_range(trace_file_t *f, off_t start, off_t end) {
+	unsigned int i;
+	for (i = 0; i < f->nranges; i++) {
+		range_t *r = &f->ranges[i];
+		if (start <= r->end && end >= r->start) {
+			if (start < r->start) r->start = start;
+			if (end > r->end) r->end = end;
+			return;
+		}
+	}
+
+	if (f->nranges < TRACE_RANGES) {
+		f->ranges[f->nranges].start = start;
+		f->ranges[f->nranges].end = end;
+		f->nranges++;
+		return;
+	}
+
+	range_t *r = &f->ranges[TRACE_RANGES - 1];
+	if (start < r->start) r->start = start;
+	if (end > r->end) r->end = end;
+}
+
+/**
+ * Parse a line of a manifest, returns NULL for invalid lines
+ */
+static trace_file_t *parse_line(char *line) {
+	char *tab = strchr(line, '\t');
+	if (!tab || line[0] != '/') return NULL;
+	*tab = '\0';
+
+	trace_file_t *f = new_file(line);
+	if (!f) return NULL;
+
+	char *walk = tab + 1;
+	while (f->nranges < TRACE_RANGES) {
+		char *end;
+		intmax_t start = strtoimax(walk, &end, 10);
+		if (end == walk || *end != '-') break;
+
+		walk = end + 1;
+		intmax_t stop = strtoimax(walk, &end, 10);
+		if (end == walk || stop < start || start < 0) break;
+		walk = end;
+
+		f->ranges[f->nranges].start = start;
+		f->ranges[f->nranges].end = stop;
+		f->nranges++;
+	}
+
+	return f;
+}
+
+/**
+ * Read the manifest file, to be replayed by prefetch_start(). Returns 0 or
+ * -errno, lines which cannot be parsed are skipped.
+ */
+static int prefetch_load(const char *file) {
+	FILE *fp = fopen(file, "r");
+	if (!fp) return -errno;
+
+	trace_file_t *files = NULL, **tail = &files;
+	unsigned int n = 0;
+
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	while (n < TRACE_MAX_FILES && (len = getline(&line, &size, fp)) != -1) {
+		if (len && line[len - 1] == '\n') line[len - 1] = '\0';
+
+		trace_file_t *f = parse_line(line);
+		if (!f) continue;
+
+		*tail = f;
+		tail = &f->next;
+		n++;
+	}
+
+	free(line);
+	fclose(fp);
+
+	if (!n) return 0;
+
+	manifest = malloc(n * sizeof(trace_file_t *));
+	if (!manifest) {
+		free_files(files);
+		return -ENOMEM;
+	}
+
+	trace_file_t *f;
+	for (f = files; f; f = f->next) manifest[manifest_len++] = f;
+
+	return 0;
+}
+
+static void prefetch_file(const trace_file_t *f) {
+	reconf_enter();
+
+	int i = find_rorw_branch(f->path);
+	if (i == -1) goto out;
+
+	branch_file_t file;
+	if (branch_open(i, f->path, O_RDONLY, 0, &file) == -1) goto out;
+
+#ifdef POSIX_FADV_WILLNEED
+	// files served from memory, e.g. images, are there already
+	unsigned int r;
+	for (r = 0; r < f->nranges && file.fd != -1; r++) {
+		const range_t *range = &f->ranges[r];
+		posix_fadvise(file.fd, range->start, range->end - range->start, POSIX_FADV_WILLNEED);
+	}
+#endif
+
+	branch_close(&file);
+
+out:
+	reconf_leave();
+}
+
+static void free_manifest(void) {
+	unsigned int i;
+	for (i = 0; i < manifest_len; i++) free(manifest[i]);
+	free(manifest);
+	manifest = NULL;
+}
+
+static void *prefetch_thread(void *arg) {
+	(void)arg;
+
+	while (1) {
+		unsigned int n = __atomic_fetch_add(&manifest_next, 1, __ATOMIC_RELAXED);
+		if (n >= manifest_len) break;
+
+		prefetch_file(manifest[n]);
+	}
+
+	// the last one cleans up
+	if (__atomic_sub_fetch(&prefetchers, 1, __ATOMIC_ACQ_REL) == 0) {
+		DBG("prefetched %u files\n", manifest_len);
+		free_manifest();
+	}
+
+	return NULL;
+}
+
+/**
+ * Replay the manifest read by prefetch_load() in the background. Must be
+ * called after we went into the chroot, if any.
+ */
+void prefetch_start(void) {
+	if (!manifest) return;
+
+	// not incremented one by one, a thread might be done before the next starts
+	prefetchers = PREFETCH_THREADS;
+
+	int i;
+	for (i = 0; i < PREFETCH_THREADS; i++) {
+		pthread_t thread;
+
+		int res = pthread_create(&thread, NULL, prefetch_thread, NULL);
+		if (res) {
+			USYSLOG(LOG_WARNING, "Failed to start a prefetch thread: %s\n", strerror(res));
+			// the threads we did not start are done as well
+			if (__atomic_sub_fetch(&prefetchers, PREFETCH_THREADS - i, __ATOMIC_ACQ_REL) == 0) {
+				free_manifest();
+			}
+			return;
+		}
+
+		pthread_detach(thread);
+	}
+}
+
+/**
+ * Open the file to write the recorded manifest into. Returns 0 or -errno.
+ */
+static int trace_open_manifest(const char *file) {
+	trace_fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (trace_fd == -1) return -errno;
+
+	traced = cache_create(1024);
+	if (!traced) {
+		close(trace_fd);
+		trace_fd = -1;
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/**
+ * Build the path of a manifest given by an option, like branches it is
+ * within the chroot if there is one
+ */
+static int manifest_path(char *path, const char *file) {
+	int res;
+	if (uopt.chroot) {
+		res = BUILD_PATH(path, uopt.chroot, file);
+	} else {
+		res = BUILD_PATH(path, file);
+	}
+	return res ? -ENAMETOOLONG : 0;
+}
+
+/**
+ * Read the manifest to prefetch and open the one to record. Called on mount,
+ * before we go into the chroot.
+ */
+void trace_init(void) {
+	char path[PATHLEN_MAX];
+
+	// the manifest might be the same file for both, so it is read first
+	if (uopt.prefetch_file) {
+		int res = manifest_path(path, uopt.prefetch_file);
+		if (!res) res = prefetch_load(path);
+
+		// a missing manifest is fine, e.g. on the first mount with -otrace=
+		if (res && res != -ENOENT) {
+			fprintf(stderr, "Failed to load manifest %s: %s. Aborting!\n",
+				uopt.prefetch_file, strerror(-res));
+			exit(1); // still early phase, we can abort
+		}
+	}
+
+	if (uopt.trace_file) {
+		int res = manifest_path(path, uopt.trace_file);
+		if (!res) res = trace_open_manifest(path);
+
+		if (res) {
+			fprintf(stderr, "Failed to open manifest %s: %s. Aborting!\n",
+				uopt.trace_file, strerror(-res));
+			exit(1);
+		}
+	}
+}
+
+static void *trace_timer(void *arg) {
+	sleep((uintptr_t)arg);
+	trace_stop();
+	return NULL;
+}
+
+/**
+ * Start recording, the manifest is written after seconds or on unmount,
+ * whatever comes first
+ */
+void trace_start(unsigned int seconds) {
+	if (trace_fd == -1) return;
+
+	__atomic_store_n(&recording, true, __ATOMIC_RELEASE);
+
+	pthread_t thread;
+	int res = pthread_create(&thread, NULL, trace_timer, (void *)(uintptr_t)seconds);
+	if (res) {
+		USYSLOG(LOG_WARNING, "Failed to start the trace timer: %s\n", strerror(res));
+		return; // recorded until unmount
+	}
+
+	pthread_detach(thread);
+}
+
+/**
+ * Record the open of path, which is on a ro-branch
+ */
+void trace_open(const char *path) {
+	if (!__atomic_load_n(&recording, __ATOMIC_ACQUIRE)) return;
+
+	// the manifest is line based
+	if (strpbrk(path, "\t\n")) return;
+
+	pthread_mutex_lock(&trace_lock);
+
+	if (!recording || cache_search(traced, path)) goto out;
+	if (count >= TRACE_MAX_FILES) goto out;
+
+	trace_file_t *f = new_file(path);
+	if (!f) goto out;
+
+	if (!cache_insert(traced, path, f)) {
+		free(f);
+		goto out;
+	}
+
+	*last = f;
+	last = &f->next;
+	count++;
+
+out:
+	pthread_mutex_unlock(&trace_lock);
+}
+
+/**
+ * Record the read of len bytes at offset from path, if trace_open() was
+ * called for it
+ */
+void trace_read(const char *path, off_t offset, size_t len) {
+	if (!__atomic_load_n(&recording, __ATOMIC_ACQUIRE) || !path || !len) return;
+
+	pthread_mutex_lock(&trace_lock);
+
+	if (recording) {
+		trace_file_t *f = cache_search(traced, path);
+		if (f) add_range(f, offset, offset + len);
+	}
+
+	pthread_mutex_unlock(&trace_lock);
+}
+
+/**
+ * Stop recording and write the manifest, only the first call does anything
+ */
+void trace_stop(void) {
+	pthread_mutex_lock(&trace_lock);
+
+	if (!recording) {
+		pthread_mutex_unlock(&trace_lock);
+		return;
+	}
+	recording = false;
+
+	trace_file_t *files = first;
+	first = NULL;
+	last = &first;
+	hashtable_destroy(traced, 0);
+	traced = NULL;
+
+	pthread_mutex_unlock(&trace_lock);
+
+	FILE *fp = fdopen(trace_fd, "w");
+	if (!fp) {
+		USYSLOG(LOG_ERR, "Failed to write the trace manifest: %s\n", strerror(errno));
+		close(trace_fd);
+		free_files(files);
+		return;
+	}
+
+	trace_file_t *f;
+	for (f = files; f; f = f->next) {
+		fprintf(fp, "%s\t", f->path);
+
+		unsigned int i;
+		for (i = 0; i < f->nranges; i++) {
+			fprintf(fp, "%s%jd-%jd", i ? " " : "",
+				(intmax_t)f->ranges[i].start, (intmax_t)f->ranges[i].end);
+		}
+		fputc('\n', fp);
+	}
+
+	if (fclose(fp)) {
+		USYSLOG(LOG_ERR, "Failed to write the trace manifest: %s\n", strerror(errno));
+	} else {
+		USYSLOG(LOG_INFO, "Wrote the trace manifest of %u files\n", count);
+	}
+
+	free_files(files);
+}
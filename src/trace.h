@@ -0,0 +1,21 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <sys/types.h>
+
+#define TRACE_TIME_DEFAULT 60	// seconds to record after mount
+
+void trace_init(void);
+void prefetch_start(void);
+void trace_start(unsigned int seconds);
+void trace_open(const char *path);
+void trace_read(const char *path, off_t offset, size_t len);
+void trace_stop(void);
+
+#endif
@@ -7,16 +7,86 @@
 #ifndef UIOCTL_H_
 #define UIOCTL_H_
 
+#include <stdint.h>
 #include <sys/ioctl.h>
 
 #include "unionfs.h"
 
 
-enum unionfs_ioctls {
+// statistics of a mount, see UNIONFS_GET_STATS
+struct unionfs_stats {
+	uint64_t symlink_cache_hits;
+	uint64_t symlink_cache_misses;
+	uint64_t dir_cache_hits;	// lookups answered from a directory listing
+	uint64_t dir_cache_misses;
+	uint64_t path_lock_acquired;
+	uint64_t path_lock_contended;	// had to wait for another operation
+	uint64_t path_lock_wait_ns;	// total time spent waiting
+	uint64_t drop_behind_bytes;	// page cache of branches dropped behind streams
+	uint64_t peer_invalidations;	// changes of other mounts applied to our caches
+};
+
+// modes of a branch, see UNIONFS_ADD_BRANCH and UNIONFS_SET_BRANCH_MODE
+enum unionfs_branch_mode {
+	UNIONFS_BRANCH_RO,
+	UNIONFS_BRANCH_RW,
+	UNIONFS_BRANCH_MEM,
+	UNIONFS_BRANCH_IMMUTABLE,
+};
+
+// a branch to add to a running mount, see UNIONFS_ADD_BRANCH
+struct unionfs_branch {
+	int32_t index;		// position, 0 is the top, -1 the bottom
+	int32_t mode;		// enum unionfs_branch_mode
+	char path[PATHLEN_MAX];	// absolute, within the chroot if any
+};
+
+// one result of UNIONFS_BULK_STAT, followed by the name it was found by
+struct unionfs_stat_record {
+	uint16_t reclen;	// of the record including its name, a multiple of 8
+	uint16_t namelen;	// without the terminating '\0'
+	int32_t error;		// errno of the lookup, all below is only valid if 0
+	int32_t branch;		// index of the branch the file is served from
+	uint32_t mode;
+	uint32_t nlink;
+	uint32_t uid;
+	uint32_t gid;
+	uint32_t atime_nsec;
+	uint32_t mtime_nsec;
+	uint32_t ctime_nsec;
+	uint64_t ino;
+	uint64_t size;
+	uint64_t blocks;
+	uint64_t rdev;
+	int64_t atime;
+	int64_t mtime;
+	int64_t ctime;
+	char name[];
+};
+
+#define UNIONFS_BULK_SIZE 12288	// the size of an ioctl is limited to 14 bits
+#define UNIONFS_BULK_DIR 1	// stat the entries of the directory
+
+// attributes of many files at once, see UNIONFS_BULK_STAT
+struct unionfs_bulk_stat {
+	uint32_t flags;		// UNIONFS_BULK_DIR
+	uint32_t count;		// in: number of names, out: number of records
+	uint64_t offset;	// UNIONFS_BULK_DIR only, in: entries to skip, out: where to go on, 0 at the end
+	char buf[UNIONFS_BULK_SIZE];	// in: '\0' terminated names, relative to the file of the ioctl, out: records
+};
+
+typedef enum unionfs_ioctls {
 	UNIONFS_ONOFF_DEBUG         = _IOW('E', 0, int),
 	UNIONFS_SET_DEBUG_FILE      = _IOW('E', 1, char[PATHLEN_MAX]),
 	UNIONFS_STATS_BYTES_READ    = _IOW('E', 2, void),
 	UNIONFS_STATS_BYTES_WRITTEN = _IOW('E', 3, void),
+	UNIONFS_GET_STATS           = _IOR('E', 4, struct unionfs_stats),
+	UNIONFS_ADD_BRANCH          = _IOW('E', 5, struct unionfs_branch),
+	UNIONFS_REMOVE_BRANCH       = _IOW('E', 6, int32_t),          // index
+	UNIONFS_MOVE_BRANCH         = _IOW('E', 7, int32_t[2]),       // index, new index
+	UNIONFS_SET_BRANCH_MODE     = _IOW('E', 8, int32_t[2]),       // index, mode
+	UNIONFS_BULK_STAT           = _IOWR('E', 9, struct unionfs_bulk_stat),
+	UNIONFS_RELOAD_POLICY       = _IO('E', 10),
 } unionfs_ioctls_t;
 
 #endif // UIOCTL_H_
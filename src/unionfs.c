@@ -32,6 +32,7 @@
 #include <sys/types.h>
 #include <sys/time.h>
 #include <inttypes.h>
+#include <signal.h>
 #include <asm/ioctl.h>
 
 #ifdef linux
@@ -58,6 +59,22 @@
 #include "usyslog.h"
 #include "conf.h"
 #include "uioctl.h"
+#include "cache.h"
+#include "xattr_cache.h"
+#include "symlink_cache.h"
+#include "dircache.h"
+#include "prewarm.h"
+#include "policy.h"
+#include "trace.h"
+#include "peers.h"
+#include "statfs.h"
+#include "branch.h"
+#include "reconf.h"
+#include "pathlock.h"
+#include "bulkstat.h"
+
+// the branch_file_t of an open file
+#define FILE_OF(fi) ((branch_file_t *)(uintptr_t)(fi)->fh)
 
 #ifndef _IOC_SIZE
 #ifdef IOCPARM_LEN
@@ -71,17 +88,32 @@ static struct fuse_opt unionfs_opts[] = {
 	FUSE_OPT_KEY("chroot=%s,", KEY_CHROOT),
 	FUSE_OPT_KEY("cow", KEY_COW),
 	FUSE_OPT_KEY("debug_file=%s", KEY_DEBUG_FILE),
+	FUSE_OPT_KEY("dir_cache", KEY_DIR_CACHE),
 	FUSE_OPT_KEY("dirs=%s", KEY_DIRS),
+	FUSE_OPT_KEY("drop_behind", KEY_DROP_BEHIND),
 	FUSE_OPT_KEY("--help", KEY_HELP),
 	FUSE_OPT_KEY("-h", KEY_HELP),
 	FUSE_OPT_KEY("hide_meta_dir", KEY_HIDE_METADIR),
 	FUSE_OPT_KEY("hide_meta_files", KEY_HIDE_META_FILES),
+	FUSE_OPT_KEY("hide_patterns=%s", KEY_HIDE_PATTERNS),
+	FUSE_OPT_KEY("index_dir=%s", KEY_INDEX_DIR),
 	FUSE_OPT_KEY("max_files=%s", KEY_MAX_FILES),
+	FUSE_OPT_KEY("mem_size=%s", KEY_MEM_SIZE),
+	FUSE_OPT_KEY("mem_spill=%s", KEY_MEM_SPILL),
 	FUSE_OPT_KEY("noinitgroups", KEY_NOINITGROUPS),
+	FUSE_OPT_KEY("peers=%s", KEY_PEERS),
+	FUSE_OPT_KEY("policy=%s", KEY_POLICY),
+	FUSE_OPT_KEY("prefetch=%s", KEY_PREFETCH),
+	FUSE_OPT_KEY("prewarm", KEY_PREWARM),
 	FUSE_OPT_KEY("relaxed_permissions", KEY_RELAXED_PERMISSIONS),
+	FUSE_OPT_KEY("statfs_cache=%s", KEY_STATFS_CACHE),
 	FUSE_OPT_KEY("statfs_omit_ro", KEY_STATFS_OMIT_RO),
+	FUSE_OPT_KEY("symlink_cache", KEY_SYMLINK_CACHE),
+	FUSE_OPT_KEY("trace=%s", KEY_TRACE),
+	FUSE_OPT_KEY("trace_time=%s", KEY_TRACE_TIME),
 	FUSE_OPT_KEY("--version", KEY_VERSION),
 	FUSE_OPT_KEY("-V", KEY_VERSION),
+	FUSE_OPT_KEY("xattr_cache", KEY_XATTR_CACHE),
 	FUSE_OPT_END
 };
 
@@ -91,10 +123,10 @@ static int unionfs_chmod(const char *path, mode_t mode) {
 	int i = find_rw_branch_cow(path);
 	if (i == -1) RETURN(-errno);
 
-	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
-
-	int res = chmod(p, mode);
+	int res = branch_chmod(i, path, mode);
+	// chmod() also rewrites the ACL, which is an extended attribute
+	xattr_cache_invalidate(path);
+	peers_publish(path, false);
 	if (res == -1) RETURN(-errno);
 
 	RETURN(0);
@@ -106,10 +138,8 @@ static int unionfs_chown(const char *path, uid_t uid, gid_t gid) {
 	int i = find_rw_branch_cow(path);
 	if (i == -1) RETURN(-errno);
 
-	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
-
-	int res = lchown(p, uid, gid);
+	int res = branch_chown(i, path, uid, gid);
+	xattr_cache_kill_priv(path); // chown removes security.capability
 	if (res == -1) RETURN(-errno);
 
 	RETURN(0);
@@ -125,42 +155,146 @@ static int unionfs_create(const char *path, mode_t mode, struct fuse_file_info *
 	int i = find_rw_branch_cutlast(path);
 	if (i == -1) RETURN(-errno);
 
-	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
-
 	// NOTE: We should do:
 	//       Create the file with mode=0 first, otherwise we might create
 	//       a file as root + x-bit + suid bit set, which might be used for
 	//       security racing!
-	int res = open(p, fi->flags, 0);
-	if (res == -1) RETURN(-errno);
+	branch_file_t *file = malloc(sizeof(branch_file_t));
+	if (!file) RETURN(-ENOMEM);
+
+	if (branch_open(i, path, fi->flags, 0, file) == -1) {
+		int err = errno;
+		free(file);
+		RETURN(-err);
+	}
 
-	set_owner(p); // no error check, since creating the file succeeded
+	set_owner(i, path); // no error check, since creating the file succeeded
 
 	// NOW, that the file has the proper owner we may set the requested mode
-	fchmod(res, mode);
+	branch_chmod(i, path, mode);
 
-	fi->fh = res;
+	unsigned int policy = policy_of(path);
+	fi->direct_io = !!(policy & POLICY_DIRECT_IO);
+	fi->keep_cache = !!(policy & POLICY_KEEP_CACHE);
+	fi->fh = (uintptr_t)file;
 	remove_hidden(path, i);
+	cache_invalidate(path);
 
-	DBG("fd = %" PRIx64 "\n", fi->fh);
+	DBG("fd = %d\n", file->fd);
 	RETURN(0);
 }
 
 
+/**
+ * Open the copy of path on a rw-branch for the deferred copy-up of file,
+ * copying path up first if it is still on a ro-branch. With copy false we
+ * only look for a copy done by someone else. Returns NULL with errno set
+ * if there is no copy.
+ */
+static branch_file_t *open_copy(const char *path, branch_file_t *file, bool copy) {
+	branch_file_t *up = NULL;
+
+	reconf_enter();
+	path_lock(path, NULL);
+
+	int i;
+	if (copy) {
+		i = find_rw_branch_cow(path);
+	} else {
+		i = find_rorw_branch(path);
+		if (i != -1 && !uopt.branches[i].rw) {
+			i = -1;
+			errno = ENOENT;
+		}
+	}
+	if (i == -1) goto out;
+
+	up = malloc(sizeof(branch_file_t));
+	if (!up) {
+		errno = ENOMEM;
+		goto out;
+	}
+
+	if (branch_open(i, path, file->cow_flags & ~(O_CREAT | O_EXCL | O_TRUNC), 0, up) == -1) {
+		int err = errno;
+		free(up);
+		up = NULL;
+		errno = err;
+		goto out;
+	}
+
+	// another thread might have been faster, e.g. if path was renamed meanwhile
+	branch_file_t *other = NULL;
+	if (!__atomic_compare_exchange_n(&file->up, &other, up, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		branch_close(up);
+		free(up);
+		up = other;
+	}
+
+out:
+	path_unlock(path, NULL);
+	reconf_leave();
+	return up;
+}
+
+/**
+ * The file to read fi from. Lower files opened for writing read from the
+ * lower branch until they are copied up, see unionfs_open(). If another
+ * open of the same file copied it up in the meantime, we have to read that
+ * copy from now on.
+ */
+static branch_file_t *read_file(const char *path, struct fuse_file_info *fi) {
+	branch_file_t *file = FILE_OF(fi);
+	if (!file->cow_flags) return file;
+
+	branch_file_t *up = __atomic_load_n(&file->up, __ATOMIC_ACQUIRE);
+	if (up) return up;
+
+	unsigned long count = copy_up_count();
+	if (count == __atomic_load_n(&file->cow_seen, __ATOMIC_RELAXED) || !path) return file;
+
+	up = open_copy(path, file, false);
+	if (up) return up;
+
+	__atomic_store_n(&file->cow_seen, count, __ATOMIC_RELAXED);
+	return file;
+}
+
+/**
+ * The file to modify fi in, this does the deferred copy-up
+ */
+static branch_file_t *write_file(const char *path, struct fuse_file_info *fi) {
+	branch_file_t *file = FILE_OF(fi);
+	if (!file->cow_flags) return file;
+
+	branch_file_t *up = __atomic_load_n(&file->up, __ATOMIC_ACQUIRE);
+	if (up) return up;
+
+	// libfuse only omits the path with hard_remove, which we do not set
+	if (!path) {
+		errno = EIO;
+		return NULL;
+	}
+
+	return open_copy(path, file, true);
+}
+
 /**
  * flush may be called multiple times for an open file, this must not really
  * close the file. This is important if used on a network filesystem like NFS
  * which flush the data/metadata on close()
  */
 static int unionfs_flush(const char *path, struct fuse_file_info *fi) {
-	DBG("fd = %"PRIx64"\n", fi->fh);
+	branch_file_t *file = read_file(NULL, fi);
+	DBG("fd = %d\n", file->fd);
+
+	if (file->fd == -1) RETURN(0); // nothing to flush for memory backed files
 
-	int fd = dup(fi->fh);
+	int fd = dup(file->fd);
 
 	if (fd == -1) {
 		// What to do now?
-		if (fsync(fi->fh) == -1) RETURN(-EIO);
+		if (fsync(file->fd) == -1) RETURN(-EIO);
 
 		RETURN(-errno);
 	}
@@ -175,17 +309,20 @@ static int unionfs_flush(const char *path, struct fuse_file_info *fi) {
  * Just a stub. This method is optional and can safely be left unimplemented
  */
 static int unionfs_fsync(const char *path, int isdatasync, struct fuse_file_info *fi) {
-	DBG("fd = %"PRIx64"\n", fi->fh);
+	branch_file_t *file = read_file(NULL, fi);
+	DBG("fd = %d\n", file->fd);
+
+	if (file->fd == -1) RETURN(0);
 
 	int res;
 	if (isdatasync) {
 #if _POSIX_SYNCHRONIZED_IO + 0 > 0
-		res = fdatasync(fi->fh);
+		res = fdatasync(file->fd);
 #else
-		res = fsync(fi->fh);
+		res = fsync(file->fd);
 #endif
 	} else {
-		res = fsync(fi->fh);
+		res = fsync(file->fd);
 	}
 
 	if (res == -1)  RETURN(-errno);
@@ -196,23 +333,8 @@ static int unionfs_fsync(const char *path, int isdatasync, struct fuse_file_info
 static int unionfs_getattr(const char *path, struct stat *stbuf) {
 	DBG("%s\n", path);
 
-	int i = find_rorw_branch(path);
-	if (i == -1) RETURN(-errno);
-
-	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
-
-	int res = lstat(p, stbuf);
-	if (res == -1) RETURN(-errno);
-
-	/* This is a workaround for broken gnu find implementations. Actually,
-	 * n_links is not defined at all for directories by posix. However, it
-	 * seems to be common for filesystems to set it to one if the actual value
-	 * is unknown. Since nlink_t is unsigned and since these broken implementations
-	 * always substract 2 (for . and ..) this will cause an underflow, setting
-	 * it to max(nlink_t).
-	 */
-	if (S_ISDIR(stbuf->st_mode)) stbuf->st_nlink = 1;
+	int res = union_lstat(path, stbuf);
+	if (res < 0) RETURN(res);
 
 	RETURN(0);
 }
@@ -241,14 +363,30 @@ static void * unionfs_init(struct fuse_conn_info *conn) {
 		conn->want |= FUSE_CAP_IOCTL_DIR;
 #endif
 
+	statfs_init();
+	if (uopt.prewarm) prewarm_start();
+	if (uopt.prefetch_file) prefetch_start();
+	if (uopt.trace_file) trace_start(uopt.trace_time);
+	peers_start();
+
 	return NULL;
 }
 
+/**
+ * destroy method
+ * called on unmount
+ */
+static void unionfs_destroy(void *private_data) {
+	(void)private_data;
+
+	trace_stop();
+}
+
 static int unionfs_link(const char *from, const char *to) {
 	DBG("from %s to %s\n", from, to);
 
 	// hardlinks do not work across different filesystems so we need a copy of from first
-	int i = find_rw_branch_cow(from);
+	int i = find_rw_branch_cow_link(from);
 	if (i == -1) RETURN(-errno);
 
 	int j = __find_rw_branch_cutlast(to, i);
@@ -256,22 +394,32 @@ static int unionfs_link(const char *from, const char *to) {
 
 	DBG("from branch: %d to branch: %d\n", i, j);
 
-	char f[PATHLEN_MAX], t[PATHLEN_MAX];
-	if (BUILD_PATH(f, uopt.branches[i].path, from)) RETURN(-ENAMETOOLONG);
-	if (BUILD_PATH(t, uopt.branches[j].path, to)) RETURN(-ENAMETOOLONG);
+	if (i != j) RETURN(-EXDEV);
 
-	int res = link(f, t);
+	int res = branch_link(i, from, to);
 	if (res == -1) RETURN(-errno);
 
 	// no need for set_owner(), since owner and permissions are copied over by link()
 
 	remove_hidden(to, i); // remove hide file (if any)
+	cache_invalidate(to);
+	// from has more than one name now, so its attributes are not cached any more
+	xattr_cache_invalidate(from);
 	RETURN(0);
 }
 
 #if FUSE_VERSION >= 28
+/**
+ * Only root and the user running us may change the branches, anyone else
+ * could make arbitrary directories visible with our permissions.
+ */
+static bool may_reconf(void) {
+	uid_t uid = fuse_get_context()->uid;
+
+	return uid == 0 || uid == getuid();
+}
+
 static int unionfs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *data) {
-	(void) path;
 	(void) arg; // avoid compiler warning
 	(void) fi;  // avoid compiler warning
 
@@ -300,6 +448,46 @@ static int unionfs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_
 		debug_init();
 		return 0;
 	}
+	case UNIONFS_GET_STATS: {
+		struct unionfs_stats *stats = data;
+
+		memset(stats, 0, sizeof(*stats));
+		symlink_cache_stats(stats);
+		dircache_stats(stats);
+		path_lock_stats(stats);
+		branch_stats(stats);
+		peers_stats(stats);
+		return 0;
+	}
+	case UNIONFS_ADD_BRANCH: {
+		struct unionfs_branch *branch = data;
+
+		if (!may_reconf()) return -EPERM;
+		branch->path[sizeof(branch->path) - 1] = '\0';
+		return reconf_add_branch(branch->index, branch->path, branch->mode);
+	}
+	case UNIONFS_REMOVE_BRANCH:
+		if (!may_reconf()) return -EPERM;
+		return reconf_remove_branch(*(int32_t *)data);
+	case UNIONFS_MOVE_BRANCH: {
+		int32_t *args = data;
+
+		if (!may_reconf()) return -EPERM;
+		return reconf_move_branch(args[0], args[1]);
+	}
+	case UNIONFS_SET_BRANCH_MODE: {
+		int32_t *args = data;
+
+		if (!may_reconf()) return -EPERM;
+		return reconf_set_mode(args[0], args[1]);
+	}
+	case UNIONFS_BULK_STAT:
+		// lookups are not checked against the permissions of the caller
+		if (!may_reconf()) return -EPERM;
+		return bulk_stat(path, data);
+	case UNIONFS_RELOAD_POLICY:
+		if (!may_reconf()) return -EPERM;
+		return policy_reload();
 	default:
 		USYSLOG(LOG_ERR, "Unknown ioctl: %d", cmd);
 		return -EINVAL;
@@ -322,15 +510,14 @@ static int unionfs_mkdir(const char *path, mode_t mode) {
 	int i = find_rw_branch_cutlast(path);
 	if (i == -1) RETURN(-errno);
 
-	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
-
-	int res = mkdir(p, 0);
+	int res = branch_mkdir(i, path, 0);
 	if (res == -1) RETURN(-errno);
 
-	set_owner(p); // no error check, since creating the file succeeded
+	set_owner(i, path); // no error check, since creating the file succeeded
 	// NOW, that the file has the proper owner we may set the requested mode
-	chmod(p, mode);
+	branch_chmod(i, path, mode);
+
+	cache_invalidate(path);
 
 	RETURN(0);
 }
@@ -341,9 +528,6 @@ static int unionfs_mknod(const char *path, mode_t mode, dev_t rdev) {
 	int i = find_rw_branch_cutlast(path);
 	if (i == -1) RETURN(-errno);
 
-	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
-
 	int file_type = mode & S_IFMT;
 	int file_perm = mode & (S_PROT_MASK);
 
@@ -356,92 +540,292 @@ static int unionfs_mknod(const char *path, mode_t mode, dev_t rdev) {
 
 		USYSLOG (LOG_INFO, "deprecated mknod workaround, tell the unionfs-fuse authors if you see this!\n");
 
-		res = creat(p, 0);
-		if (res > 0 && close(res) == -1) USYSLOG(LOG_WARNING, "Warning, cannot close file\n");
+		branch_file_t file;
+		res = branch_open(i, path, O_WRONLY | O_CREAT | O_TRUNC, 0, &file);
+		if (res == 0 && branch_close(&file) == -1) USYSLOG(LOG_WARNING, "Warning, cannot close file\n");
 	} else {
-		res = mknod(p, file_type, rdev);
+		res = branch_mknod(i, path, file_type, rdev);
 	}
 
 	if (res == -1) RETURN(-errno);
 
-	set_owner(p); // no error check, since creating the file succeeded
+	set_owner(i, path); // no error check, since creating the file succeeded
 	// NOW, that the file has the proper owner we may set the requested mode
-	chmod(p, file_perm);
+	branch_chmod(i, path, file_perm);
 
 	remove_hidden(path, i);
+	cache_invalidate(path);
 
 	RETURN(0);
 }
 
+/**
+ * Check if the open of path for writing may read from its lower branch
+ * until the first modification. Programs often open files O_RDWR and never
+ * write, e.g. sqlite readers, which then saves the whole copy-up. Returns
+ * the branch of path or -1 if it has to be opened on a rw-branch.
+ */
+static int defer_copy_up(const char *path, int flags) {
+	if (!uopt.cow_enabled || (flags & O_TRUNC)) return -1;
+
+	int i = find_rorw_branch(path);
+	if (i == -1 || uopt.branches[i].rw) return -1;
+
+	// without a rw-branch to copy to, the open has to fail right away
+	if (find_lowest_rw_branch(i) == -1) return -1;
+
+	struct stat st;
+	if (branch_lstat(i, path, &st) == -1 || !S_ISREG(st.st_mode)) return -1;
+
+	return i;
+}
+
 static int unionfs_open(const char *path, struct fuse_file_info *fi) {
 	DBG("%s\n", path);
 
 	int i;
+	int flags = fi->flags;
+	unsigned int policy = policy_of(path);
+	bool deferred = false;
+	unsigned long seen = 0;
 	if (fi->flags & (O_WRONLY | O_RDWR)) {
-		i = find_rw_branch_cutlast(path);
+		// copies made after this are found by read_file()
+		seen = copy_up_count();
+		i = (policy & POLICY_COW_OPEN) ? -1 : defer_copy_up(path, fi->flags);
+		if (i != -1) {
+			deferred = true;
+			flags = (flags & ~(O_ACCMODE | O_CREAT | O_EXCL | O_APPEND)) | O_RDONLY;
+		} else {
+			i = find_rw_branch_cutlast(path);
+		}
 	} else {
 		i = find_rorw_branch(path);
 	}
 
 	if (i == -1) RETURN(-errno);
 
-	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
+	branch_file_t *file = malloc(sizeof(branch_file_t));
+	if (!file) RETURN(-ENOMEM);
+
+	if (branch_open(i, path, flags, 0, file) == -1) {
+		int err = errno;
+		free(file);
+		RETURN(-err);
+	}
 
-	int fd = open(p, fi->flags);
-	if (fd == -1) RETURN(-errno);
+	if (!uopt.branches[i].rw) trace_open(path);
 
-	if (fi->flags & (O_WRONLY | O_RDWR)) {
+	if (deferred) {
+		file->cow_flags = fi->flags;
+		file->cow_seen = seen;
+	} else if (fi->flags & (O_WRONLY | O_RDWR)) {
 		// There might have been a hide file, but since we successfully
 		// wrote to the real file, a hide file must not exist anymore
 		remove_hidden(path, i);
 	}
 
-	// This makes exec() fail
-	//fi->direct_io = 1;
-	fi->fh = (unsigned long)fd;
+	if (fi->flags & O_TRUNC) {
+		xattr_cache_kill_priv(path);
+		statfs_invalidate();
+	}
 
-	DBG("fd = %"PRIx64"\n", fi->fh);
+	// This makes exec() fail, so only where the policy asks for it
+	fi->direct_io = !!(policy & POLICY_DIRECT_IO);
+	// Files of immutable branches never change, so whatever the kernel
+	// cached from an earlier open is still valid and served without us.
+	// Modifications through the union go through that cache as well.
+	// After branches were added, removed or moved, path might be another
+	// file though.
+	fi->keep_cache = ((policy & POLICY_KEEP_CACHE) || uopt.branches[i].immutable) && !reconf_first_open(path);
+	fi->fh = (uintptr_t)file;
+
+	DBG("fd = %d\n", file->fd);
 	RETURN(0);
 }
 
 static int unionfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-	DBG("fd = %"PRIx64"\n", fi->fh);
+	branch_file_t *file = read_file(path, fi);
+	DBG("fd = %d\n", file->fd);
 
-	int res = pread(fi->fh, buf, size, offset);
+	int res = branch_read(file, buf, size, offset);
 
 	if (res == -1) RETURN(-errno);
 
+	trace_read(path, offset, res);
+
 	RETURN(res);
 }
 
 static int unionfs_readlink(const char *path, char *buf, size_t size) {
 	DBG("%s\n", path);
 
+	if (symlink_cache_get(path, buf, size)) RETURN(0);
+
+	unsigned int gen = symlink_cache_generation();
+
 	int i = find_rorw_branch(path);
 	if (i == -1) RETURN(-errno);
 
-	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
-
-	int res = readlink(p, buf, size - 1);
+	int res = branch_readlink(i, path, buf, size - 1);
 
 	if (res == -1) RETURN(-errno);
 
 	buf[res] = '\0';
 
+	// do not cache truncated targets
+	if ((size_t)res < size - 1) symlink_cache_set(path, i, buf, gen);
+
 	RETURN(0);
 }
 
 static int unionfs_release(const char *path, struct fuse_file_info *fi) {
-	DBG("fd = %"PRIx64"\n", fi->fh);
+	branch_file_t *file = FILE_OF(fi);
+	DBG("fd = %d\n", file->fd);
 
-	int res = close(fi->fh);
+	int res = branch_close(file);
+	if (file->up) {
+		if (branch_close(file->up) == -1) res = -1;
+		free(file->up);
+	}
+	free(file);
 	if (res == -1) RETURN(-errno);
 
 	RETURN(0);
 }
 
+// temporary copies of renames found by collect_rename_leftover()
+struct rename_leftovers {
+	char **names;
+	int count;
+};
+
+static int collect_rename_leftover(void *priv, const char *name, ino_t ino, unsigned char type) {
+	(void)ino;
+	(void)type;
+
+	struct rename_leftovers *state = priv;
+
+	if (strncmp(name, RENAME_TMP, strlen(RENAME_TMP)) != 0) return 0;
+
+	// the rename might still be running in another mount of this branch
+	int pid = atoi(name + strlen(RENAME_TMP));
+	if (pid > 0 && (kill(pid, 0) == 0 || errno == EPERM)) return 0;
+
+	char **names = realloc(state->names, (state->count + 1) * sizeof(char *));
+	if (!names) return 0;
+	state->names = names;
+
+	state->names[state->count] = strdup(name);
+	if (state->names[state->count]) state->count++;
+
+	return 0;
+}
+
+/**
+ * Remove the copies of renames which did not complete, e.g. as we crashed
+ */
+static void remove_rename_leftovers(void) {
+	int i;
+	for (i = 0; i < uopt.nbranches; i++) {
+		if (!uopt.branches[i].rw) continue;
+
+		struct rename_leftovers state = { NULL, 0 };
+		branch_readdir(i, "/" METANAME, collect_rename_leftover, &state);
+
+		int n;
+		for (n = 0; n < state.count; n++) {
+			char p[PATHLEN_MAX];
+			if (!BUILD_PATH(p, "/" METANAME "/", state.names[n])) {
+				USYSLOG(LOG_INFO, "removing %s%s left over by a rename\n", uopt.branches[i].path, p);
+				remove_tree(i, p);
+			}
+			free(state.names[n]);
+		}
+		free(state.names);
+	}
+}
+
+/**
+ * rename() from on branch i to to on the rw-branch j, which rename(2) can
+ * not do for us. If both are on the same filesystem we still simply
+ * rename(), otherwise from is copied (see copy_file(), which uses reflinks
+ * and copy_file_range() if possible) to a temporary name within the meta
+ * directory of branch j, which then replaces to atomically. The original
+ * is removed or hidden afterwards.
+ */
+static int rename_across(const char *from, int i, const char *to, int j) {
+	DBG("from %s on %d to %s on %d\n", from, i, to, j);
+
+	struct stat from_st, to_st;
+	if (branch_lstat(i, from, &from_st) == -1) RETURN(-errno);
+	bool is_dir = S_ISDIR(from_st.st_mode);
+
+	// checks rename(2) would do for us, before we copy for nothing
+	size_t len = strlen(from);
+	if (is_dir && strncmp(from, to, len) == 0 && to[len] == '/') RETURN(-EINVAL);
+	if (branch_lstat(j, to, &to_st) == 0) {
+		if (is_dir && !S_ISDIR(to_st.st_mode)) RETURN(-ENOTDIR);
+		if (!is_dir && S_ISDIR(to_st.st_mode)) RETURN(-EISDIR);
+	}
+
+	int lowest_rw = -1;
+	if (!uopt.branches[i].rw) {
+		// the original stays, so it needs to be hidden
+		lowest_rw = find_lowest_rw_branch(i);
+		if (lowest_rw == -1) RETURN(-EROFS);
+	}
+
+	int res = -1;
+	if (uopt.branches[i].rw) {
+		res = branch_move(i, from, j, to);
+		if (res == -1 && errno != EXDEV) RETURN(-errno);
+	}
+
+	if (res == -1) {
+		static unsigned int seq;
+
+		// the copy is made within the hidden meta directory of the target
+		// branch, so it is never visible before it is complete
+		char tmp[PATHLEN_MAX];
+		snprintf(tmp, sizeof(tmp), "/" METANAME "/" RENAME_TMP "%d-%u",
+		         (int)getpid(), __atomic_add_fetch(&seq, 1, __ATOMIC_RELAXED));
+
+		if (branch_mkdir(j, "/" METANAME, S_IRWXU) == -1 && errno != EEXIST) RETURN(-errno);
+
+		errno = 0;
+		if (cow_cp_to(from, i, tmp, j)) {
+			int err = errno ? errno : EIO;
+			remove_tree(j, tmp);
+			RETURN(-err);
+		}
+
+		if (branch_rename(j, tmp, to) == -1) {
+			int err = errno;
+			remove_tree(j, tmp);
+			RETURN(-err);
+		}
+
+		if (uopt.branches[i].rw && remove_tree(i, from)) {
+			USYSLOG(LOG_ERR, "%s: copied %s to branch %d, but removing the original from "
+			       "branch %d failed: %s\n", __func__, from, j, i, strerror(errno));
+		}
+	}
+
+	if (lowest_rw != -1) {
+		res = is_dir ? hide_dir(from, lowest_rw) : hide_file(from, lowest_rw);
+	} else {
+		// a lower branch still *might* have a file called 'from'
+		res = maybe_whiteout(from, i, is_dir ? WHITEOUT_DIR : WHITEOUT_FILE);
+	}
+	if (res) USYSLOG(LOG_ERR, "%s: hiding %s failed\n", __func__, from);
+
+	cache_invalidate_tree(from);
+	cache_invalidate_tree(to);
+
+	remove_hidden(to, j); // remove hide file (if any)
+	RETURN(0);
+}
+
 /**
  * unionfs rename function
  * TODO: If we rename a directory on a read-only branch, we need to copy over
@@ -458,22 +842,19 @@ static int unionfs_rename(const char *from, const char *to) {
 	int i = find_rorw_branch(from);
 	if (i == -1) RETURN(-errno);
 
+	// copy from right to where to is going to be
+	if (!uopt.branches[i].rw && uopt.cow_enabled && find_lowest_rw_branch(i) != j) {
+		RETURN(rename_across(from, i, to, j));
+	}
+
 	if (!uopt.branches[i].rw) {
 		i = find_rw_branch_cow_common(from, true);
 		if (i == -1) RETURN(-errno);
 	}
 
-	if (i != j) {
-		USYSLOG(LOG_ERR, "%s: from and to are on different writable branches %d vs %d, which"
-		       "is not supported yet.\n", __func__, i, j);
-		RETURN(-EXDEV);
-	}
+	if (i != j) RETURN(rename_across(from, i, to, j));
 
-	char f[PATHLEN_MAX], t[PATHLEN_MAX];
-	if (BUILD_PATH(f, uopt.branches[i].path, from)) RETURN(-ENAMETOOLONG);
-	if (BUILD_PATH(t, uopt.branches[i].path, to)) RETURN(-ENAMETOOLONG);
-
-	filetype_t ftype = path_is_dir(f);
+	filetype_t ftype = path_is_dir(i, from);
 	if (ftype == NOT_EXISTING)
 		RETURN(-ENOENT);
 	else if (ftype == IS_DIR)
@@ -490,13 +871,16 @@ static int unionfs_rename(const char *from, const char *to) {
 		if (res) RETURN(-errno);
 	}
 
-	res = rename(f, t);
+	res = branch_rename(i, from, to);
+
+	cache_invalidate_tree(from);
+	cache_invalidate_tree(to);
 
 	if (res == -1) {
 		int err = errno; // unlink() might overwrite errno
 		// if from was on a read-only branch we copied it, but now rename failed so we need to delete it
 		if (!uopt.branches[i].rw) {
-			if (unlink(f))
+			if (branch_unlink(i, from))
 				USYSLOG(LOG_ERR, "%s: cow of %s succeeded, but rename() failed and now "
 				       "also unlink()  failed\n", __func__, from);
 
@@ -521,52 +905,6 @@ static int unionfs_rename(const char *from, const char *to) {
 	RETURN(0);
 }
 
-/**
- * Wrapper function to convert the result of statfs() to statvfs()
- * libfuse uses statvfs, since it conforms to POSIX. Unfortunately,
- * glibc's statvfs parses /proc/mounts, which then results in reading
- * the filesystem itself again - which would result in a deadlock.
- * TODO: BSD/MacOSX
- */
-static int statvfs_local(const char *path, struct statvfs *stbuf) {
-#ifdef linux
-	/* glibc's statvfs walks /proc/mounts and stats entries found there
-	 * in order to extract their mount flags, which may deadlock if they
-	 * are mounted under the unionfs. As a result, we have to do this
-	 * ourselves.
-	 */
-	struct statfs stfs;
-	int res = statfs(path, &stfs);
-	if (res == -1) RETURN(res);
-
-	memset(stbuf, 0, sizeof(*stbuf));
-	stbuf->f_bsize = stfs.f_bsize;
-	if (stfs.f_frsize) {
-		stbuf->f_frsize = stfs.f_frsize;
-	} else {
-		stbuf->f_frsize = stfs.f_bsize;
-	}
-	stbuf->f_blocks = stfs.f_blocks;
-	stbuf->f_bfree = stfs.f_bfree;
-	stbuf->f_bavail = stfs.f_bavail;
-	stbuf->f_files = stfs.f_files;
-	stbuf->f_ffree = stfs.f_ffree;
-	stbuf->f_favail = stfs.f_ffree; /* nobody knows */
-
-	/* We don't worry about flags, exactly because this would
-	 * require reading /proc/mounts, and avoiding that and the
-	 * resulting deadlocks is exactly what we're trying to avoid
-	 * by doing this rather than using statvfs.
-	 */
-	stbuf->f_flag = 0;
-	stbuf->f_namemax = stfs.f_namelen;
-
-	RETURN(0);
-#else
-	RETURN(statvfs(path, stbuf));
-#endif
-}
-
 /**
  * statvs implementation
  *
@@ -577,70 +915,7 @@ static int unionfs_statfs(const char *path, struct statvfs *stbuf) {
 
 	DBG("%s\n", path);
 
-	int first = 1;
-
-	dev_t devno[uopt.nbranches];
-
-	int retVal = 0;
-
-	int i = 0;
-	for (i = 0; i < uopt.nbranches; i++) {
-		struct statvfs stb;
-		int res = statvfs_local(uopt.branches[i].path, &stb);
-		if (res == -1) {
-			retVal = -errno;
-			break;
-		}
-
-		struct stat st;
-		res = stat(uopt.branches[i].path, &st);
-		if (res == -1) {
-			retVal = -errno;
-			break;
-		}
-		devno[i] = st.st_dev;
-
-		if (first) {
-			memcpy(stbuf, &stb, sizeof(*stbuf));
-			first = 0;
-			stbuf->f_fsid = stb.f_fsid << 8;
-			continue;
-		}
-
-		// Eliminate same devices
-		int j = 0;
-		for (j = 0; j < i; j ++) {
-			if (st.st_dev == devno[j]) break;
-		}
-
-		if (j == i) {
-			// Filesystem can have different block sizes -> normalize to first's block size
-			double ratio = (double)stb.f_bsize / (double)stbuf->f_bsize;
-
-			if (uopt.branches[i].rw) {
-				stbuf->f_blocks += stb.f_blocks * ratio;
-				stbuf->f_bfree += stb.f_bfree * ratio;
-				stbuf->f_bavail += stb.f_bavail * ratio;
-
-				stbuf->f_files += stb.f_files;
-				stbuf->f_ffree += stb.f_ffree;
-				stbuf->f_favail += stb.f_favail;
-			} else if (!uopt.statfs_omit_ro) {
-				// omitting the RO branches is not correct regarding
-				// the block counts but it actually fixes the
-				// percentage of free space. so, let the user decide.
-				stbuf->f_blocks += stb.f_blocks * ratio;
-				stbuf->f_files  += stb.f_files;
-			}
-
-			if (!(stb.f_flag & ST_RDONLY)) stbuf->f_flag &= ~ST_RDONLY;
-			if (!(stb.f_flag & ST_NOSUID)) stbuf->f_flag &= ~ST_NOSUID;
-
-			if (stb.f_namemax < stbuf->f_namemax) stbuf->f_namemax = stb.f_namemax;
-		}
-	}
-
-	RETURN(retVal);
+	RETURN(statfs_union(stbuf));
 }
 
 static int unionfs_symlink(const char *from, const char *to) {
@@ -649,15 +924,13 @@ static int unionfs_symlink(const char *from, const char *to) {
 	int i = find_rw_branch_cutlast(to);
 	if (i == -1) RETURN(-errno);
 
-	char t[PATHLEN_MAX];
-	if (BUILD_PATH(t, uopt.branches[i].path, to)) RETURN(-ENAMETOOLONG);
-
-	int res = symlink(from, t);
+	int res = branch_symlink(i, from, to);
 	if (res == -1) RETURN(-errno);
 
-	set_owner(t); // no error check, since creating the file succeeded
+	set_owner(i, to); // no error check, since creating the file succeeded
 
 	remove_hidden(to, i); // remove hide file (if any)
+	cache_invalidate(to);
 	RETURN(0);
 }
 
@@ -667,10 +940,9 @@ static int unionfs_truncate(const char *path, off_t size) {
 	int i = find_rw_branch_cow(path);
 	if (i == -1) RETURN(-errno);
 
-	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
-
-	int res = truncate(p, size);
+	int res = branch_truncate(i, path, size);
+	xattr_cache_kill_priv(path);
+	statfs_invalidate();
 
 	if (res == -1) RETURN(-errno);
 
@@ -683,33 +955,23 @@ static int unionfs_utimens(const char *path, const struct timespec ts[2]) {
 	int i = find_rw_branch_cow(path);
 	if (i == -1) RETURN(-errno);
 
-	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
-
-#ifdef UNIONFS_HAVE_AT
-	int res = utimensat(0, p, ts, AT_SYMLINK_NOFOLLOW);
-#else
-	struct timeval tv[2];
-	tv[0].tv_sec = ts[0].tv_sec;
-	tv[0].tv_usec = ts[0].tv_nsec / 1000;
-	tv[1].tv_sec = ts[1].tv_sec;
-	tv[1].tv_usec = ts[1].tv_nsec / 1000;
-	int res = utimes(p, tv);
-#endif
-
+	int res = branch_utimens(i, path, ts);
 	if (res == -1) RETURN(-errno);
 
 	RETURN(0);
 }
 
 static int unionfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-	(void)path;
+	branch_file_t *file = write_file(path, fi);
+	if (!file) RETURN(-errno);
+	DBG("fd = %d\n", file->fd);
 
-	DBG("fd = %"PRIx64"\n", fi->fh);
-
-	int res = pwrite(fi->fh, buf, size, offset);
+	int res = branch_write(file, buf, size, offset);
+	if (path) xattr_cache_kill_priv(path);
 	if (res == -1) RETURN(-errno);
 
+	statfs_written(res);
+
 	RETURN(res);
 }
 
@@ -722,19 +984,39 @@ static int unionfs_getxattr(const char *path, const char *name, char *value, siz
 #endif
 	DBG("%s\n", path);
 
+	int res;
+#if __APPLE__
+	if (position == 0 && xattr_cache_get(path, name, value, size, &res)) RETURN(res);
+#else
+	if (xattr_cache_get(path, name, value, size, &res)) RETURN(res);
+#endif
+
+	unsigned int gen = xattr_cache_generation();
+
 	int i = find_rorw_branch(path);
 	if (i == -1) RETURN(-errno);
 
+	// e.g. images do not store extended attributes
+	if (!uopt.branches[i].ops->xattrs) RETURN(-ENOATTR);
+
 	char p[PATHLEN_MAX];
 	if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
 
 #if __APPLE__
-	int res = getxattr(p, name, value, size, position, XATTR_NOFOLLOW);
+	res = getxattr(p, name, value, size, position, XATTR_NOFOLLOW);
+	if (position != 0) RETURN(res == -1 ? -errno : res);
 #else
-	int res = lgetxattr(p, name, value, size);
+	res = lgetxattr(p, name, value, size);
 #endif
 
-	if (res == -1) RETURN(-errno);
+	if (res == -1) {
+		res = -errno;
+		// the usual answer, e.g. for security.capability
+		if (res == -ENOATTR || res == -ENOTSUP) xattr_cache_set(path, i, name, NULL, 0, res, gen);
+		RETURN(res);
+	}
+
+	xattr_cache_set(path, i, name, value, size, res, gen);
 
 	RETURN(res);
 }
@@ -742,19 +1024,32 @@ static int unionfs_getxattr(const char *path, const char *name, char *value, siz
 static int unionfs_listxattr(const char *path, char *list, size_t size) {
 	DBG("%s\n", path);
 
+	int res;
+	if (xattr_cache_list_get(path, list, size, &res)) RETURN(res);
+
+	unsigned int gen = xattr_cache_generation();
+
 	int i = find_rorw_branch(path);
 	if (i == -1) RETURN(-errno);
 
+	if (!uopt.branches[i].ops->xattrs) RETURN(0); // no attributes at all
+
 	char p[PATHLEN_MAX];
 	if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
 
 #if __APPLE__
-	int res = listxattr(p, list, size, XATTR_NOFOLLOW);
+	res = listxattr(p, list, size, XATTR_NOFOLLOW);
 #else
-	int res = llistxattr(p, list, size);
+	res = llistxattr(p, list, size);
 #endif
 
-	if (res == -1) RETURN(-errno);
+	if (res == -1) {
+		res = -errno;
+		if (res == -ENOTSUP) xattr_cache_list_set(path, i, NULL, 0, res, gen);
+		RETURN(res);
+	}
+
+	xattr_cache_list_set(path, i, list, size, res, gen);
 
 	RETURN(res);
 }
@@ -765,6 +1060,9 @@ static int unionfs_removexattr(const char *path, const char *name) {
 	int i = find_rw_branch_cow(path);
 	if (i == -1) RETURN(-errno);
 
+	// e.g. memory branches do not store extended attributes
+	if (!uopt.branches[i].ops->xattrs) RETURN(-ENOTSUP);
+
 	char p[PATHLEN_MAX];
 	if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
 
@@ -773,6 +1071,8 @@ static int unionfs_removexattr(const char *path, const char *name) {
 #else
 	int res = lremovexattr(p, name);
 #endif
+	xattr_cache_invalidate(path);
+	peers_publish(path, false);
 
 	if (res == -1) RETURN(-errno);
 
@@ -789,6 +1089,8 @@ static int unionfs_setxattr(const char *path, const char *name, const char *valu
 	int i = find_rw_branch_cow(path);
 	if (i == -1) RETURN(-errno);
 
+	if (!uopt.branches[i].ops->xattrs) RETURN(-ENOTSUP);
+
 	char p[PATHLEN_MAX];
 	if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
 
@@ -797,6 +1099,8 @@ static int unionfs_setxattr(const char *path, const char *name, const char *valu
 #else
 	int res = lsetxattr(p, name, value, size, flags);
 #endif
+	xattr_cache_invalidate(path);
+	peers_publish(path, false);
 
 	if (res == -1) RETURN(-errno);
 
@@ -804,38 +1108,103 @@ static int unionfs_setxattr(const char *path, const char *name, const char *valu
 }
 #endif // HAVE_XATTR
 
+/*
+ * Operations using branch indices run within reconf_enter() and
+ * reconf_leave(), so branches are not added or removed under them.
+ * Operations modifying the union also hold the locks of the paths they
+ * modify (see pathlock.c), so that e.g. a copy-up and a rename of the same
+ * path do not interleave. Operations on open files need neither, see
+ * branch_file_t.
+ */
+#define WRAP(op, params, args, path1, path2) \
+	static int wrap_##op params { \
+		reconf_enter(); \
+		path_lock(path1, path2); \
+		int res = unionfs_##op args; \
+		path_unlock(path1, path2); \
+		reconf_leave(); \
+		return res; \
+	}
+
+WRAP(chmod, (const char *path, mode_t mode), (path, mode), path, NULL)
+WRAP(chown, (const char *path, uid_t uid, gid_t gid), (path, uid, gid), path, NULL)
+WRAP(create, (const char *path, mode_t mode, struct fuse_file_info *fi), (path, mode, fi), path, NULL)
+WRAP(getattr, (const char *path, struct stat *stbuf), (path, stbuf), NULL, NULL)
+WRAP(link, (const char *from, const char *to), (from, to), from, to)
+WRAP(mkdir, (const char *path, mode_t mode), (path, mode), path, NULL)
+WRAP(mknod, (const char *path, mode_t mode, dev_t rdev), (path, mode, rdev), path, NULL)
+WRAP(open, (const char *path, struct fuse_file_info *fi), (path, fi), (fi->flags & O_ACCMODE) == O_RDONLY ? NULL : path, NULL)
+WRAP(readlink, (const char *path, char *buf, size_t size), (path, buf, size), NULL, NULL)
+WRAP(readdir, (const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi),
+	(path, buf, filler, offset, fi), NULL, NULL)
+WRAP(rename, (const char *from, const char *to), (from, to), from, to)
+WRAP(rmdir, (const char *path), (path), path, NULL)
+WRAP(statfs, (const char *path, struct statvfs *stbuf), (path, stbuf), NULL, NULL)
+WRAP(symlink, (const char *from, const char *to), (from, to), to, NULL)
+WRAP(truncate, (const char *path, off_t size), (path, size), path, NULL)
+WRAP(unlink, (const char *path), (path), path, NULL)
+WRAP(utimens, (const char *path, const struct timespec ts[2]), (path, ts), path, NULL)
+#ifdef HAVE_XATTR
+#if __APPLE__
+WRAP(getxattr, (const char *path, const char *name, char *value, size_t size, uint32_t position),
+	(path, name, value, size, position), NULL, NULL)
+WRAP(setxattr, (const char *path, const char *name, const char *value, size_t size, int flags, uint32_t position),
+	(path, name, value, size, flags, position), path, NULL)
+#else
+WRAP(getxattr, (const char *path, const char *name, char *value, size_t size), (path, name, value, size), NULL, NULL)
+WRAP(setxattr, (const char *path, const char *name, const char *value, size_t size, int flags),
+	(path, name, value, size, flags), path, NULL)
+#endif
+WRAP(listxattr, (const char *path, char *list, size_t size), (path, list, size), NULL, NULL)
+WRAP(removexattr, (const char *path, const char *name), (path, name), path, NULL)
+#endif
+
+/**
+ * ftruncate() needs the deferred copy-up of unionfs_open() first, then it is
+ * just a truncate()
+ */
+static int unionfs_ftruncate(const char *path, off_t size, struct fuse_file_info *fi) {
+	DBG("%s\n", path);
+
+	if (!write_file(path, fi)) RETURN(-errno);
+
+	RETURN(wrap_truncate(path, size));
+}
+
 static struct fuse_operations unionfs_oper = {
-	.chmod = unionfs_chmod,
-	.chown = unionfs_chown,
-	.create = unionfs_create,
+	.chmod = wrap_chmod,
+	.chown = wrap_chown,
+	.create = wrap_create,
 	.flush = unionfs_flush,
 	.fsync = unionfs_fsync,
-	.getattr = unionfs_getattr,
+	.ftruncate = unionfs_ftruncate,
+	.getattr = wrap_getattr,
 	.init = unionfs_init,
+	.destroy = unionfs_destroy,
 #if FUSE_VERSION >= 28
 	.ioctl = unionfs_ioctl,
 #endif
-	.link = unionfs_link,
-	.mkdir = unionfs_mkdir,
-	.mknod = unionfs_mknod,
-	.open = unionfs_open,
+	.link = wrap_link,
+	.mkdir = wrap_mkdir,
+	.mknod = wrap_mknod,
+	.open = wrap_open,
 	.read = unionfs_read,
-	.readlink = unionfs_readlink,
-	.readdir = unionfs_readdir,
+	.readlink = wrap_readlink,
+	.readdir = wrap_readdir,
 	.release = unionfs_release,
-	.rename = unionfs_rename,
-	.rmdir = unionfs_rmdir,
-	.statfs = unionfs_statfs,
-	.symlink = unionfs_symlink,
-	.truncate = unionfs_truncate,
-	.unlink = unionfs_unlink,
-	.utimens = unionfs_utimens,
+	.rename = wrap_rename,
+	.rmdir = wrap_rmdir,
+	.statfs = wrap_statfs,
+	.symlink = wrap_symlink,
+	.truncate = wrap_truncate,
+	.unlink = wrap_unlink,
+	.utimens = wrap_utimens,
 	.write = unionfs_write,
 #ifdef HAVE_XATTR
-	.getxattr = unionfs_getxattr,
-	.listxattr = unionfs_listxattr,
-	.removexattr = unionfs_removexattr,
-	.setxattr = unionfs_setxattr,
+	.getxattr = wrap_getxattr,
+	.listxattr = wrap_listxattr,
+	.removexattr = wrap_removexattr,
+	.setxattr = wrap_setxattr,
 #endif
 };
 
@@ -877,6 +1246,12 @@ int main(int argc, char *argv[]) {
 		}
 	}
 	unionfs_post_opts();
+	remove_rename_leftovers();
+
+	if (uopt.xattr_cache) xattr_cache_init();
+	if (uopt.symlink_cache) symlink_cache_init();
+	if (uopt.dir_cache) dircache_init();
+	trace_init();
 
 #ifdef FUSE_CAP_BIG_WRITES
 	/* libfuse > 0.8 supports large IO, also for reads, to increase performance
@@ -12,6 +12,7 @@
 
 #define METANAME ".unionfs"
 #define METADIR (METANAME  "/") // string concetanation!
+#define RENAME_TMP ".unionfs-rename-" // copies of renames across branches, within METADIR
 
 // fuse meta files, we might want to hide those
 #define FUSE_META_FILE ".fuse_hidden"
@@ -20,11 +21,17 @@
 // file access protection mask
 #define S_PROT_MASK (S_ISUID| S_ISGID | S_ISVTX | S_IRWXU | S_IRWXG | S_IRWXO)
 
+struct branch_ops;
+
 typedef struct {
 	char *path;
 	int path_len;		// strlen(path)
 	int fd;			 // used to prevent accidental umounts of path
 	unsigned char rw;	 // the writable flag
+	unsigned char immutable; // read-only and never modified while we are mounted
+	unsigned char memory;	 // rw-branch kept in memory, path is the spill directory
+	const struct branch_ops *ops; // the backend serving this branch
+	void *priv;		 // data of the backend
 } branch_entry_t;
 
 #endif
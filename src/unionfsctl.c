@@ -5,10 +5,87 @@
 #include <errno.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <strings.h>
 
 #include "uioctl.h"
 
 
+/**
+ * Parse a branch mode as given to unionfs
+ */
+static int parse_mode(const char *mode) {
+	if (strcasecmp(mode, "ro") == 0) return UNIONFS_BRANCH_RO;
+	if (strcasecmp(mode, "rw") == 0) return UNIONFS_BRANCH_RW;
+	if (strcasecmp(mode, "mem") == 0) return UNIONFS_BRANCH_MEM;
+	if (strcasecmp(mode, "immutable") == 0) return UNIONFS_BRANCH_IMMUTABLE;
+
+	fprintf(stderr, "Invalid branch mode %s!\n", mode);
+	exit(1);
+}
+
+/**
+ * Parse "<index>:<rest>", return rest
+ */
+static char *parse_index(char *arg, int32_t *index) {
+	char *end;
+
+	*index = strtol(arg, &end, 10);
+	if (end == arg || *end != ':') {
+		fprintf(stderr, "Invalid argument %s, expected <index>:...\n", arg);
+		exit(1);
+	}
+
+	return end + 1;
+}
+
+/**
+ * Print the records of a UNIONFS_BULK_STAT
+ */
+static void print_records(struct unionfs_bulk_stat *req) {
+	const char *walk = req->buf;
+	uint32_t i;
+
+	for (i = 0; i < req->count; i++) {
+		const struct unionfs_stat_record *rec = (const void *)walk;
+
+		if (rec->error) {
+			printf("%s: %s\n", rec->name, strerror(rec->error));
+		} else {
+			printf("%06o %u %u %u %llu %lld %d %s\n", rec->mode, rec->nlink,
+				rec->uid, rec->gid, (unsigned long long)rec->size,
+				(long long)rec->mtime, rec->branch, rec->name);
+		}
+
+		walk += rec->reclen;
+	}
+}
+
+/**
+ * Stat the names of req in as few ioctls as possible
+ */
+static void bulk_stat(int fd, struct unionfs_bulk_stat *req, uint32_t count) {
+	// the names of the next call, req gets the records
+	char names[sizeof(req->buf)];
+	memcpy(names, req->buf, sizeof(names));
+	const char *next = names;
+
+	while (count) {
+		memcpy(req->buf, next, names + sizeof(names) - next);
+		req->flags = 0;
+		req->count = count;
+
+		if (ioctl(fd, UNIONFS_BULK_STAT, req) == -1) {
+			fprintf(stderr, "bulk-stat ioctl failed: %s\n", strerror(errno));
+			exit(1);
+		}
+		print_records(req);
+
+		uint32_t i;
+		for (i = 0; i < req->count; i++) next += strlen(next) + 1;
+		count -= req->count;
+	}
+}
+
 static void print_help(char* progname) {
 	fprintf(stderr, "Usage:\n");
 	fprintf(stderr, "     %s <parameter1> [<parameter2>] [file-path] \n", progname);
@@ -17,6 +94,23 @@ static void print_help(char* progname) {
 	fprintf(stderr, "       -p </path/to/debug/file>\n");
 	fprintf(stderr, "       -d <on/off>\n");
 	fprintf(stderr, "          Enable or disable debugging.\n");
+	fprintf(stderr, "       -s\n");
+	fprintf(stderr, "          Print statistics of the mount.\n");
+	fprintf(stderr, "       -a <index>:</path/to/branch>[=RO/RW/MEM/immutable]\n");
+	fprintf(stderr, "          Add a branch at index, 0 is the top, -1 the bottom.\n");
+	fprintf(stderr, "       -r <index>\n");
+	fprintf(stderr, "          Remove the branch at index.\n");
+	fprintf(stderr, "       -m <index>:<new index>\n");
+	fprintf(stderr, "          Move the branch at index.\n");
+	fprintf(stderr, "       -t <index>:<RO/RW/immutable>\n");
+	fprintf(stderr, "          Change the mode of the branch at index.\n");
+	fprintf(stderr, "       -l\n");
+	fprintf(stderr, "          List the attributes of all entries of the directory file-path.\n");
+	fprintf(stderr, "       -S <name>\n");
+	fprintf(stderr, "          Print the attributes of name, relative to file-path. May be\n");
+	fprintf(stderr, "          given several times, all names are looked up at once.\n");
+	fprintf(stderr, "       -P\n");
+	fprintf(stderr, "          Read the policy file of the mount again.\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "Example: ");
 	fprintf(stderr, " %s -p /tmp/unionfs-fuse.log -d on /mnt/unionfs/union\n", progname);
@@ -46,7 +140,13 @@ int main(int argc, char **argv) {
 	const char* argument_param;
 	int debug_on_off;
 	int ioctl_res;
-	while ((opt = getopt(argc, argv, "d:p:")) != -1) {
+	struct unionfs_stats stats;
+	struct unionfs_branch branch;
+	int32_t args[2];
+	char *rest;
+	static struct unionfs_bulk_stat bulk, listing;
+	size_t bulk_len = 0;
+	while ((opt = getopt(argc, argv, "a:d:lm:Pp:r:sS:t:")) != -1) {
 		switch (opt) {
 		case 'p':
 			argument_param = optarg;
@@ -96,11 +196,132 @@ int main(int argc, char **argv) {
 				exit(1);
 			}
 			break;
+		case 's':
+			ioctl_res = ioctl(fd, UNIONFS_GET_STATS, &stats);
+			if (ioctl_res == -1) {
+				fprintf(stderr, "stats ioctl failed: %s\n",
+					strerror(errno) );
+				exit(1);
+			}
+
+			printf("symlink_cache_hits %llu\n",
+				(unsigned long long)stats.symlink_cache_hits);
+			printf("symlink_cache_misses %llu\n",
+				(unsigned long long)stats.symlink_cache_misses);
+			printf("dir_cache_hits %llu\n",
+				(unsigned long long)stats.dir_cache_hits);
+			printf("dir_cache_misses %llu\n",
+				(unsigned long long)stats.dir_cache_misses);
+			printf("path_lock_acquired %llu\n",
+				(unsigned long long)stats.path_lock_acquired);
+			printf("path_lock_contended %llu\n",
+				(unsigned long long)stats.path_lock_contended);
+			printf("path_lock_wait_ns %llu\n",
+				(unsigned long long)stats.path_lock_wait_ns);
+			printf("drop_behind_bytes %llu\n",
+				(unsigned long long)stats.drop_behind_bytes);
+			printf("peer_invalidations %llu\n",
+				(unsigned long long)stats.peer_invalidations);
+			break;
+		case 'a':
+			memset(&branch, 0, sizeof(branch));
+			rest = parse_index(optarg, &branch.index);
+
+			char *mode = strrchr(rest, '=');
+			branch.mode = UNIONFS_BRANCH_RO;
+			if (mode) {
+				*mode = '\0';
+				branch.mode = parse_mode(mode + 1);
+			}
+
+			if (rest[0] != '/') {
+				fprintf(stderr, "The branch path has to be absolute!\n");
+				exit(1);
+			}
+
+			if (strlen(rest) >= sizeof(branch.path)) {
+				fprintf(stderr, "Branch path too long!\n");
+				exit(1);
+			}
+			strcpy(branch.path, rest);
+
+			ioctl_res = ioctl(fd, UNIONFS_ADD_BRANCH, &branch);
+			if (ioctl_res == -1) {
+				fprintf(stderr, "add-branch ioctl failed: %s\n",
+					strerror(errno) );
+				exit(1);
+			}
+			break;
+		case 'r':
+			args[0] = atoi(optarg);
+
+			ioctl_res = ioctl(fd, UNIONFS_REMOVE_BRANCH, &args[0]);
+			if (ioctl_res == -1) {
+				fprintf(stderr, "remove-branch ioctl failed: %s\n",
+					strerror(errno) );
+				exit(1);
+			}
+			break;
+		case 'm':
+			rest = parse_index(optarg, &args[0]);
+			args[1] = atoi(rest);
+
+			ioctl_res = ioctl(fd, UNIONFS_MOVE_BRANCH, args);
+			if (ioctl_res == -1) {
+				fprintf(stderr, "move-branch ioctl failed: %s\n",
+					strerror(errno) );
+				exit(1);
+			}
+			break;
+		case 't':
+			rest = parse_index(optarg, &args[0]);
+			args[1] = parse_mode(rest);
+
+			ioctl_res = ioctl(fd, UNIONFS_SET_BRANCH_MODE, args);
+			if (ioctl_res == -1) {
+				fprintf(stderr, "branch-mode ioctl failed: %s\n",
+					strerror(errno) );
+				exit(1);
+			}
+			break;
+		case 'P':
+			ioctl_res = ioctl(fd, UNIONFS_RELOAD_POLICY);
+			if (ioctl_res == -1) {
+				fprintf(stderr, "reload-policy ioctl failed: %s\n",
+					strerror(errno) );
+				exit(1);
+			}
+			break;
+		case 'l':
+			memset(&listing, 0, sizeof(listing));
+			listing.flags = UNIONFS_BULK_DIR;
+			do {
+				listing.count = 0;
+				ioctl_res = ioctl(fd, UNIONFS_BULK_STAT, &listing);
+				if (ioctl_res == -1) {
+					fprintf(stderr, "bulk-stat ioctl failed: %s\n",
+						strerror(errno) );
+					exit(1);
+				}
+				print_records(&listing);
+			} while (listing.offset);
+			break;
+		case 'S':
+			if (bulk_len + strlen(optarg) + 1 > sizeof(bulk.buf)) {
+				fprintf(stderr, "Too many names given!\n");
+				exit(1);
+			}
+			strcpy(bulk.buf + bulk_len, optarg);
+			bulk_len += strlen(optarg) + 1;
+			bulk.count++;
+			break;
 		default:
 			fprintf(stderr, "Unhandled option %c given.\n", opt);
 			break;
 		}
 	}
 
+	if (bulk_len) bulk_stat(fd, &bulk, bulk.count);
+
 	return 0;
 }
@@ -29,6 +29,8 @@
 #include "general.h"
 #include "findbranch.h"
 #include "string.h"
+#include "cache.h"
+#include "branch.h"
 
 /**
   * If the branch that has the file to be unlinked is in read-only mode,
@@ -60,10 +62,7 @@ static int unlink_ro(const char *path, int branch_ro) {
 static int unlink_rw(const char *path, int branch_rw) {
 	DBG("%s\n", path);
 
-	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[branch_rw].path, path)) RETURN(ENAMETOOLONG);
-
-	int res = unlink(p);
+	int res = branch_unlink(branch_rw, path);
 	if (res == -1) RETURN(errno);
 
 	RETURN(0);
@@ -78,6 +77,8 @@ int unionfs_unlink(const char *path) {
 	int i = find_rorw_branch(path);
 	if (i == -1) RETURN(errno);
 
+	cache_invalidate(path);
+
 	int res;
 	if (!uopt.branches[i].rw) {
 		// read-only branch
@@ -95,5 +96,8 @@ int unionfs_unlink(const char *path) {
 		}
 	}
 
+	// lookups since the invalidation above might have cached path again
+	cache_invalidate(path);
+
 	RETURN(-res);
 }
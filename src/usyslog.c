@@ -13,6 +13,10 @@
  *   calls write without a risk to deadlock into the syslog buffer (chained 
  *   list) and then the seperate syslog_thread call syslog(). That way our
  *   our filesystem thread(s) cannot stall from syslog() calls.
+ *   Hosts might run hundreds of mounts, most of which never log anything,
+ *   so the buffer and the thread are only set up for the first message.
+ *   Threads do not survive fork(), which libfuse does to go into the
+ *   background, so the thread is started again if we are another process.
  */
 
 #include <stdio.h>
@@ -43,6 +47,9 @@ static pthread_cond_t cond_message;		// used to wake up the syslog thread
 static int free_entries;  
 static int used_entries = 0;
 
+static ulogs_t *logs;		// the buffer, allocated on the first message
+static pid_t thread_pid;	// the process the syslog thread runs in
+
 //#define USYSLOG_DEBUG
 
 #ifdef USYSLOG_DEBUG
@@ -172,6 +179,52 @@ static void * syslog_thread(void *arg)
 	return NULL;
 }
 
+/**
+ * Allocate the syslog buffer and start the syslog thread, if not done yet
+ * by this process. Called with list_lock held. If this fails, messages are
+ * dropped as if the buffer was full, we cannot abort anymore.
+ */
+static void start_syslog(void)
+{
+	static int t_arg = 0; // thread argument, not required for us
+
+	pid_t pid = getpid();
+	if (thread_pid == pid) return;
+
+	if (logs == NULL) {
+		logs = calloc(MAX_SYSLOG_MESSAGES, sizeof(ulogs_t));
+		if (logs == NULL) {
+			DBG("Log initialization failed: %s\n", strerror(errno));
+			return;
+		}
+
+		int i;
+		for (i = 0; i < MAX_SYSLOG_MESSAGES; i++) {
+			logs[i].used = false;
+			pthread_mutex_init(&logs[i].lock, NULL);
+			logs[i].next = (i + 1 < MAX_SYSLOG_MESSAGES) ? &logs[i + 1] : NULL;
+		}
+
+		free_head = logs;
+		free_bottom = &logs[MAX_SYSLOG_MESSAGES - 1];
+		free_entries = MAX_SYSLOG_MESSAGES;
+	}
+
+	// only tried once per process
+	thread_pid = pid;
+
+	pthread_t thread;
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	int res = pthread_create(&thread, &attr, syslog_thread, (void *) &t_arg);
+	if (res != 0) {
+		// the buffer fills up and further messages are dropped
+		DBG("Failed to initialize the syslog threads: %s\n", strerror(res));
+	}
+	pthread_attr_destroy(&attr);
+}
+
 /**
  * usyslog - function to be called if something shall be logged to syslog
  */
@@ -183,6 +236,8 @@ void usyslog(int priority, const char *format, ...)
 	// Lock the entire list first, which means the syslog thread MUST NOT
 	// lock it if there is any chance it might be locked forever.
 	pthread_mutex_lock(&list_lock);
+
+	start_syslog();
 	
 	// Some sanity checks. If we fail here, we will leak a log entry,
 	// but will not lock up.
@@ -259,44 +314,4 @@ void init_syslog(void)
 
 	pthread_mutex_init(&list_lock, NULL);
 	pthread_cond_init(&cond_message, NULL);
-	pthread_t thread;
-	pthread_attr_t attr;
-	int t_arg = 0; // thread argument, not required for us
-
-	int i;
-	ulogs_t *log, *last = NULL;
-	for (i = 0; i < MAX_SYSLOG_MESSAGES; i++) {
-		log = malloc(sizeof(ulogs_t));
-		if (log == NULL) {
-			fprintf(stderr, "\nLog initialization failed: %s\n", strerror(errno));
-			fprintf(stderr, "Aborting!\n");
-			// Still initialazation phase, we can abort.
-			exit (1);	
-		}
-
-		log->used = false;
-		pthread_mutex_init(&log->lock, NULL);
-		
-		if (last) {
-			last->next = log;
-		} else {
-			// so the very first entry
-			free_head = log;
-		}
-		last = log;
-	}
-	last->next = NULL;
-	free_bottom = last;
-	
-	free_entries = MAX_SYSLOG_MESSAGES;
-
-	pthread_attr_init(&attr);
-	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-	int res = pthread_create(&thread, &attr, syslog_thread, (void *) &t_arg);
-	if (res != 0) {
-		fprintf(stderr, "Failed to initialize the syslog threads: %s\n",
-			strerror(res));
-		exit(1);
-	}
 }
-
@@ -0,0 +1,361 @@
+/*
+*  C Implementation: xattr_cache
+*
+* Description: Cache of getxattr() and listxattr() results
+*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*
+*
+* Details:
+*	On every write the kernel asks for "security.capability" and almost
+*	always gets ENODATA, which costs us a full branch lookup plus a
+*	lgetxattr(). So we remember per path the values and also the
+*	"no such attribute" answers (negative entries). Entries are dropped
+*	by setxattr(), removexattr(), copy-up and all operations modifying
+*	the path itself.
+*	Writes, truncates and chown() make the kernel remove
+*	security.capability (and only ever remove it). So these only drop the
+*	positive entries of a path, the negative entries stay valid.
+*	If the cache grows too large, it is simply flushed.
+*	Lookups are not path locked, so like in symlink_cache.c, a lookup
+*	only adds its result if no invalidation happened since it started.
+*	Extended attributes belong to the inode, not to the path, so files
+*	with several hard links are not cached at all; a setxattr() through
+*	one name could not drop the entries of the others.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "unionfs.h"
+#include "opts.h"
+#include "debug.h"
+#include "hashtable.h"
+#include "string.h"
+#include "cache.h"
+#include "policy.h"
+#include "branch.h"
+#include "xattr_cache.h"
+
+#define XATTR_CACHE_MAX_PATHS 65536	// flush the cache if it grows larger
+#define XATTR_CACHE_MAX_VALUE 4096	// larger values are not cached
+
+typedef struct xattr_value {
+	char *name;
+	char *value;		// NULL if only the size is known
+	int res;		// size of the value or negative errno
+	struct xattr_value *next;
+} xattr_value_t;
+
+typedef struct {
+	xattr_value_t *values;
+	char *list;		// listxattr() result, NULL if only the size is known
+	int list_res;		// size of list or negative errno
+	bool has_list;		// list_res and list are valid
+} xattr_entry_t;
+
+static struct hashtable *xattrs;	// path -> xattr_entry_t
+static pthread_rwlock_t xattrs_lock = PTHREAD_RWLOCK_INITIALIZER;
+static unsigned int generation;		// increased on every invalidation
+
+void xattr_cache_init(void) {
+	xattrs = cache_create(256);
+}
+
+static void free_values(xattr_entry_t *entry, bool positive_only) {
+	xattr_value_t **pv = &entry->values;
+
+	while (*pv) {
+		xattr_value_t *v = *pv;
+		if (positive_only && v->res < 0) {
+			pv = &v->next;
+			continue;
+		}
+
+		*pv = v->next;
+		free(v->name);
+		free(v->value);
+		free(v);
+	}
+}
+
+static void free_list(xattr_entry_t *entry) {
+	free(entry->list);
+	entry->list = NULL;
+	entry->has_list = false;
+}
+
+static void free_entry(void *data) {
+	xattr_entry_t *entry = data;
+
+	free_values(entry, false);
+	free_list(entry);
+	free(entry);
+}
+
+/**
+ * Get the entry of path, create it if it does not exist yet.
+ * Must be called write-locked.
+ */
+static xattr_entry_t *get_entry(const char *path) {
+	xattr_entry_t *entry = cache_search(xattrs, path);
+	if (entry) return entry;
+
+	if (hashtable_count(xattrs) >= XATTR_CACHE_MAX_PATHS) {
+		DBG("xattr cache full, flushing it\n");
+		cache_flush(xattrs, free_entry);
+	}
+
+	entry = calloc(1, sizeof(xattr_entry_t));
+	if (!entry || !cache_insert(xattrs, path, entry)) {
+		free(entry);
+		return NULL;
+	}
+
+	return entry;
+}
+
+/**
+ * Answer a getxattr() from the cache. Returns true if there was a cache hit,
+ * the result of the getxattr() is then in res.
+ */
+bool xattr_cache_get(const char *path, const char *name, char *value, size_t size, int *res) {
+	if (!uopt.xattr_cache) return false;
+
+	bool hit = false;
+
+	pthread_rwlock_rdlock(&xattrs_lock);
+
+	xattr_entry_t *entry = cache_search(xattrs, path);
+	xattr_value_t *v = entry ? entry->values : NULL;
+	for (; v; v = v->next) {
+		if (strcmp(v->name, name) != 0) continue;
+
+		if (v->res < 0 || size == 0) {
+			*res = v->res;
+			hit = true;
+		} else if (v->value) {
+			if (size < (size_t)v->res) {
+				*res = -ERANGE;
+			} else {
+				memcpy(value, v->value, v->res);
+				*res = v->res;
+			}
+			hit = true;
+		}
+		break;
+	}
+
+	pthread_rwlock_unlock(&xattrs_lock);
+
+	if (hit) DBG("%s: %s cached: %d\n", path, name, *res);
+	return hit;
+}
+
+/**
+ * Get the generation to be given to xattr_cache_set() and
+ * xattr_cache_list_set() later on, this has to be called before the
+ * branch lookup.
+ */
+unsigned int xattr_cache_generation(void) {
+	return __sync_fetch_and_add(&generation, 0);
+}
+
+/**
+ * Check if the attributes of path on branch may be cached under path
+ */
+static bool cacheable(int branch, const char *path) {
+	if (policy_of(path) & POLICY_NOCACHE) return false;
+
+	struct stat st;
+	if (branch_lstat(branch, path, &st)) return false;
+
+	return S_ISDIR(st.st_mode) || st.st_nlink <= 1;
+}
+
+/**
+ * Remember the result of a getxattr(path, name, value, size) on branch
+ */
+void xattr_cache_set(const char *path, int branch, const char *name, const char *value, size_t size, int res, unsigned int gen) {
+	if (!uopt.xattr_cache || res > XATTR_CACHE_MAX_VALUE) return;
+	if (!cacheable(branch, path)) return;
+
+	pthread_rwlock_wrlock(&xattrs_lock);
+
+	// an invalidation in the mean time, our result might be outdated
+	if (gen != generation) goto out;
+
+	xattr_entry_t *entry = get_entry(path);
+	if (!entry) goto out;
+
+	xattr_value_t *v;
+	for (v = entry->values; v; v = v->next) {
+		if (strcmp(v->name, name) == 0) break;
+	}
+
+	if (!v) {
+		v = calloc(1, sizeof(xattr_value_t));
+		if (!v) goto out;
+		v->name = strdup(name);
+		if (!v->name) {
+			free(v);
+			goto out;
+		}
+		v->next = entry->values;
+		entry->values = v;
+	}
+
+	free(v->value);
+	v->value = NULL;
+	v->res = res;
+	if (res > 0 && size > 0) {
+		v->value = malloc(res);
+		if (v->value) memcpy(v->value, value, res);
+	} else if (res == 0 && size > 0) {
+		v->value = strdup(""); // empty, but known value
+	}
+
+out:
+	pthread_rwlock_unlock(&xattrs_lock);
+}
+
+/**
+ * Answer a listxattr() from the cache. Returns true on a cache hit.
+ */
+bool xattr_cache_list_get(const char *path, char *list, size_t size, int *res) {
+	if (!uopt.xattr_cache) return false;
+
+	bool hit = false;
+
+	pthread_rwlock_rdlock(&xattrs_lock);
+
+	xattr_entry_t *entry = cache_search(xattrs, path);
+	if (entry && entry->has_list) {
+		if (entry->list_res < 0 || size == 0) {
+			*res = entry->list_res;
+			hit = true;
+		} else if (entry->list) {
+			if (size < (size_t)entry->list_res) {
+				*res = -ERANGE;
+			} else {
+				memcpy(list, entry->list, entry->list_res);
+				*res = entry->list_res;
+			}
+			hit = true;
+		}
+	}
+
+	pthread_rwlock_unlock(&xattrs_lock);
+
+	if (hit) DBG("%s: list cached: %d\n", path, *res);
+	return hit;
+}
+
+/**
+ * Remember the result of a listxattr(path, list, size) on branch
+ */
+void xattr_cache_list_set(const char *path, int branch, const char *list, size_t size, int res, unsigned int gen) {
+	if (!uopt.xattr_cache || res > XATTR_CACHE_MAX_VALUE) return;
+	if (!cacheable(branch, path)) return;
+
+	pthread_rwlock_wrlock(&xattrs_lock);
+
+	if (gen != generation) goto out;
+
+	xattr_entry_t *entry = get_entry(path);
+	if (!entry) goto out;
+
+	free_list(entry);
+	entry->list_res = res;
+	if (res >= 0 && size > 0) {
+		entry->list = malloc(res + 1);
+		if (entry->list) memcpy(entry->list, list, res);
+	}
+	entry->has_list = true;
+
+out:
+	pthread_rwlock_unlock(&xattrs_lock);
+}
+
+/**
+ * Forget everything about path
+ */
+void xattr_cache_invalidate(const char *path) {
+	if (!uopt.xattr_cache) return;
+
+	pthread_rwlock_wrlock(&xattrs_lock);
+
+	generation++;
+	xattr_entry_t *entry = cache_remove(xattrs, path);
+	if (entry) free_entry(entry);
+
+	pthread_rwlock_unlock(&xattrs_lock);
+}
+
+/**
+ * Forget everything about path and everything below it, e.g. if a directory
+ * got renamed.
+ */
+void xattr_cache_invalidate_tree(const char *path) {
+	if (!uopt.xattr_cache) return;
+
+	pthread_rwlock_wrlock(&xattrs_lock);
+	generation++;
+	cache_remove_tree(xattrs, path, free_entry);
+	pthread_rwlock_unlock(&xattrs_lock);
+}
+
+/**
+ * Forget everything branch might serve, see cache_forget_branch()
+ */
+void xattr_cache_forget_branch(int branch) {
+	if (!uopt.xattr_cache) return;
+
+	pthread_rwlock_wrlock(&xattrs_lock);
+	generation++;
+	cache_remove_branch(xattrs, branch, free_entry);
+	pthread_rwlock_unlock(&xattrs_lock);
+}
+
+/**
+ * The kernel removes security.capability on write, truncate and chown, so
+ * only the negative entries of path stay valid.
+ */
+void xattr_cache_kill_priv(const char *path) {
+	if (!uopt.xattr_cache) return;
+
+	// fast path, in the common case there is nothing positive to forget
+	bool positive = false;
+
+	pthread_rwlock_rdlock(&xattrs_lock);
+
+	xattr_entry_t *entry = cache_search(xattrs, path);
+	if (entry) {
+		xattr_value_t *v;
+		for (v = entry->values; v; v = v->next) {
+			if (v->res >= 0) positive = true;
+		}
+		if (entry->has_list) positive = true;
+	}
+
+	pthread_rwlock_unlock(&xattrs_lock);
+
+	if (!positive) return;
+
+	pthread_rwlock_wrlock(&xattrs_lock);
+
+	generation++;
+	entry = cache_search(xattrs, path);
+	if (entry) {
+		free_values(entry, true);
+		free_list(entry);
+	}
+
+	pthread_rwlock_unlock(&xattrs_lock);
+}
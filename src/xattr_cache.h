@@ -0,0 +1,30 @@
+/*
+* License: BSD-style license
+* Copyright: Radek Podgorny <radek@podgorny.cz>,
+*            Bernd Schubert <bernd-schubert@gmx.de>
+*/
+
+#ifndef XATTR_CACHE_H
+#define XATTR_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <errno.h>
+
+// linux has no ENOATTR, but ENODATA is used for the same purpose
+#ifndef ENOATTR
+#define ENOATTR ENODATA
+#endif
+
+void xattr_cache_init(void);
+bool xattr_cache_get(const char *path, const char *name, char *value, size_t size, int *res);
+unsigned int xattr_cache_generation(void);
+void xattr_cache_set(const char *path, int branch, const char *name, const char *value, size_t size, int res, unsigned int generation);
+bool xattr_cache_list_get(const char *path, char *list, size_t size, int *res);
+void xattr_cache_list_set(const char *path, int branch, const char *list, size_t size, int res, unsigned int generation);
+void xattr_cache_invalidate(const char *path);
+void xattr_cache_invalidate_tree(const char *path);
+void xattr_cache_forget_branch(int branch);
+void xattr_cache_kill_priv(const char *path);
+
+#endif
@@ -6,6 +6,7 @@ import os
 import shutil
 import time
 import tempfile
+import threading
 
 
 def call(cmd):
@@ -179,6 +180,18 @@ class UnionFS_RW_RO_COW_TestCase(Common, unittest.TestCase):
 		self.assertEqual(read_from_file('ro1/ro1_file'), 'ro1')
 		self.assertEqual(read_from_file('rw1/ro1_file'), 'something')
 
+	def test_cow_deferred(self):
+		with open('union/ro1_file', 'r+') as f:
+			self.assertEqual(f.read(), 'ro1')
+			self.assertFalse(os.path.exists('rw1/ro1_file'))
+
+			f.seek(0)
+			f.write('RO1')
+			f.flush()
+			self.assertEqual(read_from_file('rw1/ro1_file'), 'RO1')
+
+		self.assertEqual(read_from_file('ro1/ro1_file'), 'ro1')
+
 	def test_cow_and_whiteout(self):
 		write_to_file('union/ro1_file', 'something')
 		os.remove('union/ro1_file')
@@ -193,6 +206,25 @@ class UnionFS_RW_RO_COW_TestCase(Common, unittest.TestCase):
 		self.assertEqual(read_from_file('rw1/new_file'), 'something')
 		self.assertNotIn('new_file', os.listdir('ro1'))
 
+	def test_link_hardlinked(self):
+		os.link('ro1/ro1_file', 'ro1/ro1_link')
+		os.link('union/ro1_file', 'union/link1')
+		os.link('union/ro1_link', 'union/link2')
+
+		# both names of the lower file share a single copy
+		self.assertEqual(os.stat('rw1/link1').st_ino, os.stat('rw1/link2').st_ino)
+		self.assertEqual(read_from_file('union/link2'), 'ro1')
+
+	def test_link_hardlinked_modified(self):
+		os.link('ro1/ro1_file', 'ro1/ro1_link')
+		os.link('union/ro1_file', 'union/link1')
+		write_to_file('union/ro1_file', 'changed')
+		os.link('union/ro1_link', 'union/link2')
+
+		# the copy was modified, so the other name gets a copy of its own
+		self.assertNotEqual(os.stat('rw1/link1').st_ino, os.stat('rw1/link2').st_ino)
+		self.assertEqual(read_from_file('union/link2'), 'ro1')
+
 	def test_rename(self):
 		os.rename('union/rw1_file', 'union/rw1_file_renamed')
 		self.assertEqual(read_from_file('union/rw1_file_renamed'), 'rw1')
@@ -275,6 +307,47 @@ class UnionFS_RW_RO_COW_TestCase(Common, unittest.TestCase):
 			self.assertNotEqual(get_dir_contents(union), get_dir_contents(cow_path))
 
 
+class RenameAcross_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		# as left behind by a crash in the middle of a rename
+		os.makedirs('rw1/.unionfs/.unionfs-rename-%d-1' % self.dead_pid())
+		call('%s -o cow rw1=rw:ro1=ro union' % self.unionfs_path)
+
+	def dead_pid(self):
+		pid = subprocess.Popen('true')
+		pid.wait()
+		return pid.pid
+
+	def test_leftovers(self):
+		self.assertEqual(os.listdir('rw1/.unionfs'), [])
+
+	def test_hidden_copy(self):
+		os.makedirs('ro1/dir/sub')
+		os.rename('union/dir', 'union/dir_renamed')
+		self.assertTrue(os.path.isdir('union/dir_renamed/sub'))
+		for d in ['union', 'rw1']:
+			self.assertFalse([n for n in os.listdir(d) if n.startswith('.unionfs-rename-')])
+		self.assertFalse([n for n in os.listdir('rw1/.unionfs') if n.startswith('.unionfs-rename-')])
+
+
+class RenameCopy_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		os.mkdir('spill')
+		os.mkdir('rw1/dir')
+		# a memory branch can not rename() into a directory, so this copies
+		call('%s -o cow spill=mem:rw1=rw union' % self.unionfs_path)
+
+	def test_rename_copy(self):
+		write_to_file('union/new_file', 'something')
+		os.rename('union/new_file', 'union/dir/new_file')
+		self.assertEqual(read_from_file('union/dir/new_file'), 'something')
+		self.assertEqual(read_from_file('rw1/dir/new_file'), 'something')
+		self.assertNotIn('new_file', os.listdir('union'))
+		self.assertFalse([n for n in os.listdir('rw1/.unionfs') if n.startswith('.unionfs-rename-')])
+
+
 class UnionFS_RO_RW_TestCase(Common, unittest.TestCase):
 	def setUp(self):
 		super().setUp()
@@ -348,6 +421,43 @@ class UnionFS_RO_RW_COW_TestCase(Common, unittest.TestCase):
 		#self.assertEqual(read_from_file('union/common_file_renamed'), 'rw1')
 
 
+class UnionFS_RW_RW_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		call('%s -o cow rw1=rw:rw2=rw union' % self.unionfs_path)
+
+	def test_rename_across(self):
+		os.mkdir('rw1/dir')
+		os.rename('union/rw2_file', 'union/dir/rw2_file')
+		self.assertEqual(read_from_file('union/dir/rw2_file'), 'rw2')
+		self.assertNotIn('rw2_file', os.listdir('union'))
+		self.assertFalse(os.path.exists('rw2/rw2_file'))
+
+	def test_rename_dir_across(self):
+		os.mkdir('rw2/dir')
+		write_to_file('rw2/dir/file', 'something')
+		os.mkdir('rw1/dest')
+		os.rename('union/dir', 'union/dest/dir')
+		self.assertEqual(read_from_file('union/dest/dir/file'), 'something')
+		self.assertNotIn('dir', os.listdir('union'))
+
+
+class HideMeta_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		write_to_file('ro1/editor.swp', 'ro1')
+		call('%s -o cow,hide_patterns=/.unionfs:*.swp rw1=rw:ro1=ro union' % self.unionfs_path)
+
+	def test_hidden(self):
+		os.remove('union/ro1_file')
+		self.assertIn('.unionfs', os.listdir('rw1'))
+
+		lst = ['rw1_file', 'ro_common_file', 'rw_common_file', 'common_file']
+		self.assertEqual(set(lst), set(os.listdir('union')))
+		self.assertFalse(os.path.exists('union/editor.swp'))
+		self.assertFalse(os.path.exists('union/.unionfs'))
+
+
 @unittest.skipIf(os.environ.get('RUNNING_ON_TRAVIS_CI'), 'Not supported on Travis')
 class IOCTL_TestCase(Common, unittest.TestCase):
 	def setUp(self):
@@ -375,6 +485,376 @@ class IOCTL_TestCase(Common, unittest.TestCase):
 		self.assertEqual(ex.returncode, 1)
 		self.assertEqual(ex.output, b'')
 
+	def test_bulk_stat(self):
+		out = call('%s -S common_file -S ro1_file -S missing union' % self.unionfsctl_path).decode().splitlines()
+		self.assertRegex(out[0], r' 3 [0-9]+ 0 common_file$')
+		self.assertRegex(out[1], r' 3 [0-9]+ 1 ro1_file$')
+		self.assertRegex(out[2], 'missing: ')
+
+		names = [line.split()[-1] for line in call('%s -l union' % self.unionfsctl_path).decode().splitlines()]
+		self.assertEqual(sorted(names), sorted(os.listdir('union')))
+
+	def test_bulk_stat_continued(self):
+		# more records than fit into a single ioctl
+		os.mkdir('rw1/dir')
+		for i in range(500):
+			write_to_file('rw1/dir/file%d' % i, '')
+
+		names = [line.split()[-1] for line in call('%s -l union/dir' % self.unionfsctl_path).decode().splitlines()]
+		self.assertEqual(sorted(names), sorted(os.listdir('union/dir')))
+
+
+class SymlinkCache_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		os.symlink('ro1_file', 'ro1/link')
+		call('%s -o cow,symlink_cache,prewarm rw1=rw:ro1=immutable union' % self.unionfs_path)
+
+	def test_readlink(self):
+		self.assertEqual(os.readlink('union/link'), 'ro1_file')
+		self.assertEqual(os.readlink('union/link'), 'ro1_file')
+
+	def test_replace(self):
+		self.assertEqual(os.readlink('union/link'), 'ro1_file')
+		os.remove('union/link')
+		with self.assertRaises(FileNotFoundError):
+			os.readlink('union/link')
+		os.symlink('rw1_file', 'union/link')
+		self.assertEqual(os.readlink('union/link'), 'rw1_file')
+
+	@unittest.skipIf(os.environ.get('RUNNING_ON_TRAVIS_CI'), 'Not supported on Travis')
+	def test_stats(self):
+		os.readlink('union/link')
+		stats = call('%s -s union' % self.unionfsctl_path).decode()
+		self.assertRegex(stats, 'symlink_cache_hits [0-9]+')
+		self.assertRegex(stats, 'symlink_cache_misses [0-9]+')
+		self.assertRegex(stats, 'path_lock_contended [0-9]+')
+
+
+class XattrCache_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		call('%s -o cow,xattr_cache rw1=rw:ro1=ro union' % self.unionfs_path)
+
+	@unittest.skipIf(not shutil.which('setfacl'), 'setfacl is missing')
+	def test_chmod_acl(self):
+		call('setfacl -m u:nobody:rw union/rw1_file')
+		before = os.getxattr('union/rw1_file', 'system.posix_acl_access')
+		os.chmod('union/rw1_file', 0o600)
+		after = os.getxattr('union/rw1_file', 'system.posix_acl_access')
+		self.assertNotEqual(before, after)
+		self.assertEqual(after, os.getxattr('rw1/rw1_file', 'system.posix_acl_access'))
+
+	def test_hardlink(self):
+		with self.assertRaises(OSError):
+			os.getxattr('union/rw1_file', 'user.test')
+		os.link('union/rw1_file', 'union/rw1_link')
+		os.setxattr('union/rw1_link', 'user.test', b'value')
+		self.assertEqual(os.getxattr('union/rw1_file', 'user.test'), b'value')
+
+
+class DirCache_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		call('%s -o cow,dir_cache rw1=rw:ro1=ro union' % self.unionfs_path)
+
+	def test_lookup(self):
+		os.listdir('union')
+		self.assertFalse(os.path.exists('union/missing'))
+		self.assertEqual(read_from_file('union/ro1_file'), 'ro1')
+
+		write_to_file('union/missing', 'new')
+		self.assertEqual(read_from_file('union/missing'), 'new')
+		os.remove('union/ro1_file')
+		self.assertFalse(os.path.exists('union/ro1_file'))
+
+		stats = call('%s -s union' % self.unionfsctl_path).decode()
+		self.assertRegex(stats, 'dir_cache_hits [1-9][0-9]*')
+
+
+class DropBehind_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		write_to_file('ro1/big', 'x' * (16 << 20))
+		call('%s -o drop_behind rw1=rw:ro1=ro union' % self.unionfs_path)
+
+	def test_stream(self):
+		self.assertEqual(len(read_from_file('union/big')), 16 << 20)
+		stats = call('%s -s union' % self.unionfsctl_path).decode()
+		self.assertRegex(stats, 'drop_behind_bytes [1-9][0-9]*')
+
+
+class Trace_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		call('%s -o trace=manifest,prefetch=manifest,trace_time=1 rw1=rw:ro1=ro union' % self.unionfs_path)
+
+	def test_manifest(self):
+		self.assertEqual(read_from_file('union/ro1_file'), 'ro1')
+		self.assertEqual(read_from_file('union/rw1_file'), 'rw1')
+		time.sleep(2)
+		self.assertEqual(read_from_file('manifest'), '/ro1_file\t0-3\n')
+
+
+class Peers_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		os.mkdir('union2')
+		call('%s -o cow,dir_cache,peers=log rw1=rw:ro1=ro union' % self.unionfs_path)
+		call('%s -o cow,dir_cache,peers=log rw1=rw:ro1=ro union2' % self.unionfs_path)
+
+	def tearDown(self):
+		call('fusermount -u union2')
+		super().tearDown()
+
+	def test_create(self):
+		self.assertFalse(os.path.exists('union/new_file'))
+		write_to_file('union2/new_file', 'new')
+		time.sleep(0.5)
+		self.assertEqual(read_from_file('union/new_file'), 'new')
+		stats = call('%s -s union' % self.unionfsctl_path).decode()
+		self.assertRegex(stats, 'peer_invalidations [1-9][0-9]*')
+
+
+class Policy_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		os.mkdir('ro1/eager')
+		write_to_file('ro1/eager/file', 'ro1')
+		write_to_file('policy', '# test\n/eager cow=open\n/ro1_file direct_io\n')
+		call('%s -o cow,policy=policy rw1=rw:ro1=ro union' % self.unionfs_path)
+
+	def test_cow_open(self):
+		with open('union/eager/file', 'r+'):
+			self.assertTrue(os.path.isfile('rw1/eager/file'))
+		with open('union/ro1_file', 'r+'):
+			self.assertFalse(os.path.isfile('rw1/ro1_file'))
+		self.assertEqual(read_from_file('union/ro1_file'), 'ro1')
+
+	def test_reload(self):
+		write_to_file('policy', '/eager nonsense\n')
+		with self.assertRaises(subprocess.CalledProcessError):
+			call('%s -P union 2>/dev/null' % self.unionfsctl_path)
+
+		write_to_file('policy', '/ cow=open\n')
+		call('%s -P union' % self.unionfsctl_path)
+		with open('union/ro1_file', 'r+'):
+			self.assertTrue(os.path.isfile('rw1/ro1_file'))
+
+
+class PathLock_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		for i in range(50):
+			os.mkdir('ro1/dir%d' % i)
+			write_to_file('ro1/dir%d/file' % i, 'ro1')
+		call('%s -o cow rw1=rw:ro1=ro union' % self.unionfs_path)
+
+	def test_rename_during_copy_up(self):
+		for i in range(50):
+			def copy_up():
+				with open('union/dir%d/file' % i, 'a') as f:
+					f.write('x')
+
+			t = threading.Thread(target=copy_up)
+			t.start()
+			try:
+				os.rename('union/dir%d' % i, 'union/renamed%d' % i)
+			finally:
+				t.join()
+
+			# the copy-up must not bring back the old directory
+			self.assertFalse(os.path.exists('union/dir%d' % i))
+			self.assertTrue(os.path.isfile('union/renamed%d/file' % i))
+
+
+class Reconf_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		call('%s -o cow rw1=rw:ro1=ro union' % self.unionfs_path)
+
+	def test_add_remove(self):
+		call('%s -a 1:%s=ro union' % (self.unionfsctl_path, os.path.abspath('ro2')))
+		self.assertEqual(read_from_file('union/ro_common_file'), 'ro2')
+		self.assertIn('ro2_file', os.listdir('union'))
+
+		call('%s -r 1 union' % self.unionfsctl_path)
+		self.assertEqual(read_from_file('union/ro_common_file'), 'ro1')
+		self.assertNotIn('ro2_file', os.listdir('union'))
+
+	def test_move(self):
+		call('%s -m 1:0 union' % self.unionfsctl_path)
+		self.assertEqual(read_from_file('union/common_file'), 'ro1')
+
+	def test_mode(self):
+		call('%s -t 0:ro union' % self.unionfsctl_path)
+		with self.assertRaises(OSError):
+			write_to_file('union/new_file', 'something')
+
+	def test_open_file(self):
+		with open('union/ro1_file', 'r') as f:
+			call('%s -r 1 union' % self.unionfsctl_path)
+			self.assertEqual(f.read(), 'ro1')
+		self.assertFalse(os.path.exists('union/ro1_file'))
+
+	def test_add_immutable(self):
+		os.mkdir('union2')
+		call('%s ro1=immutable union2' % self.unionfs_path)
+		try:
+			self.assertEqual(read_from_file('union2/ro_common_file'), 'ro1')
+			# the kernel must not keep the page cache of the file of ro1
+			call('%s -a 0:%s=immutable union2' % (self.unionfsctl_path, os.path.abspath('ro2')))
+			self.assertEqual(read_from_file('union2/ro_common_file'), 'ro2')
+		finally:
+			call('fusermount -u union2')
+
+
+class Squash_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		self.squash_path = os.path.abspath('%s/src/unionfssquash' % self.original_cwd)
+
+	def tearDown(self):
+		# nothing is mounted here
+		os.chdir(self.original_cwd)
+		shutil.rmtree(self.tmpdir)
+
+	def test_squash(self):
+		os.makedirs('rw1/.unionfs')
+		write_to_file('rw1/.unionfs/ro1_file_HIDDEN~', '')
+		os.makedirs('ro1/dir/subdir')
+		write_to_file('ro1/dir/subdir/file', 'ro1')
+		os.link('ro2/ro2_file', 'ro2/ro2_file_link')
+
+		call('%s rw1=rw:ro1=ro:ro2=ro squashed' % self.squash_path)
+
+		lst = ['rw1_file', 'ro2_file', 'ro2_file_link', 'rw_common_file', 'ro_common_file', 'common_file', 'dir']
+		self.assertEqual(set(lst), set(os.listdir('squashed')))
+		self.assertEqual(read_from_file('squashed/common_file'), 'rw1')
+		self.assertEqual(read_from_file('squashed/ro_common_file'), 'ro1')
+		self.assertEqual(read_from_file('squashed/dir/subdir/file'), 'ro1')
+		self.assertEqual(os.stat('squashed/ro2_file').st_ino, os.stat('squashed/ro2_file_link').st_ino)
+
+	def test_image(self):
+		os.makedirs('ro1/dir/subdir')
+		write_to_file('ro1/dir/subdir/file', 'ro1')
+		os.symlink('../ro1_file', 'ro1/dir/link')
+
+		call('%s -i rw1=rw:ro1=ro layer.img' % self.squash_path)
+		# the image itself can be a branch, so squash it again
+		call('%s layer.img=ro squashed' % self.squash_path)
+
+		lst = ['rw1_file', 'ro1_file', 'rw_common_file', 'ro_common_file', 'common_file', 'dir']
+		self.assertEqual(set(lst), set(os.listdir('squashed')))
+		self.assertEqual(read_from_file('squashed/common_file'), 'rw1')
+		self.assertEqual(read_from_file('squashed/dir/subdir/file'), 'ro1')
+		self.assertEqual(os.readlink('squashed/dir/link'), '../ro1_file')
+
+
+class Image_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		squash_path = os.path.abspath('%s/src/unionfssquash' % self.original_cwd)
+		call('%s -i ro1=ro ro1.img' % squash_path)
+		call('%s -o cow rw1=rw:ro1.img=ro union' % self.unionfs_path)
+
+	def test_listing(self):
+		lst = ['ro1_file', 'rw1_file', 'ro_common_file', 'rw_common_file', 'common_file']
+		self.assertEqual(set(lst), set(os.listdir('union')))
+
+	def test_read(self):
+		self.assertEqual(read_from_file('union/ro1_file'), 'ro1')
+		self.assertEqual(read_from_file('union/common_file'), 'rw1')
+
+	def test_cow(self):
+		write_to_file('union/ro1_file', 'changed')
+		self.assertEqual(read_from_file('union/ro1_file'), 'changed')
+		self.assertEqual(read_from_file('rw1/ro1_file'), 'changed')
+
+
+class Index_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		os.mkdir('index')
+		os.mkdir('ro1/dir')
+		call('%s -o cow,index_dir=index rw1=rw:ro1=immutable union' % self.unionfs_path)
+
+	def test_shared(self):
+		self.assertEqual(len(os.listdir('index')), 1)
+		os.mkdir('union2')
+		call('%s -o index_dir=index ro1=immutable union2' % self.unionfs_path)
+		try:
+			self.assertEqual(len(os.listdir('index')), 1)
+			self.assertEqual(read_from_file('union2/ro1_file'), 'ro1')
+		finally:
+			call('fusermount -u union2')
+
+	def test_cow(self):
+		self.assertEqual(read_from_file('union/ro1_file'), 'ro1')
+		write_to_file('union/ro1_file', 'changed')
+		self.assertEqual(read_from_file('rw1/ro1_file'), 'changed')
+
+	def test_rebuild(self):
+		write_to_file('ro1/dir/new_file', 'new')
+		os.mkdir('union2')
+		call('%s -o index_dir=index ro1=immutable union2' % self.unionfs_path)
+		try:
+			self.assertEqual(len(os.listdir('index')), 1)
+			self.assertEqual(read_from_file('union2/dir/new_file'), 'new')
+		finally:
+			call('fusermount -u union2')
+
+
+class MemBranch_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		os.mkdir('spill')
+		call('%s -o cow,mem_spill=4k spill=mem:ro1=ro union' % self.unionfs_path)
+
+	def test_listing(self):
+		lst = ['ro1_file', 'ro_common_file', 'common_file']
+		self.assertEqual(set(lst), set(os.listdir('union')))
+
+	def test_write_new(self):
+		write_to_file('union/new_file', 'something')
+		self.assertEqual(read_from_file('union/new_file'), 'something')
+		self.assertEqual(os.listdir('spill'), [])
+
+	def test_cow_and_whiteout(self):
+		write_to_file('union/ro1_file', 'something')
+		self.assertEqual(read_from_file('union/ro1_file'), 'something')
+		self.assertEqual(read_from_file('ro1/ro1_file'), 'ro1')
+
+		os.remove('union/ro1_file')
+		self.assertNotIn('ro1_file', os.listdir('union'))
+
+	def test_spill(self):
+		data = 'x' * 100000
+		write_to_file('union/big_file', data)
+		self.assertEqual(read_from_file('union/big_file'), data)
+
+	def test_rename(self):
+		os.mkdir('union/dir')
+		write_to_file('union/dir/file', 'something')
+		os.rename('union/dir', 'union/dir_renamed')
+		self.assertEqual(read_from_file('union/dir_renamed/file'), 'something')
+
+	def test_reuse(self):
+		# memory of removed files has to be usable by files of any size
+		os.mkdir('spill2')
+		os.mkdir('union2')
+		call('%s -o mem_size=4m,mem_spill=1m spill2=mem union2' % self.unionfs_path)
+		try:
+			for i in range(3):
+				write_to_file('union2/big_file%d' % i, 'x' * (1 << 20))
+			for i in range(3):
+				os.remove('union2/big_file%d' % i)
+			for i in range(1000):
+				write_to_file('union2/small_file%d' % i, 'small')
+			self.assertEqual(read_from_file('union2/small_file999'), 'small')
+		finally:
+			call('fusermount -u union2')
+
 
 if __name__ == '__main__':
 	unittest.main()
@@ -0,0 +1,85 @@
+#!/usr/bin/python3
+
+# Page cache footprint of a branch file read through the union, with and
+# without -o drop_behind. Reads a large file of a ro branch once per mount
+# and prints how much of the branch file stays resident, using mincore().
+#
+#	tests/drop_behind.py [size in MB] [path of unionfs]
+
+import ctypes
+import ctypes.util
+import mmap
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+
+libc = ctypes.CDLL(ctypes.util.find_library('c'), use_errno=True)
+libc.mincore.argtypes = [ctypes.c_void_p, ctypes.c_size_t, ctypes.POINTER(ctypes.c_ubyte)]
+
+
+def resident(path):
+	"""Bytes of path in the page cache"""
+	size = os.path.getsize(path)
+	pages = (size + mmap.PAGESIZE - 1) // mmap.PAGESIZE
+
+	with open(path, 'rb') as f:
+		# a private mapping, ctypes can only take the address of writable ones
+		m = mmap.mmap(f.fileno(), size, access=mmap.ACCESS_COPY)
+		view = (ctypes.c_ubyte * 1).from_buffer(m)
+		try:
+			vec = (ctypes.c_ubyte * pages)()
+			if libc.mincore(ctypes.addressof(view), size, vec) != 0:
+				raise OSError(ctypes.get_errno(), 'mincore')
+			return sum(v & 1 for v in vec) * mmap.PAGESIZE
+		finally:
+			del view
+			m.close()
+
+
+def drop_cache(path):
+	with open(path, 'rb') as f:
+		os.posix_fadvise(f.fileno(), 0, 0, os.POSIX_FADV_DONTNEED)
+
+
+def measure(unionfs, tmpdir, opts):
+	big = os.path.join(tmpdir, 'ro', 'big')
+	union = os.path.join(tmpdir, 'union')
+
+	drop_cache(big)
+	subprocess.check_call([unionfs] + opts + ['%s/rw=rw:%s/ro=ro' % (tmpdir, tmpdir), union])
+	try:
+		with open(os.path.join(union, 'big'), 'rb') as f:
+			while f.read(1 << 20):
+				pass
+		return resident(big)
+	finally:
+		subprocess.check_call(['fusermount', '-u', union])
+
+
+def main():
+	size = int(sys.argv[1]) if len(sys.argv) > 1 else 256
+	unionfs = os.path.abspath(sys.argv[2] if len(sys.argv) > 2 else 'src/unionfs')
+
+	tmpdir = tempfile.mkdtemp()
+	try:
+		for d in ['ro', 'rw', 'union']:
+			os.mkdir(os.path.join(tmpdir, d))
+
+		with open(os.path.join(tmpdir, 'ro', 'big'), 'wb') as f:
+			chunk = b'x' * (1 << 20)
+			for i in range(size):
+				f.write(chunk)
+			f.flush()
+			os.fsync(f.fileno())
+
+		for name, opts in [('default', []), ('drop_behind', ['-o', 'drop_behind'])]:
+			res = measure(unionfs, tmpdir, opts)
+			print('%-12s read %d MB, branch file resident %.1f MB' % (name, size, res / (1 << 20)))
+	finally:
+		shutil.rmtree(tmpdir)
+
+
+if __name__ == '__main__':
+	main()